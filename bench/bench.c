@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "neural_network.h"
+#include "neural_network_elite.h"
+#include "neural_network_pool.h"
+#include "neural_network_perf.h"
+#include "neural_network_accum.h"
+#include "neural_network_numa.h"
+#include "neural_network_util.h"
+
+typedef struct {
+	const char *name;
+	int n_input;
+	int n_output;
+	int n_hidden;
+	int n_neuro_per_hidden;
+	int quick;	/* Run with -q */
+} BenchTopology;
+
+typedef struct {
+	NeuralNetwork *nn;
+	NeuralNetwork *a;
+	NeuralNetwork *b;
+	NeuralNetwork *dst;
+	float *input;
+	float *expect;
+	FILE *f;
+	NNEliteList list;
+	NNPool pool;
+	NNAccumulator acc;
+	NeuralNetwork *local;	/* Placed on the node the benchmark runs on */
+	NeuralNetwork *remote;	/* Placed on the farthest node, the same as local without NUMA */
+	volatile int index;	/* Keeps the argmax from being optimized out */
+} BenchContext;
+
+typedef struct {
+	const char *name;
+	void (*func)(BenchContext *ctx);
+	double flop_per_weight;	/* FLOP of one op per weight */
+} BenchOp;
+
+typedef struct {
+	char op[64];
+	char topology[64];
+	double ns_per_op;
+} BenchBaseline;
+
+void print_help(const char *argv0);
+double now_ns(void);
+void bench_op_run(BenchContext *ctx);
+void bench_op_train(BenchContext *ctx);
+void bench_op_produce(BenchContext *ctx);
+void bench_op_produce_into(BenchContext *ctx);
+void bench_op_randomize(BenchContext *ctx);
+void bench_op_randomize_by_rate(BenchContext *ctx);
+void bench_op_plus_randomize_by_rate(BenchContext *ctx);
+void bench_op_save_load(BenchContext *ctx);
+void bench_op_elites_add_pick(BenchContext *ctx);
+void bench_op_accum_update(BenchContext *ctx);
+void bench_op_run_numa_local(BenchContext *ctx);
+void bench_op_run_numa_remote(BenchContext *ctx);
+void bench_op_find_most_possible(BenchContext *ctx);
+void bench_op_find_most_possible_scalar(BenchContext *ctx);
+int bench_context_init(BenchContext *ctx, const BenchTopology *t);
+void bench_context_free(BenchContext *ctx);
+double bench_measure(const BenchOp *op,
+		BenchContext *ctx,
+		double min_time,
+		long *iterations,
+		NNPerfCounters *pc,
+		unsigned long long *counter);
+void print_counters(NNPerfCounters *pc, unsigned long long *counter, long iterations, double flops);
+int load_baseline(const char *file_name, BenchBaseline **baseline);
+const BenchBaseline *find_baseline(const BenchBaseline *baseline, int n, const char *op, const char *topology);
+
+static const BenchTopology topologies[] = {
+	{"2-2-1",		2,	1,	1,	2,	1},
+	{"16-32-4",		16,	4,	1,	32,	1},
+	{"64-128x2-10",		64,	10,	2,	128,	1},
+	{"256-512x2-10",	256,	10,	2,	512,	1},
+	{"1024-1024x2-16",	1024,	16,	2,	1024,	0},
+	{"4096-4096-16",	4096,	16,	1,	4096,	0},
+};
+
+static const BenchOp ops[] = {
+	{"run",				bench_op_run,				2},
+	{"train",			bench_op_train,				6},
+	{"produce",			bench_op_produce,			0},
+	{"produce_into",		bench_op_produce_into,			0},
+	{"randomize",			bench_op_randomize,			0},
+	{"randomize_by_rate",		bench_op_randomize_by_rate,		0},
+	{"plus_randomize_by_rate",	bench_op_plus_randomize_by_rate,	0},
+	{"save_load",			bench_op_save_load,			0},
+	{"elites_add_pick",		bench_op_elites_add_pick,		0},
+	{"accum_update",		bench_op_accum_update,			0},
+	{"run_numa_local",		bench_op_run_numa_local,		2},
+	{"run_numa_remote",		bench_op_run_numa_remote,		2},
+	{"find_most_possible",		bench_op_find_most_possible,		0},
+	{"find_most_possible_scalar",	bench_op_find_most_possible_scalar,	0},
+};
+
+void
+print_help(const char *argv0)
+{
+	printf("%s\n"
+			"    -h for help.\n"
+			"    -q to skip the large topologies.\n"
+			"    -t <seconds> to specify the minimum time of each measurement.\n"
+			"    -f <name> to only run the ops or topologies containing name.\n"
+			"    -c <file> to compare with a baseline written by a previous run.\n"
+			"    -r <percent> to specify how much slower than the baseline is a regression.\n"
+			"    -p to read the hardware performance counters too.\n"
+			,
+			argv0);
+}
+
+double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void
+bench_op_run(BenchContext *ctx)
+{
+	nn_run(ctx->nn, ctx->input);
+}
+
+void
+bench_op_train(BenchContext *ctx)
+{
+	nn_train(ctx->nn, ctx->input, ctx->expect, 0.001f);
+}
+
+void
+bench_op_produce(BenchContext *ctx)
+{
+	nn_free(nn_produce(ctx->a, ctx->b));
+}
+
+void
+bench_op_produce_into(BenchContext *ctx)
+{
+	nn_produce_into(ctx->dst, ctx->a, ctx->b);
+}
+
+void
+bench_op_randomize(BenchContext *ctx)
+{
+	nn_randomize(ctx->dst);
+}
+
+void
+bench_op_randomize_by_rate(BenchContext *ctx)
+{
+	nn_randomize_by_rate(ctx->dst, 0.01f);
+}
+
+void
+bench_op_plus_randomize_by_rate(BenchContext *ctx)
+{
+	nn_plus_randomize_by_rate(ctx->dst, 0.1f, 0.01f);
+}
+
+void
+bench_op_save_load(BenchContext *ctx)
+{
+	rewind(ctx->f);
+	nn_savef(ctx->nn, ctx->f);
+	rewind(ctx->f);
+	nn_free(nn_loadf(ctx->f));
+}
+
+void
+bench_op_elites_add_pick(BenchContext *ctx)
+{
+	NeuralNetwork *a;
+	NeuralNetwork *b;
+
+	a = nn_elites_pick_by_random(&ctx->list, NULL);
+	b = nn_elites_pick_by_random(&ctx->list, a);
+	nn_elites_add(&ctx->list, nn_pool_produce(&ctx->pool, a, b), rand());
+}
+
+/* Move one binary feature, as a game state does between two moves */
+void
+bench_op_accum_update(BenchContext *ctx)
+{
+	int added;
+	int removed;
+
+	removed = rand() % ctx->acc.n_input;
+	added = rand() % ctx->acc.n_input;
+	nn_accum_update(&ctx->acc, &added, 1, &removed, 1);
+	nn_accum_run(&ctx->acc);
+}
+
+void
+bench_op_run_numa_local(BenchContext *ctx)
+{
+	nn_run(ctx->local, ctx->input);
+}
+
+void
+bench_op_run_numa_remote(BenchContext *ctx)
+{
+	nn_run(ctx->remote, ctx->input);
+}
+
+/* Over the input, the outputs of the topologies are too narrow to tell */
+void
+bench_op_find_most_possible(BenchContext *ctx)
+{
+	ctx->index = nn_util_find_most_possible(ctx->input, ctx->nn->n_input);
+}
+
+/* The single running maximum nn_util_find_most_possible() used to keep, to compare against */
+void
+bench_op_find_most_possible_scalar(BenchContext *ctx)
+{
+	int i;
+	int i_max;
+	float o_max;
+	const float *input = ctx->input;
+
+	i_max = 0;
+	o_max = input[0];
+	for (i = 1; i < ctx->nn->n_input; i++)
+	{
+		if (o_max < input[i])
+		{
+			o_max = input[i];
+			i_max = i;
+		}
+	}
+	ctx->index = i_max;
+}
+
+int
+bench_context_init(BenchContext *ctx, const BenchTopology *t)
+{
+	int i;
+	int n_elite;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->nn = nn_create(t->n_input, t->n_output, t->n_hidden, t->n_neuro_per_hidden, 1,
+			ACT_FUNC_TYPE_SIGMOID, ACT_FUNC_TYPE_SIGMOID);
+	if (ctx->nn == NULL)
+		return -1;
+	ctx->a = nn_duplicate(ctx->nn);
+	ctx->b = nn_duplicate(ctx->nn);
+	ctx->dst = nn_duplicate(ctx->nn);
+	nn_randomize(ctx->a);
+	nn_randomize(ctx->b);
+
+	ctx->input = malloc(t->n_input * sizeof(float));
+	ctx->expect = malloc(t->n_output * sizeof(float));
+	for (i = 0; i < t->n_input; i++)
+		ctx->input[i] = (float)rand() / RAND_MAX;
+	for (i = 0; i < t->n_output; i++)
+		ctx->expect[i] = (float)rand() / RAND_MAX;
+
+	ctx->local = nn_numa_duplicate_on(ctx->nn, 0);
+	ctx->remote = nn_numa_duplicate_on(ctx->nn, nn_numa_get_node_count() - 1);
+	if (ctx->local == NULL || ctx->remote == NULL)
+		return -1;
+
+	if (nn_accum_init(&ctx->acc, ctx->nn) < 0)
+		return -1;
+	nn_accum_reset(&ctx->acc, ctx->input);
+
+	ctx->f = tmpfile();
+	if (ctx->f == NULL)
+		return -1;
+
+	/* Don't take gigabytes for the large ones */
+	n_elite = ctx->nn->_n_weight > (1 << 20) ? 4 : 16;
+	nn_pool_init(&ctx->pool, 4);
+	nn_elites_init_list(&ctx->list, n_elite);
+	nn_elites_set_pool(&ctx->list, &ctx->pool);
+	for (i = 0; i < n_elite; i++)
+		nn_elites_add(&ctx->list, nn_duplicate(ctx->a), rand());
+
+	return 0;
+}
+
+void
+bench_context_free(BenchContext *ctx)
+{
+	nn_elites_clear(&ctx->list);
+	nn_pool_clear(&ctx->pool);
+	nn_accum_destroy(&ctx->acc);
+	if (ctx->f)
+		fclose(ctx->f);
+	free(ctx->input);
+	free(ctx->expect);
+	if (ctx->nn)
+		nn_free(ctx->nn);
+	if (ctx->a)
+		nn_free(ctx->a);
+	if (ctx->b)
+		nn_free(ctx->b);
+	if (ctx->dst)
+		nn_free(ctx->dst);
+	if (ctx->local)
+		nn_free(ctx->local);
+	if (ctx->remote)
+		nn_free(ctx->remote);
+}
+
+/*
+ * Double the iterations until it takes at least min_time, return ns per op.
+ * If pc is not NULL, counter is set to the counters of the last run.
+ */
+double
+bench_measure(const BenchOp *op,
+		BenchContext *ctx,
+		double min_time,
+		long *iterations,
+		NNPerfCounters *pc,
+		unsigned long long *counter)
+{
+	int k;
+	long i;
+	long n;
+	double start;
+	double elapsed;
+	unsigned long long counter_start[NN_PERF_N_COUNTER];
+
+	/* Warm up */
+	op->func(ctx);
+
+	for (n = 1; ; n *= 2)
+	{
+		if (pc)
+			nn_perf_read(pc, counter_start);
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			op->func(ctx);
+		elapsed = now_ns() - start;
+		if (pc)
+		{
+			nn_perf_read(pc, counter);
+			for (k = 0; k < NN_PERF_N_COUNTER; k++)
+				counter[k] -= counter_start[k];
+		}
+
+		if (elapsed >= min_time * 1e9)
+			break;
+	}
+
+	*iterations = n;
+	return elapsed / n;
+}
+
+/* Counters per op and what's derived from them, null if a counter is not available */
+void
+print_counters(NNPerfCounters *pc, unsigned long long *counter, long iterations, double flops)
+{
+	int k;
+
+	for (k = 0; k < NN_PERF_N_COUNTER; k++)
+	{
+		if (nn_perf_available(pc, k))
+			printf(", \"%s_per_op\": %.1f", nn_perf_counter_name(k), (double)counter[k] / iterations);
+		else
+			printf(", \"%s_per_op\": null", nn_perf_counter_name(k));
+	}
+
+	if (nn_perf_available(pc, NN_PERF_CYCLES) &&
+		nn_perf_available(pc, NN_PERF_INSTRUCTIONS) &&
+		counter[NN_PERF_CYCLES] > 0)
+		printf(", \"ipc\": %.3f", (double)counter[NN_PERF_INSTRUCTIONS] / counter[NN_PERF_CYCLES]);
+	else
+		printf(", \"ipc\": null");
+
+	if (nn_perf_available(pc, NN_PERF_LLC_MISSES) && flops > 0)
+		printf(", \"bytes_per_flop\": %.4f",
+				(double)counter[NN_PERF_LLC_MISSES] * NN_PERF_CACHE_LINE / iterations / flops);
+	else
+		printf(", \"bytes_per_flop\": null");
+}
+
+/* Read the results of a previous run, one result per line as printed by main() */
+int
+load_baseline(const char *file_name, BenchBaseline **baseline)
+{
+	int n;
+	int max;
+	char line[512];
+	char *p;
+	FILE *f;
+	BenchBaseline b;
+	BenchBaseline *tmp;
+
+	f = fopen(file_name, "r");
+	if (f == NULL)
+		return -1;
+
+	n = 0;
+	max = 0;
+	*baseline = NULL;
+	while (fgets(line, sizeof(line), f))
+	{
+		p = strstr(line, "\"op\"");
+		if (p == NULL)
+			continue;
+		if (sscanf(p, "\"op\": \"%63[^\"]\", \"topology\": \"%63[^\"]\"", b.op, b.topology) != 2)
+			continue;
+		p = strstr(p, "\"ns_per_op\": ");
+		if (p == NULL || sscanf(p, "\"ns_per_op\": %lf", &b.ns_per_op) != 1)
+			continue;
+
+		if (n >= max)
+		{
+			max = max ? max * 2 : 64;
+			tmp = realloc(*baseline, max * sizeof(*tmp));
+			if (tmp == NULL)
+				break;
+			*baseline = tmp;
+		}
+		(*baseline)[n++] = b;
+	}
+
+	fclose(f);
+	return n;
+}
+
+const BenchBaseline *
+find_baseline(const BenchBaseline *baseline, int n, const char *op, const char *topology)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (strcmp(baseline[i].op, op) == 0 &&
+			strcmp(baseline[i].topology, topology) == 0)
+			return &baseline[i];
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int i;
+	int j;
+	int quick = 0;
+	int first = 1;
+	int use_counters = 0;
+	int n_baseline = 0;
+	int n_regression = 0;
+	double min_time = 0.2;
+	double threshold = 10;
+	double ns;
+	double flops;
+	long iterations;
+	const char *filter = NULL;
+	const char *baseline_name = NULL;
+	BenchBaseline *baseline = NULL;
+	const BenchBaseline *base;
+	const BenchTopology *t;
+	BenchContext ctx;
+	NNPerfCounters pc;
+	unsigned long long counter[NN_PERF_N_COUNTER];
+
+	while ((c = getopt(argc, argv, "hqpt:f:c:r:")) != -1)
+	{
+		switch (c)
+		{
+			case 'q':
+				quick = 1;
+				break;
+			case 'p':
+				use_counters = 1;
+				break;
+			case 't':
+				min_time = atof(optarg);
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'c':
+				baseline_name = optarg;
+				break;
+			case 'r':
+				threshold = atof(optarg);
+				break;
+			case 'h':
+			default:
+				print_help(argv[0]);
+				return 1;
+		}
+	}
+
+	if (baseline_name)
+	{
+		n_baseline = load_baseline(baseline_name, &baseline);
+		if (n_baseline < 0)
+		{
+			fprintf(stderr, "Failed to read baseline %s\n", baseline_name);
+			return 1;
+		}
+	}
+
+	if (use_counters && nn_perf_open(&pc) == 0)
+		fprintf(stderr, "No hardware performance counter is available\n");
+
+	/* Run on node 0, so run_numa_local and run_numa_remote mean what they say */
+	nn_numa_pin_thread(0);
+
+	srand(1);
+	printf("{\n\"results\": [\n");
+	for (i = 0; i < (int)(sizeof(topologies) / sizeof(topologies[0])); i++)
+	{
+		t = &topologies[i];
+		if (quick && !t->quick)
+			continue;
+
+		if (bench_context_init(&ctx, t))
+		{
+			fprintf(stderr, "Failed to set up %s\n", t->name);
+			bench_context_free(&ctx);
+			continue;
+		}
+
+		for (j = 0; j < (int)(sizeof(ops) / sizeof(ops[0])); j++)
+		{
+			if (filter && !strstr(ops[j].name, filter) && !strstr(t->name, filter))
+				continue;
+
+			ns = bench_measure(&ops[j], &ctx, min_time, &iterations, use_counters ? &pc : NULL, counter);
+			flops = ops[j].flop_per_weight * ctx.nn->_n_weight;
+
+			printf("%s{\"op\": \"%s\", \"topology\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, "
+					"\"samples_per_sec\": %.1f, \"gflops\": %.3f",
+					first ? "" : ",\n",
+					ops[j].name,
+					t->name,
+					iterations,
+					ns,
+					1e9 / ns,
+					flops / ns);
+			first = 0;
+
+			if (use_counters)
+				print_counters(&pc, counter, iterations, flops);
+
+			base = find_baseline(baseline, n_baseline, ops[j].name, t->name);
+			if (base)
+			{
+				printf(", \"baseline_ns_per_op\": %.1f, \"change_percent\": %.1f, \"regression\": %s",
+						base->ns_per_op,
+						(ns / base->ns_per_op - 1) * 100,
+						ns > base->ns_per_op * (1 + threshold / 100) ? "true" : "false");
+				if (ns > base->ns_per_op * (1 + threshold / 100))
+				{
+					n_regression++;
+					fprintf(stderr, "Regression: %s %s %.1f ns -> %.1f ns\n",
+							ops[j].name, t->name, base->ns_per_op, ns);
+				}
+			}
+			printf("}");
+			fflush(stdout);
+		}
+
+		bench_context_free(&ctx);
+	}
+	printf("\n],\n\"regressions\": %d\n}\n", n_regression);
+
+	free(baseline);
+	if (use_counters)
+		nn_perf_close(&pc);
+
+	return n_regression ? 2 : 0;
+}
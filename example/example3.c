@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "neural_network.h"
+#include "neural_network_shm.h"
+#include "neural_network_sparse.h"
+
+/*
+ * Stress the shared memory population: worker processes take slots from the queue while
+ * the parent keeps rewriting and submitting them, and every fitness is checked.
+ * The workers run with nn_run_binary(), so a stale cached copy of an old network shows up too.
+ */
+
+#define N_INPUT 4
+
+void print_help(const char *argv0);
+void write_slot(NeuralNetwork *nn, int value);
+void worker(NNShmPopulation *pop);
+
+void
+print_help(const char *argv0)
+{
+	printf("%s\n"
+			"    -h for help.\n"
+			"    -w <workers> to specify the number of worker processes\n"
+			"    -s <slots> to specify the number of slots\n"
+			"    -r <rounds> to specify how many times every slot is submitted\n"
+			,
+			argv0);
+}
+
+/* The output of nn for all the inputs on is value * (1 + 2 + ... + N_INPUT) */
+void
+write_slot(NeuralNetwork *nn, int value)
+{
+	int i;
+
+	for (i = 0; i < N_INPUT; i++)
+		nn->weight[i] = value * (i + 1);
+	nn_touch(nn);
+}
+
+void
+worker(NNShmPopulation *pop)
+{
+	int slot;
+	uint64_t bits;
+	float *output;
+
+	bits = (1 << N_INPUT) - 1;
+	while ((slot = nn_shm_take(pop, 1)) >= 0)
+	{
+		output = nn_run_binary(nn_shm_get(pop, slot), &bits);
+		nn_shm_done(pop, slot, output ? output[0] : -1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int i;
+	int j;
+	int n_worker = 4;
+	int n_slot = 64;
+	int n_round = 1000;
+	int n_bad;
+	int status;
+	float expect;
+	pid_t *pids;
+	NeuralNetwork *shape;
+	NNShmPopulation pop;
+
+	while ((c = getopt(argc, argv, "hw:s:r:")) != -1)
+	{
+		switch (c)
+		{
+			case 'w':
+				n_worker = atoi(optarg);
+				break;
+			case 's':
+				n_slot = atoi(optarg);
+				break;
+			case 'r':
+				n_round = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	shape = nn_create(N_INPUT, 1, 0, 0, 0, ACT_FUNC_TYPE_LINEAR, ACT_FUNC_TYPE_LINEAR);
+	if (nn_shm_create(&pop, NULL, shape, n_slot) < 0)
+	{
+		printf("Failed to create the population\n");
+		return 1;
+	}
+
+	pids = malloc(n_worker * sizeof(*pids));
+	for (i = 0; i < n_worker; i++)
+	{
+		pids[i] = fork();
+		if (pids[i] == 0)
+		{
+			worker(&pop);
+			nn_shm_detach(&pop);
+			_exit(0);
+		}
+	}
+
+	n_bad = 0;
+	for (i = 0; i < n_round; i++)
+	{
+		for (j = 0; j < n_slot; j++)
+		{
+			write_slot(nn_shm_get(&pop, j), i * n_slot + j);
+			nn_shm_submit(&pop, j);
+		}
+		nn_shm_wait(&pop);
+
+		for (j = 0; j < n_slot; j++)
+		{
+			expect = (float)(i * n_slot + j) * N_INPUT * (N_INPUT + 1) / 2;
+			if (nn_shm_get_fitness(&pop, j) != expect)
+				n_bad++;
+		}
+	}
+
+	nn_shm_close_queue(&pop);
+	for (i = 0; i < n_worker; i++)
+		waitpid(pids[i], &status, 0);
+
+	printf("%d rounds of %d slots by %d workers, %d wrong\n", n_round, n_slot, n_worker, n_bad);
+
+	free(pids);
+	nn_shm_detach(&pop);
+	nn_free(shape);
+	return n_bad ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "neural_network.h"
+#include "neural_network_replay.h"
+
+/*
+ * Stress the replay buffer: many actor threads add records to a buffer much smaller than them
+ * all, so they keep lapping each other onto the same records, while the learner samples.
+ * Every value of a record is the same number, a sampled record mixing two is torn.
+ */
+
+#define N_INPUT 32
+#define N_EXPECT 8
+
+typedef struct {
+	NNReplayBuffer *rb;
+	int id;
+	int n_add;
+} Actor;
+
+void print_help(const char *argv0);
+void *actor_thread(void *arg);
+int check_record(const float *input, const float *expect);
+
+static atomic_int n_running;
+
+void
+print_help(const char *argv0)
+{
+	printf("%s\n"
+			"    -h for help.\n"
+			"    -a <actors> to specify the number of actor threads\n"
+			"    -c <capacity> to specify the capacity of the buffer\n"
+			"    -n <records> to specify how many records every actor adds\n"
+			"    -p to sample by priority\n"
+			,
+			argv0);
+}
+
+void *
+actor_thread(void *arg)
+{
+	int i;
+	int j;
+	float value;
+	float input[N_INPUT];
+	float expect[N_EXPECT];
+	Actor *actor = arg;
+
+	for (i = 0; i < actor->n_add; i++)
+	{
+		value = (float)actor->id * actor->n_add + i;
+		for (j = 0; j < N_INPUT; j++)
+			input[j] = value;
+		for (j = 0; j < N_EXPECT; j++)
+			expect[j] = value;
+		nn_replay_add(actor->rb, input, expect, i % 7 + 1);
+	}
+	atomic_fetch_sub(&n_running, 1);
+
+	return NULL;
+}
+
+/* Return 0 if every value is the same */
+int
+check_record(const float *input, const float *expect)
+{
+	int i;
+
+	for (i = 0; i < N_INPUT; i++)
+	{
+		if (input[i] != input[0])
+			return -1;
+	}
+	for (i = 0; i < N_EXPECT; i++)
+	{
+		if (expect[i] != input[0])
+			return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int i;
+	int n;
+	int n_actor = 8;
+	int capacity = 16;
+	int n_add = 200000;
+	int prioritized = 0;
+	long n_sample;
+	long n_torn;
+	float inputs[16 * N_INPUT];
+	float expects[16 * N_EXPECT];
+	int slots[16];
+	pthread_t *threads;
+	Actor *actors;
+	NNReplayBuffer rb;
+
+	while ((c = getopt(argc, argv, "ha:c:n:p")) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				n_actor = atoi(optarg);
+				break;
+			case 'c':
+				capacity = atoi(optarg);
+				break;
+			case 'n':
+				n_add = atoi(optarg);
+				break;
+			case 'p':
+				prioritized = 1;
+				break;
+			case 'h':
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	if (nn_replay_init(&rb, capacity, N_INPUT, N_EXPECT, prioritized) < 0)
+	{
+		printf("Failed to create the buffer\n");
+		return 1;
+	}
+
+	threads = malloc(n_actor * sizeof(*threads));
+	actors = malloc(n_actor * sizeof(*actors));
+	atomic_init(&n_running, n_actor);
+	for (i = 0; i < n_actor; i++)
+	{
+		actors[i].rb = &rb;
+		actors[i].id = i;
+		actors[i].n_add = n_add;
+		pthread_create(&threads[i], NULL, actor_thread, &actors[i]);
+	}
+
+	n_sample = 0;
+	n_torn = 0;
+	while (atomic_load(&n_running) > 0)
+	{
+		n = nn_replay_sample(&rb, 16, inputs, expects, slots);
+		for (i = 0; i < n; i++)
+		{
+			if (check_record(&inputs[i * N_INPUT], &expects[i * N_EXPECT]))
+				n_torn++;
+			nn_replay_set_priority(&rb, slots[i], i + 1);
+		}
+		n_sample += n;
+	}
+
+	for (i = 0; i < n_actor; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%d actors added %d records each into %d, %ld sampled, %ld torn\n",
+			n_actor, n_add, capacity, n_sample, n_torn);
+
+	free(threads);
+	free(actors);
+	nn_replay_destroy(&rb);
+	return n_torn ? 1 : 0;
+}
@@ -1,18 +1,64 @@
 #include "neural_network.h"
+#include "neural_network_private.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
-
-static int random_pick(float rate);
-
-static float nn_gen_random();
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define NN_FILE_MAGIC	0x464d4e4e	/* "NNMF" */
+#define NN_FILE_VERSION	1
+#define NN_FILE_ENDIAN	0x01020304
+
+/* Floor of the output in the cross-entropy so a saturated softmax gives a finite loss */
+#define NN_LOSS_MIN_OUTPUT	1e-7f
+
+/*
+ * Header of the aligned file format.
+ * Offsets are from the beginning of the header, weight and bias are NN_FILE_ALIGN aligned
+ * and the whole thing is padded to NN_FILE_ALIGN.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t endian;	/* NN_FILE_ENDIAN in the writer's byte order */
+	uint32_t header_size;
+	int32_t n_input;
+	int32_t n_output;
+	int32_t n_hidden;
+	int32_t n_neuro_per_hidden;
+	int32_t use_bias;
+	int32_t act_func_type_hidden;
+	int32_t act_func_type_output;
+	int32_t n_weight;
+	int32_t n_neuro;
+	uint32_t reserved;
+	uint64_t weight_offset;
+	uint64_t bias_offset;	/* 0 if there is no bias */
+	uint64_t size;
+} _NNFileHeader;
 
 static float nn_gen_random_zero_to_one();
 
 static int nn_compute_n_weight(NeuralNetwork *nn);
 
+static NeuralNetwork *nn_alloc(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output,
+		int alloc_param);
+
+static void nn_crossover(float *dst, const float *a, const float *b, int n);
+
 static void nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		int use_bias,
 		float *input,
@@ -22,20 +68,77 @@ static void nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		float *bias,
 		float *weight);
 
+static long nn_align(long n);
+
+static void nn_make_header(NeuralNetwork *nn, _NNFileHeader *hdr);
+
+static int nn_check_header(_NNFileHeader *hdr);
+
+static long nn_header_n_weight(_NNFileHeader *hdr);
+
+static NeuralNetwork *nn_alloc_by_header(_NNFileHeader *hdr, int alloc_param);
+
+static int nn_skip(FILE *f, long n);
+
+static NeuralNetwork *nn_load_alignedf(FILE *f);
+
 static void nn_correct(float *weight, float *delta, float *input, int n_input, int n_output, float rate);
 
 static float nn_act_func_derivate(ACT_FUNC_TYPE act_func_type, float output);
 
-static int
-random_pick(float rate)
+/* Set by nn_set_thread_seed(), the calling thread draws from it instead of rand() */
+static _Thread_local unsigned int *nn_thread_seed;
+
+/*
+ * Make the random numbers of the calling thread come from rand_r(seed), NULL to go back to rand().
+ * Threads with their own seed don't contend on the lock of rand() and are reproducible.
+ * Return the seed used before, to be set back.
+ */
+unsigned int *
+nn_set_thread_seed(unsigned int *seed)
 {
-	if (nn_gen_random_zero_to_one() < rate)
-		return 1;
-	return 0;
+	unsigned int *old;
+
+	old = nn_thread_seed;
+	nn_thread_seed = seed;
+
+	return old;
 }
 
-static float
-nn_gen_random()
+int
+_nn_rand(void)
+{
+	return nn_thread_seed ? rand_r(nn_thread_seed) : rand();
+}
+
+/*
+ * Return the index of the next element to pick after index i among n elements,
+ * or n if there is none.
+ * Every element is picked independently with probability rate, so the gap between
+ * two picks follows a geometric distribution and is sampled directly instead of
+ * rolling a random number for every element.
+ */
+int
+_nn_next_pick(int i, int n, float rate)
+{
+	double u;
+	double skip;
+
+	if (rate <= 0.0f)
+		return n;
+	if (rate >= 1.0f)
+		return i + 1 < n ? i + 1 : n;
+
+	u = (_nn_rand() + 1.0) / ((double)RAND_MAX + 1.0);	/* A random (0, 1], never 0 for log() */
+	skip = floor(log(u) / log1p(-rate));		/* Number of elements not picked */
+
+	if (skip >= (double)(n - i - 1))
+		return n;
+	return i + 1 + (int)skip;
+}
+
+float
+_nn_gen_random()
 {
 	return nn_gen_random_zero_to_one() - 0.5f;	/* A random -0.5 ~ 0.5 */
 }
@@ -44,7 +147,7 @@ static float nn_gen_random_zero_to_one()
 {
 	float r;
 
-	r = rand();			 /* A random 0 ~ RAND_MAX */
+	r = _nn_rand();		 /* A random 0 ~ RAND_MAX */
 	r /= (float)RAND_MAX;   /* A random 0 ~ 1.0 */
 
 	return r;
@@ -70,6 +173,93 @@ nn_compute_n_weight(NeuralNetwork *nn)
 	return n_weight;
 }
 
+/*
+ * Allocate a network without initializing its weight and bias.
+ * If alloc_param is 0 weight and bias are left NULL for the caller to point somewhere.
+ */
+static NeuralNetwork *
+nn_alloc(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output,
+		int alloc_param)
+{
+	NeuralNetwork *nn;
+
+	/* Error check */
+	if (n_input < 0)
+		return NULL;
+	if (n_output < 0)
+		return NULL;
+	if (n_hidden < 0)
+		return NULL;
+	if (n_hidden > 0 && n_neuro_per_hidden < 1)
+		return NULL;
+	/* Softmax couples the whole layer, there is no per neuro derivative to back propagate */
+	if (n_hidden > 0 && act_func_type_hidden == ACT_FUNC_TYPE_SOFTMAX)
+		return NULL;
+
+	nn = malloc(sizeof(*nn));
+	nn->n_input = n_input;
+	nn->n_output = n_output;
+	nn->n_hidden = n_hidden;
+	nn->n_neuro_per_hidden = n_neuro_per_hidden;
+	nn->use_bias = use_bias;
+	nn->act_func_type_hidden = act_func_type_hidden;
+	nn->act_func_type_output = act_func_type_output;
+	/* Calculate number of neuro */
+	nn->_n_neuro = n_output + n_hidden  * n_neuro_per_hidden;
+	nn->_n_weight = nn_compute_n_weight(nn);
+
+	nn->weight = NULL;
+	nn->bias = NULL;
+	if (alloc_param)
+	{
+		nn->weight = malloc(nn->_n_weight * sizeof(float));
+		if (nn->use_bias)
+			nn->bias = malloc(nn->_n_neuro * sizeof(float));
+	}
+	nn->output = malloc(nn->_n_neuro * sizeof(float));
+	nn->delta = malloc(nn->_n_neuro * sizeof(float));
+	nn->_map_base = NULL;
+	nn->_map_len = 0;
+	nn->_view = 0;
+	nn->_prof = NULL;
+	nn->_version = 0;
+	nn->_sparse = NULL;
+	nn->_loss = 0;
+
+	return nn;
+}
+
+/*
+ * Pick every element from either a or b.
+ * One _nn_rand() gives at least 15 random bits (RAND_MAX >= 32767), so use them all.
+ */
+static void
+nn_crossover(float *dst, const float *a, const float *b, int n)
+{
+	int i;
+	int bits;
+	int n_bits;
+
+	n_bits = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (n_bits == 0)
+		{
+			bits = _nn_rand();
+			n_bits = 15;
+		}
+		dst[i] = bits & 1 ? a[i] : b[i];
+		bits >>= 1;
+		n_bits--;
+	}
+}
+
 static void
 nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		int use_bias,
@@ -79,6 +269,22 @@ nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		int n_output,
 		float *bias,
 		float *weight)
+{
+	_nn_layer_sum(use_bias, input, n_input, output, n_output, bias, weight);
+
+	/* Do activation function */
+	_nn_act_func_apply(act_func_type, output, n_output);
+}
+
+/* The sums of a layer before the activation function */
+void
+_nn_layer_sum(int use_bias,
+		const float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		const float *bias,
+		const float *weight)
 {
 	int i;
 	int j;
@@ -94,21 +300,203 @@ nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		{
 			output[i] += weight[i * n_input + j] * input[j];
 		}
-		/* Do activation function */
-		switch (act_func_type)
-		{
-			case ACT_FUNC_TYPE_SIGMOID:
-				output[i] = 1.0f / (1.0f + exp(-output[i]));
-				break;
-			case ACT_FUNC_TYPE_TANH:
-				output[i] = tanh(output[i]);
-				break;
-			default:
-				break;
-		}
 	}
 }
 
+static long
+nn_align(long n)
+{
+	return (n + NN_FILE_ALIGN - 1) / NN_FILE_ALIGN * NN_FILE_ALIGN;
+}
+
+static void
+nn_make_header(NeuralNetwork *nn, _NNFileHeader *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = NN_FILE_MAGIC;
+	hdr->version = NN_FILE_VERSION;
+	hdr->endian = NN_FILE_ENDIAN;
+	hdr->header_size = sizeof(*hdr);
+	hdr->n_input = nn->n_input;
+	hdr->n_output = nn->n_output;
+	hdr->n_hidden = nn->n_hidden;
+	hdr->n_neuro_per_hidden = nn->n_neuro_per_hidden;
+	hdr->use_bias = nn->use_bias;
+	hdr->act_func_type_hidden = nn->act_func_type_hidden;
+	hdr->act_func_type_output = nn->act_func_type_output;
+	hdr->n_weight = nn->_n_weight;
+	hdr->n_neuro = nn->_n_neuro;
+
+	hdr->weight_offset = nn_align(sizeof(*hdr));
+	hdr->size = nn_align(hdr->weight_offset + nn->_n_weight * sizeof(float));
+	if (nn->use_bias)
+	{
+		hdr->bias_offset = hdr->size;
+		hdr->size = nn_align(hdr->bias_offset + nn->_n_neuro * sizeof(float));
+	}
+}
+
+/*
+ * Number of weight of the shape in hdr, -1 if it doesn't fit in an int.
+ * Computed in long, every term is at most INT_MAX * INT_MAX so nothing overflows.
+ */
+static long
+nn_header_n_weight(_NNFileHeader *hdr)
+{
+	long n_weight;
+	long per_hidden;	/* Weight of a hidden layer after the first one */
+
+	if (hdr->n_hidden == 0)
+	{
+		n_weight = (long)hdr->n_input * hdr->n_output;
+	}
+	else
+	{
+		per_hidden = (long)hdr->n_neuro_per_hidden * hdr->n_neuro_per_hidden;
+		if (hdr->n_hidden - 1 > INT_MAX / per_hidden)
+			return -1;
+		n_weight = (long)hdr->n_input * hdr->n_neuro_per_hidden +
+			(hdr->n_hidden - 1) * per_hidden +
+			(long)hdr->n_neuro_per_hidden * hdr->n_output;
+	}
+
+	return n_weight > INT_MAX ? -1 : n_weight;
+}
+
+/* Everything after the magic has to make sense before any of it is used */
+static int
+nn_check_header(_NNFileHeader *hdr)
+{
+	long weight_end;
+	long n_weight;
+	long n_neuro;
+
+	if (hdr->magic != NN_FILE_MAGIC)
+		return -1;
+	if (hdr->version != NN_FILE_VERSION)
+		return -1;
+	/* Written by a machine of the other byte order */
+	if (hdr->endian != NN_FILE_ENDIAN)
+		return -1;
+	if (hdr->header_size != sizeof(*hdr))
+		return -1;
+	if (hdr->n_input < 0 ||
+		hdr->n_output < 0 ||
+		hdr->n_hidden < 0 ||
+		(hdr->n_hidden > 0 && hdr->n_neuro_per_hidden < 1))
+		return -1;
+	if (hdr->act_func_type_hidden < ACT_FUNC_TYPE_LINEAR ||
+		hdr->act_func_type_hidden > ACT_FUNC_TYPE_SOFTMAX ||
+		hdr->act_func_type_output < ACT_FUNC_TYPE_LINEAR ||
+		hdr->act_func_type_output > ACT_FUNC_TYPE_SOFTMAX)
+		return -1;
+
+	n_weight = nn_header_n_weight(hdr);
+	n_neuro = hdr->n_output + (hdr->n_hidden > 0 ? (long)hdr->n_hidden * hdr->n_neuro_per_hidden : 0);
+	if (n_weight < 0 || n_neuro > INT_MAX ||
+		hdr->n_weight != n_weight ||
+		hdr->n_neuro != n_neuro)
+		return -1;
+
+	/* Offsets past the size would wrap around in the sums below */
+	if (hdr->size > LONG_MAX || hdr->weight_offset > hdr->size || hdr->bias_offset > hdr->size)
+		return -1;
+	if (hdr->weight_offset < sizeof(*hdr) || hdr->weight_offset % NN_FILE_ALIGN)
+		return -1;
+	weight_end = hdr->weight_offset + hdr->n_weight * sizeof(float);
+	if (hdr->use_bias)
+	{
+		if (hdr->bias_offset < weight_end || hdr->bias_offset % NN_FILE_ALIGN)
+			return -1;
+		if (hdr->size < hdr->bias_offset + hdr->n_neuro * sizeof(float))
+			return -1;
+	}
+	else if (hdr->size < weight_end)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+static NeuralNetwork *
+nn_alloc_by_header(_NNFileHeader *hdr, int alloc_param)
+{
+	return nn_alloc(hdr->n_input,
+			hdr->n_output,
+			hdr->n_hidden,
+			hdr->n_neuro_per_hidden,
+			hdr->use_bias,
+			hdr->act_func_type_hidden,
+			hdr->act_func_type_output,
+			alloc_param);
+}
+
+/* Skip n bytes, f may be a pipe so don't seek */
+static int
+nn_skip(FILE *f, long n)
+{
+	char buf[NN_FILE_ALIGN];
+	long len;
+
+	while (n > 0)
+	{
+		len = n < (long)sizeof(buf) ? n : (long)sizeof(buf);
+		if (fread(buf, 1, len, f) != len)
+			return -1;
+		n -= len;
+	}
+
+	return 0;
+}
+
+/* Read the aligned format, the magic is already read */
+static NeuralNetwork *
+nn_load_alignedf(FILE *f)
+{
+	long pos;
+	NeuralNetwork *nn;
+	_NNFileHeader hdr;
+
+	hdr.magic = NN_FILE_MAGIC;
+	pos = sizeof(hdr.magic);
+	if (fread((char *)&hdr + pos, sizeof(hdr) - pos, 1, f) != 1)
+		return NULL;
+	pos = sizeof(hdr);
+
+	if (nn_check_header(&hdr))
+		return NULL;
+
+	nn = nn_alloc_by_header(&hdr, 1);
+	if (nn == NULL)
+		return NULL;
+
+	if (nn_skip(f, hdr.weight_offset - pos))
+		goto __error;
+	if (fread(nn->weight, sizeof(float), nn->_n_weight, f) != nn->_n_weight)
+		goto __error;
+	pos = hdr.weight_offset + nn->_n_weight * sizeof(float);
+
+	if (nn->use_bias)
+	{
+		if (nn_skip(f, hdr.bias_offset - pos))
+			goto __error;
+		if (fread(nn->bias, sizeof(float), nn->_n_neuro, f) != nn->_n_neuro)
+			goto __error;
+		pos = hdr.bias_offset + nn->_n_neuro * sizeof(float);
+	}
+
+	/* Leave f at the end of this network */
+	if (nn_skip(f, hdr.size - pos))
+		goto __error;
+
+	return nn;
+
+__error:
+	nn_free(nn);
+	return NULL;
+}
+
 static void
 nn_correct(float *weight, float *delta, float *input, int n_input, int n_output, float rate)
 {
@@ -123,6 +511,46 @@ nn_correct(float *weight, float *delta, float *input, int n_input, int n_output,
 	}
 }
 
+void
+_nn_act_func_apply(ACT_FUNC_TYPE act_func_type, float *v, int n)
+{
+	int i;
+	float max;
+	float sum;
+
+	switch (act_func_type)
+	{
+		case ACT_FUNC_TYPE_SIGMOID:
+			for (i = 0; i < n; i++)
+				v[i] = 1.0f / (1.0f + exp(-v[i]));
+			break;
+
+		case ACT_FUNC_TYPE_TANH:
+			for (i = 0; i < n; i++)
+				v[i] = tanh(v[i]);
+			break;
+
+		case ACT_FUNC_TYPE_SOFTMAX:
+			/* Shift by the max so exp() can't overflow, the result is the same */
+			max = n > 0 ? v[0] : 0;
+			for (i = 1; i < n; i++)
+				if (v[i] > max)
+					max = v[i];
+			sum = 0;
+			for (i = 0; i < n; i++)
+			{
+				v[i] = exp(v[i] - max);
+				sum += v[i];
+			}
+			for (i = 0; i < n; i++)
+				v[i] /= sum;
+			break;
+
+		default:
+			break;
+	}
+}
+
 static float
 nn_act_func_derivate(ACT_FUNC_TYPE act_func_type, float output)
 {
@@ -149,37 +577,19 @@ nn_create(int n_input,
 		ACT_FUNC_TYPE act_func_type_hidden,
 		ACT_FUNC_TYPE act_func_type_output)
 {
-	int i;
 	NeuralNetwork *nn;
 
-	/* Error check */
-	if (n_input < 0)
-		return NULL;
-	if (n_output < 0)
-		return NULL;
-	if (n_hidden < 0)
-		return NULL;
-	if (n_hidden > 0 && n_neuro_per_hidden < 1)
+	nn = nn_alloc(n_input,
+			n_output,
+			n_hidden,
+			n_neuro_per_hidden,
+			use_bias,
+			act_func_type_hidden,
+			act_func_type_output,
+			1);
+	if (nn == NULL)
 		return NULL;
 
-	nn = malloc(sizeof(*nn));
-	nn->n_input = n_input;
-	nn->n_output = n_output;
-	nn->n_hidden = n_hidden;
-	nn->n_neuro_per_hidden = n_neuro_per_hidden;
-	nn->use_bias = use_bias;
-	nn->act_func_type_hidden = act_func_type_hidden;
-	nn->act_func_type_output = act_func_type_output;
-	/* Calculate number of neuro */
-	nn->_n_neuro = n_output + n_hidden  * n_neuro_per_hidden;
-	nn->_n_weight = nn_compute_n_weight(nn);
-
-	nn->weight = malloc(nn->_n_weight * sizeof(float));
-	if (nn->use_bias)
-		nn->bias = malloc(nn->_n_neuro * sizeof(float));
-	nn->output = malloc(nn->_n_neuro * sizeof(float));
-	nn->delta = malloc(nn->_n_neuro * sizeof(float));
-
 	nn_randomize(nn);
 
 	return nn;
@@ -188,57 +598,109 @@ nn_create(int n_input,
 NeuralNetwork *
 nn_produce(NeuralNetwork *a, NeuralNetwork *b)
 {
-	int i;
 	NeuralNetwork *nn;
 
-	if (a->n_input != b->n_input)
-		return NULL;
-	if (a->n_output != b->n_output)
-		return NULL;
-	if (a->n_hidden != b->n_hidden)
-		return NULL;
-	if (a->n_neuro_per_hidden != b->n_neuro_per_hidden)
-		return NULL;
-	if (a->act_func_type_hidden != b->act_func_type_hidden)
-		return NULL;
-	if (a->act_func_type_output != b->act_func_type_output)
+	if (!nn_same_shape(a, b))
 		return NULL;
 
-	nn = nn_create(a->n_input,
+	nn = nn_alloc(a->n_input,
 			a->n_output,
 			a->n_hidden,
 			a->n_neuro_per_hidden,
 			a->use_bias,
 			a->act_func_type_hidden,
-			a->act_func_type_output);
-
-	if (nn->use_bias)
-	{
-		for (i = 0; i < a->_n_neuro; i++)
-		{
-			nn->bias[i] = rand() & 1 ? a->bias[i] : b->bias[i];
-		}
-	}
+			a->act_func_type_output,
+			1);
 
-	for (i = 0; i < a->_n_weight; i++)
-	{
-		nn->weight[i] = rand() & 1 ? a->weight[i] : b->weight[i];
-	}
+	nn_produce_into(nn, a, b);
 
 	return nn;
 }
 
+int
+nn_produce_into(NeuralNetwork *dst, NeuralNetwork *a, NeuralNetwork *b)
+{
+	if (!nn_same_shape(dst, a))
+		return -1;
+	if (!nn_same_shape(a, b))
+		return -1;
+
+	if (dst->use_bias)
+		nn_crossover(dst->bias, a->bias, b->bias, a->_n_neuro);
+
+	nn_crossover(dst->weight, a->weight, b->weight, a->_n_weight);
+	dst->_version++;
+
+	return 0;
+}
+
+int
+nn_same_shape(NeuralNetwork *a, NeuralNetwork *b)
+{
+	if (a->n_input != b->n_input)
+		return 0;
+	if (a->n_output != b->n_output)
+		return 0;
+	if (a->n_hidden != b->n_hidden)
+		return 0;
+	if (a->n_neuro_per_hidden != b->n_neuro_per_hidden)
+		return 0;
+	if (a->use_bias != b->use_bias)
+		return 0;
+	if (a->act_func_type_hidden != b->act_func_type_hidden)
+		return 0;
+	if (a->act_func_type_output != b->act_func_type_output)
+		return 0;
+
+	return 1;
+}
+
 void
 nn_free(NeuralNetwork *nn)
 {
-	free(nn->weight);
-	if (nn->use_bias)
-		free(nn->bias);
+	if (nn->_map_base)
+	{
+		munmap(nn->_map_base, nn->_map_len);
+	}
+	else if (!nn->_view)
+	{
+		free(nn->weight);
+		if (nn->use_bias)
+			free(nn->bias);
+	}
 	free(nn->output);
 	free(nn->delta);
+	free(nn->_prof);
+	_nn_sparse_free(nn);
 	free(nn);
 }
 
+/* A network without weight and bias, the caller points them to memory it owns */
+NeuralNetwork *
+_nn_alloc_view(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output)
+{
+	NeuralNetwork *nn;
+
+	nn = nn_alloc(n_input,
+			n_output,
+			n_hidden,
+			n_neuro_per_hidden,
+			use_bias,
+			act_func_type_hidden,
+			act_func_type_output,
+			0);
+	if (nn)
+		nn->_view = 1;
+
+	return nn;
+}
+
 NeuralNetwork *
 nn_duplicate(NeuralNetwork *nn)
 {
@@ -247,23 +709,49 @@ nn_duplicate(NeuralNetwork *nn)
 	if (nn == NULL)
 		return NULL;
 
-	new_nn = nn_create(nn->n_input,
+	new_nn = nn_alloc(nn->n_input,
 			nn->n_output,
 			nn->n_hidden,
 			nn->n_neuro_per_hidden,
 			nn->use_bias,
 			nn->act_func_type_hidden,
-			nn->act_func_type_output);
+			nn->act_func_type_output,
+			1);
 
-	memcpy(new_nn->weight, nn->weight, nn->_n_weight * sizeof(float));
-	if (nn->use_bias)
-		memcpy(new_nn->bias, nn->bias, nn->_n_neuro * sizeof(float));
+	nn_copy_into(new_nn, nn);
 
 	return new_nn;
 }
 
+int
+nn_copy_into(NeuralNetwork *dst, NeuralNetwork *src)
+{
+	if (!nn_same_shape(dst, src))
+		return -1;
+
+	memcpy(dst->weight, src->weight, src->_n_weight * sizeof(float));
+	if (src->use_bias)
+		memcpy(dst->bias, src->bias, src->_n_neuro * sizeof(float));
+	dst->_version++;
+
+	return 0;
+}
+
+/* Tell the network that weight or bias has been changed directly, so what's derived from them is rebuilt */
+void
+nn_touch(NeuralNetwork *nn)
+{
+	nn->_version++;
+}
+
+/*
+ * Run the layers from the layer-th one, input is the input of that layer.
+ * buffer is laid out as nn->output and the outputs of the layers before are left as they are.
+ * Only the runs into nn->output are profiled, the ones with their own buffer may run at the same
+ * time from several threads (nn_run_with_buffer(), NNPublished) and nn->_prof isn't shared safely.
+ */
 float *
-nn_run(NeuralNetwork *nn, float *input)
+_nn_run_from(NeuralNetwork *nn, int layer, float *input, float *buffer)
 {
 	int i;
 	float *output;	/* Output buffer of this layer */
@@ -271,20 +759,31 @@ nn_run(NeuralNetwork *nn, float *input)
 	float *weight;	/* Weight matrix of this layer */
 	int n_input;	/* Number of input or Number of output of previous layer */
 	int n_output;	/* Number of output of this layer */
+	NN_PROF_DECL(t0)
 
 	n_input = nn->n_input;
-	output = nn->output;
-	if (nn->use_bias)
-		bias = nn->bias;
+	output = buffer;
+	bias = nn->bias;
 	weight = nn->weight;
+	if (layer > 0)
+	{
+		/* Skip the layers before */
+		output += layer * nn->n_neuro_per_hidden;
+		if (nn->use_bias)
+			bias += layer * nn->n_neuro_per_hidden;
+		weight += nn->n_input * nn->n_neuro_per_hidden
+			+ (layer - 1) * nn->n_neuro_per_hidden * nn->n_neuro_per_hidden;
+		n_input = nn->n_neuro_per_hidden;
+	}
 	/*
 	 * 1. Process the hidden layers if any
 	 */
-	for (i = 0; i < nn->n_hidden; i++)
+	for (i = layer; i < nn->n_hidden; i++)
 	{
 		/* So many outputs this layer */
 		n_output = nn->n_neuro_per_hidden;
 		/* Forward propergation */
+		NN_PROF_BEGIN(t0);
 		nn_forward_propagation(nn->act_func_type_hidden,
 				nn->use_bias,
 				input,
@@ -293,6 +792,8 @@ nn_run(NeuralNetwork *nn, float *input)
 				n_output,
 				bias,
 				weight);
+		if (buffer == nn->output)
+			NN_PROF_END(nn, i, NN_PROFILE_FORWARD, t0, 2.0 * n_input * n_output);
 
 		/* Move pointer forward to the next layer */
 		input = output; /* Output of this layer is the next layer's input */
@@ -310,6 +811,7 @@ nn_run(NeuralNetwork *nn, float *input)
 	/* So many outputs this layer */
 	n_output = nn->n_output;
 	/* Forward propergation */
+	NN_PROF_BEGIN(t0);
 	nn_forward_propagation(nn->act_func_type_output,
 			nn->use_bias,
 			input,
@@ -318,17 +820,39 @@ nn_run(NeuralNetwork *nn, float *input)
 			n_output,
 			bias,
 			weight);
+	if (buffer == nn->output)
+		NN_PROF_END(nn, nn->n_hidden, NN_PROFILE_FORWARD, t0, 2.0 * n_input * n_output);
 
 	return output;
 }
 
 float *
-nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
+nn_run(NeuralNetwork *nn, float *input)
+{
+	return _nn_run_from(nn, 0, input, nn->output);
+}
+
+/*
+ * As nn_run(), but the outputs of the layers go to buffer of _n_neuro floats instead of nn->output,
+ * so threads with their own buffers can run the same network at the same time.
+ */
+float *
+nn_run_with_buffer(NeuralNetwork *nn, float *input, float *buffer)
+{
+	return _nn_run_from(nn, 0, input, buffer);
+}
+
+/*
+ * Back propagate from nn->output and correct everything except the weight of the first layer,
+ * which needs the input and is left to the caller.
+ * The delta of the first layer is at nn->delta, the loss is at nn->_loss.
+ */
+void
+_nn_backward(NeuralNetwork *nn, float *expect, float rate)
 {
 	int i;
 	int j;
 	int k;
-	float *ret;
 	int n_output;		/* Number of output of this layer */
 	int n_next_output;	/* Number of the neuro of next layer */
 	float *delta;		/* Delta of this layer */
@@ -336,11 +860,8 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 	float *bias;		/* Bias of this layer */
 	float *next_delta;	/* delta of next layer */
 	float *next_weight;	/* delta of next layer */
-
-	/*
-	 * 0. Run once
-	 */
-	ret = nn_run(nn, input);
+	float loss;
+	NN_PROF_DECL(t0)
 
 	/*
 	 * 1. From the output layer, do back propagation computation.
@@ -354,16 +875,34 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 	/*
 	 * Compute delta of this layer, also fix bias of this layer
 	 */
+	NN_PROF_BEGIN(t0);
+	loss = 0;
 	for (i = 0; i < n_output; i++)
 	{
 		delta[i] = expect[i] - output[i];
 
-		/* Apply derivation of activation function of this neuro */
-		delta[i] *= nn_act_func_derivate(nn->act_func_type_output, output[i]);
+		if (nn->act_func_type_output == ACT_FUNC_TYPE_SOFTMAX)
+		{
+			/*
+			 * The gradient of cross-entropy through softmax is just expect - output,
+			 * given expect sums to 1, so there is no derivation to apply
+			 */
+			if (expect[i] > 0)
+				loss -= expect[i] * log(output[i] > NN_LOSS_MIN_OUTPUT ? output[i] : NN_LOSS_MIN_OUTPUT);
+		}
+		else
+		{
+			loss += 0.5f * delta[i] * delta[i];
+
+			/* Apply derivation of activation function of this neuro */
+			delta[i] *= nn_act_func_derivate(nn->act_func_type_output, output[i]);
+		}
 
 		if (nn->use_bias)
 			bias[i] += delta[i] * rate;
 	}
+	nn->_loss = loss;
+	NN_PROF_END(nn, nn->n_hidden, NN_PROFILE_BACKWARD, t0, 3.0 * n_output);
 
 	/*
 	 * 2. From the last hidden layer, do back propagation computation
@@ -386,6 +925,7 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 		/*
 		 * a. Compute delta of this layer, also fix bias of this layer
 		 */
+		NN_PROF_BEGIN(t0);
 		for (j = 0; j < n_output; j++)
 		{
 			/*
@@ -405,29 +945,56 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 			if (nn->use_bias)
 				bias[j] += delta[j] * rate;
 		}
+		NN_PROF_END(nn, nn->n_hidden - 1 - i, NN_PROFILE_BACKWARD, t0, 2.0 * n_next_output * n_output + 3.0 * n_output);
 
 		/*
 		 * b. Correct the next layer's weight
 		 */
+		NN_PROF_BEGIN(t0);
 		nn_correct(next_weight, next_delta, output, n_output, n_next_output, rate);
+		NN_PROF_END(nn, nn->n_hidden - i, NN_PROFILE_UPDATE, t0, 3.0 * n_next_output * n_output);
 	}
+}
 
-	n_next_output = n_output;
-	n_output = nn->n_input;
-	/* Move weight to this layer */
-	next_weight -= n_next_output * n_output;
+float *
+nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
+{
+	float *ret;
+	int n_first;	/* Number of the neuro of the first layer */
+	NN_PROF_DECL(t0)
+
+	/*
+	 * 0. Run once
+	 */
+	ret = nn_run(nn, input);
 
-	/* Move next_delta, output to this layer */
-	next_delta = delta;
-	output = input; /* Input is treated as the output of this "input layer" */
+	/*
+	 * 1. Back propagation down to the first layer
+	 */
+	_nn_backward(nn, expect, rate);
 
 	/*
-	 * Correct the next layer's weight
+	 * 2. Correct the first layer's weight, input is treated as the output of this "input layer"
 	 */
-	nn_correct(next_weight, next_delta, output, n_output, n_next_output, rate);
+	n_first = nn->n_hidden > 0 ? nn->n_neuro_per_hidden : nn->n_output;
+	NN_PROF_BEGIN(t0);
+	nn_correct(nn->weight, nn->delta, input, nn->n_input, n_first, rate);
+	NN_PROF_END(nn, 0, NN_PROFILE_UPDATE, t0, 3.0 * n_first * nn->n_input);
+	nn->_version++;
+
 	return ret;
 }
 
+/*
+ * Loss of the last train call with the output before the correction,
+ * cross-entropy for a softmax output, half the squared error otherwise.
+ */
+float
+nn_get_loss(NeuralNetwork *nn)
+{
+	return nn->_loss;
+}
+
 void
 nn_plus_randomize(NeuralNetwork *nn, float range)
 {
@@ -437,14 +1004,15 @@ nn_plus_randomize(NeuralNetwork *nn, float range)
 	{
 		for (i = 0; i < nn->_n_neuro; i++)
 		{
-			nn->bias[i] += nn_gen_random() * 2 * range;
+			nn->bias[i] += _nn_gen_random() * 2 * range;
 		}
 	}
 
 	for (i = 0; i < nn->_n_weight; i++)
 	{
-		nn->weight[i] += nn_gen_random() * 2 * range;
+		nn->weight[i] += _nn_gen_random() * 2 * range;
 	}
+	nn->_version++;
 }
 
 void
@@ -454,19 +1022,17 @@ nn_plus_randomize_by_rate(NeuralNetwork *nn, float range, float rate)
 
 	if (nn->use_bias)
 	{
-		for (i = 0; i < nn->_n_neuro; i++)
+		for (i = _nn_next_pick(-1, nn->_n_neuro, rate); i < nn->_n_neuro; i = _nn_next_pick(i, nn->_n_neuro, rate))
 		{
-			if (random_pick(rate))
-				nn->bias[i] += nn_gen_random() * 2 * range;
+			nn->bias[i] += _nn_gen_random() * 2 * range;
 		}
 	}
 
-	for (i = 0; i < nn->_n_weight; i++)
+	for (i = _nn_next_pick(-1, nn->_n_weight, rate); i < nn->_n_weight; i = _nn_next_pick(i, nn->_n_weight, rate))
 	{
-		if (random_pick(rate))
-			nn->weight[i] += nn_gen_random() * 2 * range;
+		nn->weight[i] += _nn_gen_random() * 2 * range;
 	}
-
+	nn->_version++;
 }
 
 void
@@ -478,14 +1044,15 @@ nn_randomize(NeuralNetwork *nn)
 	{
 		for (i = 0; i < nn->_n_neuro; i++)
 		{
-			nn->bias[i] = nn_gen_random() * 2;
+			nn->bias[i] = _nn_gen_random() * 2;
 		}
 	}
 
 	for (i = 0; i < nn->_n_weight; i++)
 	{
-		nn->weight[i] = nn_gen_random() * 2;
+		nn->weight[i] = _nn_gen_random() * 2;
 	}
+	nn->_version++;
 }
 
 void
@@ -497,14 +1064,15 @@ nn_randomize_with_scale(NeuralNetwork *nn, float scale)
 	{
 		for (i = 0; i < nn->_n_neuro; i++)
 		{
-			nn->bias[i] = nn_gen_random() * 2 * scale;
+			nn->bias[i] = _nn_gen_random() * 2 * scale;
 		}
 	}
 
 	for (i = 0; i < nn->_n_weight; i++)
 	{
-		nn->weight[i] = nn_gen_random() * 2 * scale ;
+		nn->weight[i] = _nn_gen_random() * 2 * scale ;
 	}
+	nn->_version++;
 }
 
 void
@@ -514,18 +1082,17 @@ nn_randomize_by_rate(NeuralNetwork *nn, float rate)
 
 	if (nn->use_bias)
 	{
-		for (i = 0; i < nn->_n_neuro; i++)
+		for (i = _nn_next_pick(-1, nn->_n_neuro, rate); i < nn->_n_neuro; i = _nn_next_pick(i, nn->_n_neuro, rate))
 		{
-			if (random_pick(rate))
-				nn->bias[i] = nn_gen_random() * 2;
+			nn->bias[i] = _nn_gen_random() * 2;
 		}
 	}
 
-	for (i = 0; i < nn->_n_weight; i++)
+	for (i = _nn_next_pick(-1, nn->_n_weight, rate); i < nn->_n_weight; i = _nn_next_pick(i, nn->_n_weight, rate))
 	{
-		if (random_pick(rate))
-			nn->weight[i] = nn_gen_random() * 2;
+		nn->weight[i] = _nn_gen_random() * 2;
 	}
+	nn->_version++;
 }
 
 void
@@ -535,19 +1102,17 @@ nn_randomize_with_scale_by_rate(NeuralNetwork *nn, float scale, float rate)
 
 	if (nn->use_bias)
 	{
-		for (i = 0; i < nn->_n_neuro; i++)
+		for (i = _nn_next_pick(-1, nn->_n_neuro, rate); i < nn->_n_neuro; i = _nn_next_pick(i, nn->_n_neuro, rate))
 		{
-			if (random_pick(rate))
-				nn->bias[i] = nn_gen_random() * 2 * scale;
+			nn->bias[i] = _nn_gen_random() * 2 * scale;
 		}
 	}
 
-	for (i = 0; i < nn->_n_weight; i++)
+	for (i = _nn_next_pick(-1, nn->_n_weight, rate); i < nn->_n_weight; i = _nn_next_pick(i, nn->_n_weight, rate))
 	{
-		if (random_pick(rate))
-			nn->weight[i] = nn_gen_random() * 2 * scale;
+		nn->weight[i] = _nn_gen_random() * 2 * scale;
 	}
-
+	nn->_version++;
 }
 
 int
@@ -613,55 +1178,185 @@ nn_savef(NeuralNetwork *nn, FILE *f)
 	return 0;
 }
 
+/* Read either the aligned format or the legacy format */
 NeuralNetwork *
 nn_loadf(FILE *f)
 {
 	NeuralNetwork *nn;
-
-	nn = malloc(sizeof(*nn));
+	int n_input;
+	int n_output;
+	int n_hidden;
+	int n_neuro_per_hidden;
+	int use_bias;
+	ACT_FUNC_TYPE act_func_type_hidden;
+	ACT_FUNC_TYPE act_func_type_output;
 
 	/* read first informations */
-	if (fread(&nn->n_input, sizeof(nn->n_input), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->n_output, sizeof(nn->n_output), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->n_hidden, sizeof(nn->n_hidden), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->n_neuro_per_hidden, sizeof(nn->n_neuro_per_hidden), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->use_bias, sizeof(nn->use_bias), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->act_func_type_hidden, sizeof(nn->act_func_type_hidden), 1, f) != 1)
-		goto __error_1;
-	if (fread(&nn->act_func_type_output, sizeof(nn->act_func_type_output), 1, f) != 1)
-		goto __error_1;
-
-	nn->_n_neuro = nn->n_output + nn->n_hidden  * nn->n_neuro_per_hidden;
-	nn->_n_weight = nn_compute_n_weight(nn);
+	if (fread(&n_input, sizeof(n_input), 1, f) != 1)
+		return NULL;
+	if ((uint32_t)n_input == NN_FILE_MAGIC)
+		return nn_load_alignedf(f);
+	if (fread(&n_output, sizeof(n_output), 1, f) != 1)
+		return NULL;
+	if (fread(&n_hidden, sizeof(n_hidden), 1, f) != 1)
+		return NULL;
+	if (fread(&n_neuro_per_hidden, sizeof(n_neuro_per_hidden), 1, f) != 1)
+		return NULL;
+	if (fread(&use_bias, sizeof(use_bias), 1, f) != 1)
+		return NULL;
+	if (fread(&act_func_type_hidden, sizeof(act_func_type_hidden), 1, f) != 1)
+		return NULL;
+	if (fread(&act_func_type_output, sizeof(act_func_type_output), 1, f) != 1)
+		return NULL;
 
-	nn->weight = malloc(nn->_n_weight * sizeof(float));
-	if (nn->use_bias)
-		nn->bias = malloc(nn->_n_neuro * sizeof(float));
-	nn->output = malloc(nn->_n_neuro * sizeof(float));
-	nn->delta = malloc(nn->_n_neuro * sizeof(float));
+	nn = nn_alloc(n_input,
+			n_output,
+			n_hidden,
+			n_neuro_per_hidden,
+			use_bias,
+			act_func_type_hidden,
+			act_func_type_output,
+			1);
+	if (nn == NULL)
+		return NULL;
 
 	/* read weight and bias */
 	if (fread(nn->weight, sizeof(float), nn->_n_weight, f) != nn->_n_weight)
-		goto __error_2;
+		goto __error;
 	if (nn->use_bias)
 	{
 		if (fread(nn->bias, sizeof(float), nn->_n_neuro, f) != nn->_n_neuro)
-			goto __error_2;
+			goto __error;
 	}
 
 	return nn;
 
-__error_1:
-	free(nn->weight);
-	free(nn->bias);
-	free(nn->output);
-	free(nn->delta);
-__error_2:
-	free(nn);
+__error:
+	nn_free(nn);
 	return NULL;
 }
+
+int
+nn_save_aligned(NeuralNetwork *nn, const char *file_name)
+{
+	int ret;
+	FILE *f;
+
+	f = fopen(file_name, "wb");
+	if (f == NULL)
+		return -1;
+
+	ret = nn_save_alignedf(nn, f);
+
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Write the aligned format.
+ * Offsets are relative to where it starts, so it has to start at an NN_FILE_ALIGN aligned
+ * position of the file to be mapped.
+ */
+int
+nn_save_alignedf(NeuralNetwork *nn, FILE *f)
+{
+	static const char zero[NN_FILE_ALIGN];
+	long pos;
+	_NNFileHeader hdr;
+
+	nn_make_header(nn, &hdr);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+	pos = sizeof(hdr);
+
+	if (fwrite(zero, 1, hdr.weight_offset - pos, f) != hdr.weight_offset - pos)
+		return -1;
+	if (fwrite(nn->weight, sizeof(float), nn->_n_weight, f) != nn->_n_weight)
+		return -1;
+	pos = hdr.weight_offset + nn->_n_weight * sizeof(float);
+
+	if (nn->use_bias)
+	{
+		if (fwrite(zero, 1, hdr.bias_offset - pos, f) != hdr.bias_offset - pos)
+			return -1;
+		if (fwrite(nn->bias, sizeof(float), nn->_n_neuro, f) != nn->_n_neuro)
+			return -1;
+		pos = hdr.bias_offset + nn->_n_neuro * sizeof(float);
+	}
+
+	if (fwrite(zero, 1, hdr.size - pos, f) != hdr.size - pos)
+		return -1;
+
+	return 0;
+}
+
+NeuralNetwork *
+nn_map(const char *file_name)
+{
+	int fd;
+	NeuralNetwork *nn;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	nn = nn_map_fd(fd, 0);
+
+	/* The mapping stays valid after the fd is closed */
+	close(fd);
+	return nn;
+}
+
+/*
+ * Map a network in the aligned format at offset of fd, weight and bias point into the mapping.
+ * The mapping is private, so the pages are shared through the page cache by every process
+ * mapping the same file, and are only copied if this network gets trained or randomized.
+ */
+NeuralNetwork *
+nn_map_fd(int fd, long offset)
+{
+	long page;
+	long base_offset;
+	size_t len;
+	char *base;
+	char *hdr_ptr;
+	struct stat st;
+	NeuralNetwork *nn;
+	_NNFileHeader hdr;
+
+	if (offset < 0 || offset % NN_FILE_ALIGN)
+		return NULL;
+	if (pread(fd, &hdr, sizeof(hdr), offset) != sizeof(hdr))
+		return NULL;
+	if (nn_check_header(&hdr))
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < offset + (long)hdr.size)
+		return NULL;
+
+	/* mmap() wants a page aligned offset */
+	page = sysconf(_SC_PAGESIZE);
+	base_offset = offset / page * page;
+	len = offset - base_offset + hdr.size;
+
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, base_offset);
+	if (base == MAP_FAILED)
+		return NULL;
+	hdr_ptr = base + (offset - base_offset);
+
+	nn = nn_alloc_by_header(&hdr, 0);
+	if (nn == NULL)
+	{
+		munmap(base, len);
+		return NULL;
+	}
+
+	nn->weight = (float *)(hdr_ptr + hdr.weight_offset);
+	if (nn->use_bias)
+		nn->bias = (float *)(hdr_ptr + hdr.bias_offset);
+	nn->_map_base = base;
+	nn->_map_len = len;
+
+	return nn;
+}
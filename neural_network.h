@@ -3,10 +3,15 @@
 
 #include <stdio.h>
 
+/* Alignment of weight and bias in the files written by nn_save_aligned() */
+#define NN_FILE_ALIGN 64
+
 typedef enum {
 	ACT_FUNC_TYPE_LINEAR,
 	ACT_FUNC_TYPE_SIGMOID,
 	ACT_FUNC_TYPE_TANH,
+	/* Output layer only, trained against cross-entropy, see nn_get_loss() */
+	ACT_FUNC_TYPE_SOFTMAX,
 } ACT_FUNC_TYPE;
 
 typedef struct {
@@ -26,6 +31,25 @@ typedef struct {
 	float *bias;
 	float *output;
 	float *delta;
+
+	/* Set if weight and bias point into a mapped file, see nn_map() */
+	void *_map_base;
+	size_t _map_len;
+
+	/* Set if weight and bias belong to someone else and are not freed with the network */
+	int _view;
+
+	/* Per layer statistics, only used when built with NN_PROFILE */
+	void *_prof;
+
+	/* Bumped whenever weight or bias changes, see nn_touch() */
+	unsigned long _version;
+
+	/* Column-major copy of the first layer for the sparse input, see nn_run_sparse() */
+	void *_sparse;
+
+	/* Loss of the last train call */
+	float _loss;
 } NeuralNetwork;
 
 NeuralNetwork *nn_create(int n_input,
@@ -38,14 +62,28 @@ NeuralNetwork *nn_create(int n_input,
 
 NeuralNetwork *nn_produce(NeuralNetwork *a, NeuralNetwork *b);
 
+int nn_produce_into(NeuralNetwork *dst, NeuralNetwork *a, NeuralNetwork *b);
+
+int nn_same_shape(NeuralNetwork *a, NeuralNetwork *b);
+
 void nn_free(NeuralNetwork *nn);
 
 NeuralNetwork *nn_duplicate(NeuralNetwork *nn);
 
+int nn_copy_into(NeuralNetwork *dst, NeuralNetwork *src);
+
+void nn_touch(NeuralNetwork *nn);
+
+unsigned int *nn_set_thread_seed(unsigned int *seed);
+
 float *nn_run(NeuralNetwork *nn, float *input);
 
+float *nn_run_with_buffer(NeuralNetwork *nn, float *input, float *buffer);
+
 float *nn_train(NeuralNetwork *nn, float *input, float *expect, float rate);
 
+float nn_get_loss(NeuralNetwork *nn);
+
 void nn_plus_randomize(NeuralNetwork *nn, float range);
 
 void nn_plus_randomize_by_rate(NeuralNetwork *nn, float range, float rate);
@@ -66,4 +104,12 @@ int nn_savef(NeuralNetwork *nn, FILE *f);
 
 NeuralNetwork *nn_loadf(FILE *f);
 
+int nn_save_aligned(NeuralNetwork *nn, const char *file_name);
+
+int nn_save_alignedf(NeuralNetwork *nn, FILE *f);
+
+NeuralNetwork *nn_map(const char *file_name);
+
+NeuralNetwork *nn_map_fd(int fd, long offset);
+
 #endif /* __NEURAL_NETWORK_H */
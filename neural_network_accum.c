@@ -0,0 +1,173 @@
+#include "neural_network_accum.h"
+#include "neural_network_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void _nn_accum_add_column(NNAccumulator *acc, int feature, float scale);
+
+/* sum += scale * (weight column of the feature) */
+static void
+_nn_accum_add_column(NNAccumulator *acc, int feature, float scale)
+{
+	int i;
+	float *sum;
+	const float *column;
+
+	sum = acc->sum;
+	column = acc->column + (long)feature * acc->n_sum;
+	if (scale == 1.0f)
+	{
+		for (i = 0; i < acc->n_sum; i++)
+			sum[i] += column[i];
+	}
+	else if (scale == -1.0f)
+	{
+		for (i = 0; i < acc->n_sum; i++)
+			sum[i] -= column[i];
+	}
+	else
+	{
+		for (i = 0; i < acc->n_sum; i++)
+			sum[i] += scale * column[i];
+	}
+}
+
+int
+nn_accum_init(NNAccumulator *acc, NeuralNetwork *nn)
+{
+	memset(acc, 0, sizeof(*acc));
+	acc->nn = nn;
+	acc->n_input = nn->n_input;
+	acc->n_sum = nn->n_hidden > 0 ? nn->n_neuro_per_hidden : nn->n_output;
+	acc->input = calloc(acc->n_input, sizeof(float));
+	acc->sum = malloc(acc->n_sum * sizeof(float));
+	acc->column = malloc((long)acc->n_input * acc->n_sum * sizeof(float));
+	acc->buffer = malloc(nn->_n_neuro * sizeof(float));
+	if (acc->input == NULL || acc->sum == NULL || acc->column == NULL || acc->buffer == NULL)
+	{
+		nn_accum_destroy(acc);
+		return -1;
+	}
+
+	nn_accum_reload(acc);
+	return 0;
+}
+
+/*
+ * Recompute the sums from the input, NULL keeps the current input.
+ * Rounding errors build up over a long run of updates, reset once in a while to drop them.
+ */
+void
+nn_accum_reset(NNAccumulator *acc, const float *input)
+{
+	int i;
+	NeuralNetwork *nn;
+
+	nn = acc->nn;
+	if (input)
+		memcpy(acc->input, input, acc->n_input * sizeof(float));
+
+	if (nn->use_bias)
+		memcpy(acc->sum, nn->bias, acc->n_sum * sizeof(float));
+	else
+		memset(acc->sum, 0, acc->n_sum * sizeof(float));
+
+	/* Only the features that are set cost anything */
+	for (i = 0; i < acc->n_input; i++)
+	{
+		if (acc->input[i] != 0)
+			_nn_accum_add_column(acc, i, acc->input[i]);
+	}
+}
+
+/* Copy the first layer of the network again and recompute the sums */
+void
+nn_accum_reload(NNAccumulator *acc)
+{
+	int i;
+	int j;
+	const float *weight;
+
+	weight = acc->nn->weight;
+	for (j = 0; j < acc->n_input; j++)
+	{
+		for (i = 0; i < acc->n_sum; i++)
+			acc->column[(long)j * acc->n_sum + i] = weight[(long)i * acc->n_input + j];
+	}
+
+	acc->version = acc->nn->_version;
+
+	nn_accum_reset(acc, NULL);
+}
+
+void
+nn_accum_set(NNAccumulator *acc, int feature, float value)
+{
+	float diff;
+
+	diff = value - acc->input[feature];
+	if (diff == 0)
+		return;
+	acc->input[feature] = value;
+	_nn_accum_add_column(acc, feature, diff);
+}
+
+void
+nn_accum_add_feature(NNAccumulator *acc, int feature)
+{
+	acc->input[feature] += 1.0f;
+	_nn_accum_add_column(acc, feature, 1.0f);
+}
+
+void
+nn_accum_remove_feature(NNAccumulator *acc, int feature)
+{
+	acc->input[feature] -= 1.0f;
+	_nn_accum_add_column(acc, feature, -1.0f);
+}
+
+void
+nn_accum_update(NNAccumulator *acc,
+		const int *added,
+		int n_added,
+		const int *removed,
+		int n_removed)
+{
+	int i;
+
+	for (i = 0; i < n_removed; i++)
+		nn_accum_remove_feature(acc, removed[i]);
+	for (i = 0; i < n_added; i++)
+		nn_accum_add_feature(acc, added[i]);
+}
+
+/* Finish the network from the sums, return the output as nn_run() does */
+float *
+nn_accum_run(NNAccumulator *acc)
+{
+	NeuralNetwork *nn;
+
+	nn = acc->nn;
+	if (acc->version != nn->_version)
+		nn_accum_reload(acc);
+
+	memcpy(acc->buffer, acc->sum, acc->n_sum * sizeof(float));
+	if (nn->n_hidden == 0)
+	{
+		_nn_act_func_apply(nn->act_func_type_output, acc->buffer, acc->n_sum);
+		return acc->buffer;
+	}
+
+	_nn_act_func_apply(nn->act_func_type_hidden, acc->buffer, acc->n_sum);
+	return _nn_run_from(nn, 1, acc->buffer, acc->buffer);
+}
+
+void
+nn_accum_destroy(NNAccumulator *acc)
+{
+	free(acc->input);
+	free(acc->sum);
+	free(acc->column);
+	free(acc->buffer);
+	memset(acc, 0, sizeof(*acc));
+}
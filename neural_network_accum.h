@@ -0,0 +1,46 @@
+#ifndef __NEURAL_NETWORK_ACCUM_H
+#define __NEURAL_NETWORK_ACCUM_H
+
+#include "neural_network.h"
+
+/*
+ * Keep the sums of the first layer for an input that changes by a few features at a time.
+ * Changing a feature adds its weight column to the sums, so it costs the width of the
+ * first layer instead of the whole first layer.
+ * The first layer is copied into columns when the accumulator is initialized, it's copied again
+ * by nn_accum_run() after the network changes (see nn_touch()), or by nn_accum_reload().
+ */
+typedef struct {
+	NeuralNetwork *nn;
+	int n_input;
+	int n_sum;	/* Number of the neuro of the first layer */
+	float *input;	/* The current input */
+	float *sum;	/* Sums of the first layer, without the activation function */
+	float *column;	/* The first layer, n_sum floats per input */
+	float *buffer;	/* Outputs of the layers, laid out as nn->output */
+	unsigned long version;	/* nn->_version the columns were copied at */
+} NNAccumulator;
+
+int nn_accum_init(NNAccumulator *acc, NeuralNetwork *nn);
+
+void nn_accum_reset(NNAccumulator *acc, const float *input);
+
+void nn_accum_reload(NNAccumulator *acc);
+
+void nn_accum_set(NNAccumulator *acc, int feature, float value);
+
+void nn_accum_add_feature(NNAccumulator *acc, int feature);
+
+void nn_accum_remove_feature(NNAccumulator *acc, int feature);
+
+void nn_accum_update(NNAccumulator *acc,
+		const int *added,
+		int n_added,
+		const int *removed,
+		int n_removed);
+
+float *nn_accum_run(NNAccumulator *acc);
+
+void nn_accum_destroy(NNAccumulator *acc);
+
+#endif /* __NEURAL_NETWORK_ACCUM_H */
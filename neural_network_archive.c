@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include "neural_network_archive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define NN_ARCHIVE_MAGIC	0x52414e4e	/* "NNAR" */
+#define NN_ARCHIVE_VERSION	1
+
+/*
+ * File layout:
+ *   header, padded to NN_FILE_ALIGN
+ *   networks in the aligned format, each starts NN_FILE_ALIGN aligned
+ *   index, an NNArchiveEntry for every network
+ *   trailer
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} _NNArchiveHeader;
+
+typedef struct {
+	uint64_t index_offset;
+	uint32_t n_entry;
+	uint32_t magic;
+} _NNArchiveTrailer;
+
+typedef struct {
+	NNArchive *ar;
+	int rank;
+} _NNArchiveAppend;
+
+static int _nn_archive_pad(FILE *f);
+
+static int _nn_archive_append_one(NeuralNetwork *nn, float goodness, void *arg);
+
+static int _nn_archive_rank_cmp(const void *a, const void *b, void *arg);
+
+/* Pad f to the next NN_FILE_ALIGN aligned position */
+static int
+_nn_archive_pad(FILE *f)
+{
+	static const char zero[NN_FILE_ALIGN];
+	long pos;
+	long len;
+
+	pos = ftell(f);
+	if (pos < 0)
+		return -1;
+
+	len = (NN_FILE_ALIGN - pos % NN_FILE_ALIGN) % NN_FILE_ALIGN;
+	if (fwrite(zero, 1, len, f) != len)
+		return -1;
+
+	return 0;
+}
+
+static int
+_nn_archive_append_one(NeuralNetwork *nn, float goodness, void *arg)
+{
+	_NNArchiveAppend *append = arg;
+
+	/* The rank in the elite list is the tag */
+	return nn_archive_append(append->ar, nn, goodness, append->rank++) < 0 ? -1 : 0;
+}
+
+static int
+_nn_archive_rank_cmp(const void *a, const void *b, void *arg)
+{
+	NNArchive *ar = arg;
+	float ga = ar->entries[*(const int *)a].goodness;
+	float gb = ar->entries[*(const int *)b].goodness;
+
+	if (ga < gb)
+		return 1;
+	if (ga > gb)
+		return -1;
+	return *(const int *)a - *(const int *)b;
+}
+
+int
+nn_archive_create(NNArchive *ar, const char *file_name)
+{
+	_NNArchiveHeader hdr;
+
+	memset(ar, 0, sizeof(*ar));
+	ar->fd = -1;
+
+	ar->f = fopen(file_name, "wb");
+	if (ar->f == NULL)
+		return -1;
+
+	hdr.magic = NN_ARCHIVE_MAGIC;
+	hdr.version = NN_ARCHIVE_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, ar->f) != 1 ||
+		_nn_archive_pad(ar->f))
+	{
+		fclose(ar->f);
+		ar->f = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Return the id of the appended network, -1 on error */
+int
+nn_archive_append(NNArchive *ar, NeuralNetwork *nn, float goodness, uint64_t tag)
+{
+	int max;
+	long pos;
+	NNArchiveEntry *entries;
+	NNArchiveEntry *e;
+
+	if (ar->f == NULL)
+		return -1;
+
+	if (ar->n_entry >= ar->max_entry)
+	{
+		max = ar->max_entry ? ar->max_entry * 2 : 64;
+		entries = realloc(ar->entries, max * sizeof(*entries));
+		if (entries == NULL)
+			return -1;
+		ar->entries = entries;
+		ar->max_entry = max;
+	}
+
+	pos = ftell(ar->f);
+	if (pos < 0 || nn_save_alignedf(nn, ar->f))
+		return -1;
+
+	e = &ar->entries[ar->n_entry];
+	memset(e, 0, sizeof(*e));
+	e->offset = pos;
+	e->size = ftell(ar->f) - pos;
+	e->tag = tag;
+	e->goodness = goodness;
+	e->n_input = nn->n_input;
+	e->n_output = nn->n_output;
+	e->n_hidden = nn->n_hidden;
+	e->n_neuro_per_hidden = nn->n_neuro_per_hidden;
+	e->use_bias = nn->use_bias;
+	e->act_func_type_hidden = nn->act_func_type_hidden;
+	e->act_func_type_output = nn->act_func_type_output;
+
+	return ar->n_entry++;
+}
+
+/* Append every elite from the best to the worst, tagged by its rank */
+int
+nn_archive_append_elites(NNArchive *ar, NNEliteList *list)
+{
+	_NNArchiveAppend append;
+
+	append.ar = ar;
+	append.rank = 0;
+
+	return nn_elites_foreach(list, _nn_archive_append_one, &append);
+}
+
+/* Only the trailer and the index are read */
+int
+nn_archive_open(NNArchive *ar, const char *file_name)
+{
+	int i;
+	struct stat st;
+	size_t len;
+	_NNArchiveHeader hdr;
+	_NNArchiveTrailer trailer;
+
+	memset(ar, 0, sizeof(*ar));
+
+	ar->fd = open(file_name, O_RDONLY);
+	if (ar->fd < 0)
+		return -1;
+
+	if (fstat(ar->fd, &st) ||
+		st.st_size < (long)(sizeof(hdr) + sizeof(trailer)))
+		goto __error;
+
+	if (pread(ar->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		hdr.magic != NN_ARCHIVE_MAGIC ||
+		hdr.version != NN_ARCHIVE_VERSION)
+		goto __error;
+
+	if (pread(ar->fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+		trailer.magic != NN_ARCHIVE_MAGIC)
+		goto __error;
+
+	/* The index has to fit between the header and the trailer before anything is sized by it */
+	if (trailer.n_entry > INT_MAX ||
+		trailer.n_entry > (st.st_size - sizeof(hdr) - sizeof(trailer)) / sizeof(*ar->entries))
+		goto __error;
+	len = trailer.n_entry * sizeof(*ar->entries);
+	if (trailer.index_offset + len + sizeof(trailer) != (uint64_t)st.st_size)
+		goto __error;
+
+	ar->n_entry = trailer.n_entry;
+	ar->max_entry = trailer.n_entry;
+	ar->entries = malloc(len + 1);
+	ar->rank = malloc(ar->n_entry * sizeof(*ar->rank) + 1);
+	if (ar->entries == NULL || ar->rank == NULL)
+		goto __error;
+
+	if (len && pread(ar->fd, ar->entries, len, trailer.index_offset) != (ssize_t)len)
+		goto __error;
+
+	for (i = 0; i < ar->n_entry; i++)
+	{
+		if (ar->entries[i].offset > trailer.index_offset ||
+			ar->entries[i].size > trailer.index_offset - ar->entries[i].offset)
+			goto __error;
+		ar->rank[i] = i;
+	}
+
+	qsort_r(ar->rank, ar->n_entry, sizeof(*ar->rank), _nn_archive_rank_cmp, ar);
+
+	return 0;
+
+__error:
+	close(ar->fd);
+	free(ar->entries);
+	free(ar->rank);
+	memset(ar, 0, sizeof(*ar));
+	ar->fd = -1;
+	return -1;
+}
+
+int
+nn_archive_get_count(NNArchive *ar)
+{
+	return ar->n_entry;
+}
+
+const NNArchiveEntry *
+nn_archive_get_entry(NNArchive *ar, int id)
+{
+	if (id < 0 || id >= ar->n_entry)
+		return NULL;
+
+	return &ar->entries[id];
+}
+
+/* Rank 0 is the best, only for an opened archive */
+int
+nn_archive_get_id_by_rank(NNArchive *ar, int rank)
+{
+	if (ar->rank == NULL || rank < 0 || rank >= ar->n_entry)
+		return -1;
+
+	return ar->rank[rank];
+}
+
+/* Read a copy of the network, nothing else in the file is touched */
+NeuralNetwork *
+nn_archive_load(NNArchive *ar, int id)
+{
+	char *buf;
+	FILE *f;
+	NeuralNetwork *nn;
+	const NNArchiveEntry *e;
+
+	e = nn_archive_get_entry(ar, id);
+	if (e == NULL || ar->fd < 0)
+		return NULL;
+
+	buf = malloc(e->size);
+	if (buf == NULL)
+		return NULL;
+
+	nn = NULL;
+	if (pread(ar->fd, buf, e->size, e->offset) == (ssize_t)e->size)
+	{
+		f = fmemopen(buf, e->size, "rb");
+		if (f)
+		{
+			nn = nn_loadf(f);
+			fclose(f);
+		}
+	}
+
+	free(buf);
+	return nn;
+}
+
+/* Map the network in place, see nn_map_fd() */
+NeuralNetwork *
+nn_archive_map(NNArchive *ar, int id)
+{
+	const NNArchiveEntry *e;
+
+	e = nn_archive_get_entry(ar, id);
+	if (e == NULL || ar->fd < 0)
+		return NULL;
+
+	return nn_map_fd(ar->fd, e->offset);
+}
+
+/* Writing: write the index and the trailer. Mapped networks stay valid after closing. */
+int
+nn_archive_close(NNArchive *ar)
+{
+	int ret;
+	_NNArchiveTrailer trailer;
+
+	ret = 0;
+	if (ar->f)
+	{
+		trailer.index_offset = ftell(ar->f);
+		trailer.n_entry = ar->n_entry;
+		trailer.magic = NN_ARCHIVE_MAGIC;
+		if ((ar->n_entry && fwrite(ar->entries, sizeof(*ar->entries), ar->n_entry, ar->f) != ar->n_entry) ||
+			fwrite(&trailer, sizeof(trailer), 1, ar->f) != 1)
+			ret = -1;
+		if (fclose(ar->f))
+			ret = -1;
+	}
+
+	if (ar->fd >= 0)
+		close(ar->fd);
+
+	free(ar->entries);
+	free(ar->rank);
+	memset(ar, 0, sizeof(*ar));
+	ar->fd = -1;
+
+	return ret;
+}
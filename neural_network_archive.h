@@ -0,0 +1,56 @@
+#ifndef __NEURAL_NETWORK_ARCHIVE_H
+#define __NEURAL_NETWORK_ARCHIVE_H
+
+#include <stdint.h>
+#include "neural_network.h"
+#include "neural_network_elite.h"
+
+/* One network in the archive, found by its id (the order it was appended) */
+typedef struct {
+	uint64_t offset;	/* Where the network is in the aligned format */
+	uint64_t size;
+	uint64_t tag;		/* Anything the user wants */
+	float goodness;
+	int32_t n_input;
+	int32_t n_output;
+	int32_t n_hidden;
+	int32_t n_neuro_per_hidden;
+	int32_t use_bias;
+	int32_t act_func_type_hidden;
+	int32_t act_func_type_output;
+} NNArchiveEntry;
+
+/*
+ * Networks are stored one after another and indexed at the end of the file,
+ * so opening an archive only reads the index.
+ */
+typedef struct {
+	FILE *f;		/* Set when writing */
+	int fd;			/* Set when reading */
+	int n_entry;
+	int max_entry;
+	NNArchiveEntry *entries;
+	int *rank;		/* Ids from the best to the worst */
+} NNArchive;
+
+int nn_archive_create(NNArchive *ar, const char *file_name);
+
+int nn_archive_append(NNArchive *ar, NeuralNetwork *nn, float goodness, uint64_t tag);
+
+int nn_archive_append_elites(NNArchive *ar, NNEliteList *list);
+
+int nn_archive_open(NNArchive *ar, const char *file_name);
+
+int nn_archive_get_count(NNArchive *ar);
+
+const NNArchiveEntry *nn_archive_get_entry(NNArchive *ar, int id);
+
+int nn_archive_get_id_by_rank(NNArchive *ar, int rank);
+
+NeuralNetwork *nn_archive_load(NNArchive *ar, int id);
+
+NeuralNetwork *nn_archive_map(NNArchive *ar, int id);
+
+int nn_archive_close(NNArchive *ar);
+
+#endif /* __NEURAL_NETWORK_ARCHIVE_H */
@@ -0,0 +1,287 @@
+#include "neural_network_batch.h"
+#include "neural_network_private.h"
+#include "neural_network_util.h"
+#include <stdlib.h>
+
+/* So many inputs are run through every network before moving to the next inputs */
+#define NN_BATCH_CHUNK 64
+
+static void _nn_batch_layer(const float *x,
+		int n_batch,
+		int n_input,
+		const float *weight,
+		const float *bias,
+		int n_output,
+		float *y,
+		int ldy);
+
+static void _nn_batch_run_chunk(NeuralNetwork *nn,
+		const float *x,
+		int n_batch,
+		float *buf0,
+		float *buf1,
+		float *y);
+
+static void _nn_batch_post_chunk(const NNBatchPost *post, float *y, int b, int n_batch, int n_output);
+
+/*
+ * y[b * ldy + i] = bias[i] + (i-th row of weight) dot (b-th row of x)
+ * 4 inputs times 2 neurons are computed at a time, so every weight loaded is used 4 times
+ * and every input loaded is used twice.
+ */
+static void
+_nn_batch_layer(const float *x,
+		int n_batch,
+		int n_input,
+		const float *weight,
+		const float *bias,
+		int n_output,
+		float *y,
+		int ldy)
+{
+	int b;
+	int i;
+	int k;
+	float s00, s01, s10, s11, s20, s21, s30, s31;
+	const float *x0, *x1, *x2, *x3;
+	const float *w0, *w1;
+	float s;
+
+	for (b = 0; b + 4 <= n_batch; b += 4)
+	{
+		x0 = &x[(b + 0) * n_input];
+		x1 = &x[(b + 1) * n_input];
+		x2 = &x[(b + 2) * n_input];
+		x3 = &x[(b + 3) * n_input];
+
+		for (i = 0; i + 2 <= n_output; i += 2)
+		{
+			w0 = &weight[i * n_input];
+			w1 = &weight[(i + 1) * n_input];
+			s00 = s10 = s20 = s30 = bias ? bias[i] : 0;
+			s01 = s11 = s21 = s31 = bias ? bias[i + 1] : 0;
+			for (k = 0; k < n_input; k++)
+			{
+				s00 += w0[k] * x0[k];
+				s01 += w1[k] * x0[k];
+				s10 += w0[k] * x1[k];
+				s11 += w1[k] * x1[k];
+				s20 += w0[k] * x2[k];
+				s21 += w1[k] * x2[k];
+				s30 += w0[k] * x3[k];
+				s31 += w1[k] * x3[k];
+			}
+			y[(b + 0) * ldy + i] = s00;
+			y[(b + 0) * ldy + i + 1] = s01;
+			y[(b + 1) * ldy + i] = s10;
+			y[(b + 1) * ldy + i + 1] = s11;
+			y[(b + 2) * ldy + i] = s20;
+			y[(b + 2) * ldy + i + 1] = s21;
+			y[(b + 3) * ldy + i] = s30;
+			y[(b + 3) * ldy + i + 1] = s31;
+		}
+
+		/* The odd neuro left */
+		if (i < n_output)
+		{
+			w0 = &weight[i * n_input];
+			s00 = s10 = s20 = s30 = bias ? bias[i] : 0;
+			for (k = 0; k < n_input; k++)
+			{
+				s00 += w0[k] * x0[k];
+				s10 += w0[k] * x1[k];
+				s20 += w0[k] * x2[k];
+				s30 += w0[k] * x3[k];
+			}
+			y[(b + 0) * ldy + i] = s00;
+			y[(b + 1) * ldy + i] = s10;
+			y[(b + 2) * ldy + i] = s20;
+			y[(b + 3) * ldy + i] = s30;
+		}
+	}
+
+	/* The inputs left */
+	for (; b < n_batch; b++)
+	{
+		x0 = &x[b * n_input];
+		for (i = 0; i < n_output; i++)
+		{
+			w0 = &weight[i * n_input];
+			s = bias ? bias[i] : 0;
+			for (k = 0; k < n_input; k++)
+				s += w0[k] * x0[k];
+			y[b * ldy + i] = s;
+		}
+	}
+}
+
+/* Run n_batch (<= NN_BATCH_CHUNK) inputs through nn, layer by layer */
+static void
+_nn_batch_run_chunk(NeuralNetwork *nn,
+		const float *x,
+		int n_batch,
+		float *buf0,
+		float *buf1,
+		float *y)
+{
+	int i;
+	int b;
+	int n_input;
+	int n_output;
+	const float *weight;
+	const float *bias;
+	float *tmp;
+
+	n_input = nn->n_input;
+	weight = nn->weight;
+	bias = nn->use_bias ? nn->bias : NULL;
+
+	/*
+	 * 1. Process the hidden layers if any
+	 */
+	for (i = 0; i < nn->n_hidden; i++)
+	{
+		n_output = nn->n_neuro_per_hidden;
+		_nn_batch_layer(x, n_batch, n_input, weight, bias, n_output, buf0, n_output);
+		for (b = 0; b < n_batch; b++)
+			_nn_act_func_apply(nn->act_func_type_hidden, &buf0[b * n_output], n_output);
+
+		/* Output of this layer is the next layer's input */
+		x = buf0;
+		tmp = buf0;
+		buf0 = buf1;
+		buf1 = tmp;
+		weight += n_input * n_output;
+		if (bias)
+			bias += n_output;
+		n_input = n_output;
+	}
+
+	/*
+	 * 2. Process the output layer, straight into y
+	 */
+	n_output = nn->n_output;
+	_nn_batch_layer(x, n_batch, n_input, weight, bias, n_output, y, n_output);
+	for (b = 0; b < n_batch; b++)
+		_nn_act_func_apply(nn->act_func_type_output, &y[b * n_output], n_output);
+}
+
+/* Post-process the rows b to b + n_batch, which are at y and still in cache */
+static void
+_nn_batch_post_chunk(const NNBatchPost *post, float *y, int b, int n_batch, int n_output)
+{
+	int i;
+	int n_word;
+
+	if (post->softmax)
+		nn_util_softmax_batch(y, n_batch, n_output);
+	if (post->top_k == 1)
+	{
+		nn_util_find_most_possible_batch(y, n_batch, n_output, &post->index[b]);
+		if (post->score)
+		{
+			for (i = 0; i < n_batch; i++)
+				post->score[b + i] = y[(long)i * n_output + post->index[b + i]];
+		}
+	}
+	else if (post->top_k > 1)
+	{
+		nn_util_top_k_batch(y,
+				n_batch,
+				n_output,
+				post->top_k,
+				&post->index[(long)b * post->top_k],
+				post->score ? &post->score[(long)b * post->top_k] : NULL);
+	}
+	if (post->mask)
+	{
+		n_word = (n_output + 63) / 64;
+		nn_util_threshold_batch(y, n_batch, n_output, post->threshold, &post->mask[(long)b * n_word]);
+	}
+}
+
+/*
+ * Run every input through every network.
+ * The inputs are processed NN_BATCH_CHUNK at a time, the chunk stays in cache while it's run
+ * through the whole population, and every weight loaded is used for several inputs at once.
+ * If post is not NULL, the outputs of every chunk are post-processed while they're still in cache,
+ * its rows are laid out as the outputs are. outputs can be NULL then if only those are wanted.
+ */
+int
+nn_run_population(NeuralNetwork **nns,
+		int n_nn,
+		const float *inputs,
+		int n_batch,
+		float *outputs,
+		const NNBatchPost *post)
+{
+	int i;
+	int b;
+	int n_batch_chunk;
+	int width;
+	float *buf0;
+	float *buf1;
+	float *y;
+	NeuralNetwork *nn;
+
+	if (n_nn < 1 || n_batch < 1)
+		return 0;
+	if (outputs == NULL && post == NULL)
+		return -1;
+	if (post && post->top_k > 0 && post->index == NULL)
+		return -1;
+
+	for (i = 1; i < n_nn; i++)
+	{
+		if (!nn_same_shape(nns[0], nns[i]))
+			return -1;
+	}
+
+	/* Buffers of the hidden layers' outputs of a chunk, and of the output layer's without outputs */
+	width = nns[0]->n_hidden > 0 ? nns[0]->n_neuro_per_hidden : 1;
+	buf0 = malloc((2 * width + (outputs ? 0 : nns[0]->n_output)) * NN_BATCH_CHUNK * sizeof(float));
+	if (buf0 == NULL)
+		return -1;
+	buf1 = &buf0[NN_BATCH_CHUNK * width];
+
+	for (b = 0; b < n_batch; b += NN_BATCH_CHUNK)
+	{
+		n_batch_chunk = n_batch - b < NN_BATCH_CHUNK ? n_batch - b : NN_BATCH_CHUNK;
+		for (i = 0; i < n_nn; i++)
+		{
+			nn = nns[i];
+			if (outputs)
+				y = &outputs[((long)i * n_batch + b) * nn->n_output];
+			else
+				y = &buf1[NN_BATCH_CHUNK * width];
+			_nn_batch_run_chunk(nn,
+					&inputs[(long)b * nn->n_input],
+					n_batch_chunk,
+					buf0,
+					buf1,
+					y);
+			if (post)
+				_nn_batch_post_chunk(post, y, i * n_batch + b, n_batch_chunk, nn->n_output);
+		}
+	}
+
+	free(buf0);
+
+	return 0;
+}
+
+int
+nn_run_batch(NeuralNetwork *nn, const float *inputs, int n_batch, float *outputs)
+{
+	return nn_run_population(&nn, 1, inputs, n_batch, outputs, NULL);
+}
+
+int
+nn_run_batch_post(NeuralNetwork *nn,
+		const float *inputs,
+		int n_batch,
+		float *outputs,
+		const NNBatchPost *post)
+{
+	return nn_run_population(&nn, 1, inputs, n_batch, outputs, post);
+}
@@ -0,0 +1,41 @@
+#ifndef __NEURAL_NETWORK_BATCH_H
+#define __NEURAL_NETWORK_BATCH_H
+
+#include <stdint.h>
+#include "neural_network.h"
+
+/*
+ * What's done with the outputs of every input, see nn_util_*_batch().
+ * The rows are laid out as the outputs, n_nn blocks of n_batch rows for a population.
+ */
+typedef struct {
+	int softmax;		/* Normalize the outputs first, not needed with a softmax output */
+	int top_k;		/* 0 for none, 1 for the argmax */
+	int *index;		/* Rows of top_k */
+	float *score;		/* Rows of top_k, can be NULL */
+	float threshold;
+	uint64_t *mask;		/* Rows of (n_output + 63) / 64 words, NULL for none */
+} NNBatchPost;
+
+/*
+ * inputs is n_batch rows of n_input.
+ * outputs is n_nn blocks of n_batch rows of n_output, the j-th output of nns[i] is at
+ * outputs[(i * n_batch + j) * n_output].
+ * post can be NULL, outputs can be NULL if post isn't.
+ */
+int nn_run_population(NeuralNetwork **nns,
+		int n_nn,
+		const float *inputs,
+		int n_batch,
+		float *outputs,
+		const NNBatchPost *post);
+
+int nn_run_batch(NeuralNetwork *nn, const float *inputs, int n_batch, float *outputs);
+
+int nn_run_batch_post(NeuralNetwork *nn,
+		const float *inputs,
+		int n_batch,
+		float *outputs,
+		const NNBatchPost *post);
+
+#endif /* __NEURAL_NETWORK_BATCH_H */
@@ -0,0 +1,226 @@
+#include "neural_network_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* No slot, the end of a chain */
+#define NN_CACHE_NIL	(-1)
+
+typedef struct {
+	unsigned long version;	/* nn->_version the outputs were computed at */
+	int n_input;
+	int n_output;
+	int n_bucket;		/* A power of 2 */
+	int *bucket;		/* First slot of every chain */
+	int *next;		/* Next slot in the same chain */
+	uint64_t *hash;
+	unsigned char *used;
+	unsigned char *referenced;	/* CLOCK bit, set on every hit */
+	float *key;		/* n_input floats per slot */
+	float *value;		/* n_output floats per slot */
+	int hand;		/* CLOCK hand */
+} _NNCachePriv;
+
+static uint64_t _nn_cache_hash(const float *input, int n);
+
+static void _nn_cache_unlink(_NNCachePriv *priv, int slot);
+
+static int _nn_cache_victim(NNRunCache *cache);
+
+/* Multiply and xor-shift over the bits of the floats, much cheaper than a run */
+static uint64_t
+_nn_cache_hash(const float *input, int n)
+{
+	int i;
+	uint32_t x;
+	uint64_t h;
+
+	h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)n;
+	for (i = 0; i < n; i++)
+	{
+		memcpy(&x, &input[i], sizeof(x));
+		h = (h ^ x) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	h ^= h >> 29;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* Take slot out of its chain */
+static void
+_nn_cache_unlink(_NNCachePriv *priv, int slot)
+{
+	int *p;
+
+	p = &priv->bucket[priv->hash[slot] & (priv->n_bucket - 1)];
+	while (*p != slot)
+		p = &priv->next[*p];
+	*p = priv->next[slot];
+}
+
+/* Return a free slot, evicting the first one not referenced since the hand passed it */
+static int
+_nn_cache_victim(NNRunCache *cache)
+{
+	int slot;
+	_NNCachePriv *priv;
+
+	priv = cache->priv;
+	for (;;)
+	{
+		slot = priv->hand;
+		priv->hand = (priv->hand + 1) % cache->n_slot;
+
+		if (!priv->used[slot])
+			return slot;
+		if (!priv->referenced[slot])
+			break;
+		priv->referenced[slot] = 0;
+	}
+
+	_nn_cache_unlink(priv, slot);
+	priv->used[slot] = 0;
+	cache->n_evict++;
+
+	return slot;
+}
+
+int
+nn_cache_init(NNRunCache *cache, NeuralNetwork *nn, int n_slot)
+{
+	_NNCachePriv *priv;
+
+	memset(cache, 0, sizeof(*cache));
+	if (n_slot < 1)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	cache->nn = nn;
+	cache->n_slot = n_slot;
+	cache->priv = priv;
+
+	priv->n_input = nn->n_input;
+	priv->n_output = nn->n_output;
+	for (priv->n_bucket = 1; priv->n_bucket < n_slot; priv->n_bucket *= 2)
+		;
+	priv->bucket = malloc(priv->n_bucket * sizeof(int));
+	priv->next = malloc(n_slot * sizeof(int));
+	priv->hash = malloc(n_slot * sizeof(uint64_t));
+	priv->used = malloc(n_slot);
+	priv->referenced = malloc(n_slot);
+	priv->key = malloc((long)n_slot * priv->n_input * sizeof(float));
+	priv->value = malloc((long)n_slot * priv->n_output * sizeof(float));
+	if (priv->bucket == NULL || priv->next == NULL || priv->hash == NULL || priv->used == NULL ||
+		priv->referenced == NULL || priv->key == NULL || priv->value == NULL)
+	{
+		nn_cache_destroy(cache);
+		return -1;
+	}
+
+	nn_cache_clear(cache);
+	return 0;
+}
+
+/* Return the output of nn_run(input), it's valid until the next call */
+float *
+nn_cache_run(NNRunCache *cache, float *input)
+{
+	int slot;
+	uint64_t h;
+	float *key;
+	float *output;
+	_NNCachePriv *priv;
+
+	priv = cache->priv;
+	if (priv->version != cache->nn->_version)
+	{
+		nn_cache_clear(cache);
+		cache->n_invalidate++;
+	}
+
+	h = _nn_cache_hash(input, priv->n_input);
+	for (slot = priv->bucket[h & (priv->n_bucket - 1)]; slot != NN_CACHE_NIL; slot = priv->next[slot])
+	{
+		key = priv->key + (long)slot * priv->n_input;
+		if (priv->hash[slot] == h && memcmp(key, input, priv->n_input * sizeof(float)) == 0)
+		{
+			priv->referenced[slot] = 1;
+			cache->n_hit++;
+			return priv->value + (long)slot * priv->n_output;
+		}
+	}
+
+	cache->n_miss++;
+	output = nn_run(cache->nn, input);
+
+	slot = _nn_cache_victim(cache);
+	priv->hash[slot] = h;
+	priv->used[slot] = 1;
+	priv->referenced[slot] = 0;
+	memcpy(priv->key + (long)slot * priv->n_input, input, priv->n_input * sizeof(float));
+	memcpy(priv->value + (long)slot * priv->n_output, output, priv->n_output * sizeof(float));
+	priv->next[slot] = priv->bucket[h & (priv->n_bucket - 1)];
+	priv->bucket[h & (priv->n_bucket - 1)] = slot;
+
+	return priv->value + (long)slot * priv->n_output;
+}
+
+/* Drop every output */
+void
+nn_cache_clear(NNRunCache *cache)
+{
+	int i;
+	_NNCachePriv *priv;
+
+	priv = cache->priv;
+	for (i = 0; i < priv->n_bucket; i++)
+		priv->bucket[i] = NN_CACHE_NIL;
+	memset(priv->used, 0, cache->n_slot);
+	memset(priv->referenced, 0, cache->n_slot);
+	priv->hand = 0;
+	priv->version = cache->nn->_version;
+}
+
+/* Return hits over lookups, 0 if there was none */
+double
+nn_cache_get_hit_rate(NNRunCache *cache)
+{
+	if (cache->n_hit + cache->n_miss == 0)
+		return 0;
+
+	return (double)cache->n_hit / (cache->n_hit + cache->n_miss);
+}
+
+void
+nn_cache_reset_stats(NNRunCache *cache)
+{
+	cache->n_hit = 0;
+	cache->n_miss = 0;
+	cache->n_evict = 0;
+	cache->n_invalidate = 0;
+}
+
+void
+nn_cache_destroy(NNRunCache *cache)
+{
+	_NNCachePriv *priv;
+
+	priv = cache->priv;
+	if (priv)
+	{
+		free(priv->bucket);
+		free(priv->next);
+		free(priv->hash);
+		free(priv->used);
+		free(priv->referenced);
+		free(priv->key);
+		free(priv->value);
+		free(priv);
+	}
+	memset(cache, 0, sizeof(*cache));
+}
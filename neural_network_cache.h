@@ -0,0 +1,37 @@
+#ifndef __NEURAL_NETWORK_CACHE_H
+#define __NEURAL_NETWORK_CACHE_H
+
+#include "neural_network.h"
+
+/*
+ * Remember the outputs of the last n_slot different inputs of a network.
+ * Inputs are matched by a hash and then compared bit by bit, so a hit is exactly what nn_run() returns.
+ * The least recently used ones are evicted by the CLOCK algorithm, and everything is dropped
+ * once the network changes (see nn_touch()).
+ */
+typedef struct {
+	NeuralNetwork *nn;
+	int n_slot;
+
+	/* Statistics since nn_cache_init() or nn_cache_reset_stats() */
+	long n_hit;
+	long n_miss;
+	long n_evict;
+	long n_invalidate;	/* Times everything was dropped because the network changed */
+
+	void *priv;
+} NNRunCache;
+
+int nn_cache_init(NNRunCache *cache, NeuralNetwork *nn, int n_slot);
+
+float *nn_cache_run(NNRunCache *cache, float *input);
+
+void nn_cache_clear(NNRunCache *cache);
+
+double nn_cache_get_hit_rate(NNRunCache *cache);
+
+void nn_cache_reset_stats(NNRunCache *cache);
+
+void nn_cache_destroy(NNRunCache *cache);
+
+#endif /* __NEURAL_NETWORK_CACHE_H */
@@ -0,0 +1,233 @@
+#include "neural_network_checkpoint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+
+typedef struct {
+	char *file_name;
+	char *tmp_name;
+	NeuralNetwork *buffer[2];
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;	/* Buffer waiting to be written, -1 if none */
+	int writing;	/* Buffer being written, -1 if none */
+	int stop;
+	int n_written;
+	int error;
+} _NNCheckpointPriv;
+
+static void *_nn_checkpoint_thread(void *arg);
+
+static int _nn_checkpoint_write(_NNCheckpointPriv *priv, NeuralNetwork *nn);
+
+static void *
+_nn_checkpoint_thread(void *arg)
+{
+	int b;
+	int ret;
+	_NNCheckpointPriv *priv = arg;
+
+	pthread_mutex_lock(&priv->lock);
+	for (;;)
+	{
+		while (priv->pending < 0 && !priv->stop)
+			pthread_cond_wait(&priv->cond, &priv->lock);
+		if (priv->pending < 0)
+			break;
+
+		b = priv->pending;
+		priv->pending = -1;
+		priv->writing = b;
+		pthread_mutex_unlock(&priv->lock);
+
+		ret = _nn_checkpoint_write(priv, priv->buffer[b]);
+
+		pthread_mutex_lock(&priv->lock);
+		priv->writing = -1;
+		priv->n_written++;
+		priv->error = ret;
+		pthread_cond_broadcast(&priv->cond);
+	}
+	pthread_mutex_unlock(&priv->lock);
+
+	return NULL;
+}
+
+static int
+_nn_checkpoint_write(_NNCheckpointPriv *priv, NeuralNetwork *nn)
+{
+	int fd;
+	FILE *f;
+	char *dir_name;
+
+	f = fopen(priv->tmp_name, "wb");
+	if (f == NULL)
+		return -1;
+
+	if (nn_save_alignedf(nn, f) ||
+		fflush(f) ||
+		fsync(fileno(f)))
+	{
+		fclose(f);
+		unlink(priv->tmp_name);
+		return -1;
+	}
+	if (fclose(f))
+		return -1;
+
+	if (rename(priv->tmp_name, priv->file_name))
+		return -1;
+
+	/* Make the rename durable */
+	dir_name = strdup(priv->file_name);
+	if (dir_name)
+	{
+		fd = open(dirname(dir_name), O_RDONLY | O_DIRECTORY);
+		if (fd >= 0)
+		{
+			fsync(fd);
+			close(fd);
+		}
+		free(dir_name);
+	}
+
+	return 0;
+}
+
+int
+nn_checkpoint_start(NNCheckpoint *cp, NeuralNetwork *nn, const char *file_name)
+{
+	_NNCheckpointPriv *priv;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+
+	priv->file_name = strdup(file_name);
+	priv->tmp_name = malloc(strlen(file_name) + 5);
+	/* Allocated once, snapshots are just memcpy */
+	priv->buffer[0] = nn_duplicate(nn);
+	priv->buffer[1] = nn_duplicate(nn);
+	if (priv->file_name == NULL ||
+		priv->tmp_name == NULL ||
+		priv->buffer[0] == NULL ||
+		priv->buffer[1] == NULL)
+		goto __error;
+	sprintf(priv->tmp_name, "%s.tmp", file_name);
+
+	priv->pending = -1;
+	priv->writing = -1;
+	pthread_mutex_init(&priv->lock, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+
+	if (pthread_create(&priv->thread, NULL, _nn_checkpoint_thread, priv))
+	{
+		pthread_mutex_destroy(&priv->lock);
+		pthread_cond_destroy(&priv->cond);
+		goto __error;
+	}
+
+	cp->nn = nn;
+	cp->priv = priv;
+
+	return 0;
+
+__error:
+	if (priv->buffer[0])
+		nn_free(priv->buffer[0]);
+	if (priv->buffer[1])
+		nn_free(priv->buffer[1]);
+	free(priv->file_name);
+	free(priv->tmp_name);
+	free(priv);
+	return -1;
+}
+
+/*
+ * Take a snapshot of the network, call it between training steps.
+ * It never waits for the disk: if the writer is still busy, the snapshot waits in the other
+ * buffer and a newer snapshot replaces it.
+ */
+void
+nn_checkpoint_snapshot(NNCheckpoint *cp)
+{
+	int b;
+	_NNCheckpointPriv *priv = cp->priv;
+
+	/* Take the buffer not being written, and make sure the writer doesn't take it while copying */
+	pthread_mutex_lock(&priv->lock);
+	b = priv->writing == 0 ? 1 : 0;
+	if (priv->pending == b)
+		priv->pending = -1;
+	pthread_mutex_unlock(&priv->lock);
+
+	nn_copy_into(priv->buffer[b], cp->nn);
+
+	pthread_mutex_lock(&priv->lock);
+	priv->pending = b;
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->lock);
+}
+
+/* Wait until the last snapshot is on the disk, return the result of the last write */
+int
+nn_checkpoint_wait(NNCheckpoint *cp)
+{
+	int ret;
+	_NNCheckpointPriv *priv = cp->priv;
+
+	pthread_mutex_lock(&priv->lock);
+	while (priv->pending >= 0 || priv->writing >= 0)
+		pthread_cond_wait(&priv->cond, &priv->lock);
+	ret = priv->error;
+	pthread_mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+/* How many snapshots are written so far, replaced snapshots are not counted */
+int
+nn_checkpoint_get_count(NNCheckpoint *cp)
+{
+	int cnt;
+	_NNCheckpointPriv *priv = cp->priv;
+
+	pthread_mutex_lock(&priv->lock);
+	cnt = priv->n_written;
+	pthread_mutex_unlock(&priv->lock);
+
+	return cnt;
+}
+
+/* Write what's pending, then stop the writer. Return the result of the last write */
+int
+nn_checkpoint_stop(NNCheckpoint *cp)
+{
+	int ret;
+	_NNCheckpointPriv *priv = cp->priv;
+
+	pthread_mutex_lock(&priv->lock);
+	priv->stop = 1;
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->lock);
+
+	pthread_join(priv->thread, NULL);
+	ret = priv->error;
+
+	pthread_mutex_destroy(&priv->lock);
+	pthread_cond_destroy(&priv->cond);
+	nn_free(priv->buffer[0]);
+	nn_free(priv->buffer[1]);
+	free(priv->file_name);
+	free(priv->tmp_name);
+	free(priv);
+	cp->priv = NULL;
+
+	return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef __NEURAL_NETWORK_CHECKPOINT_H
+#define __NEURAL_NETWORK_CHECKPOINT_H
+
+#include "neural_network.h"
+
+/*
+ * Save a network in the background while it keeps training.
+ * A snapshot only copies weight and bias, a writer thread saves it to a temporary file,
+ * syncs it and renames it over file_name, so file_name is always a complete network.
+ */
+typedef struct {
+	NeuralNetwork *nn;
+	void *priv;
+} NNCheckpoint;
+
+int nn_checkpoint_start(NNCheckpoint *cp, NeuralNetwork *nn, const char *file_name);
+
+void nn_checkpoint_snapshot(NNCheckpoint *cp);
+
+int nn_checkpoint_wait(NNCheckpoint *cp);
+
+int nn_checkpoint_get_count(NNCheckpoint *cp);
+
+int nn_checkpoint_stop(NNCheckpoint *cp);
+
+#endif /* __NEURAL_NETWORK_CHECKPOINT_H */
@@ -0,0 +1,317 @@
+#include "neural_network_delta.h"
+#include "neural_network_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int _nn_delta_reserve(NNDeltaChild *child, int n);
+
+static void _nn_delta_apply(NeuralNetwork *nn, const int *index, const float *value, int n);
+
+static int _nn_delta_merge(NNDeltaChild *child, const int *index, const float *value, int n);
+
+/* Make room for n deltas */
+static int
+_nn_delta_reserve(NNDeltaChild *child, int n)
+{
+	int *index;
+	float *value;
+
+	if (n <= child->max_delta)
+		return 0;
+
+	index = realloc(child->index, n * sizeof(int));
+	if (index == NULL)
+		return -1;
+	child->index = index;
+	value = realloc(child->value, n * sizeof(float));
+	if (value == NULL)
+		return -1;
+	child->value = value;
+	child->max_delta = n;
+
+	return 0;
+}
+
+/* Add the deltas to the parameters of a full network */
+static void
+_nn_delta_apply(NeuralNetwork *nn, const int *index, const float *value, int n)
+{
+	int k;
+
+	for (k = 0; k < n; k++)
+	{
+		if (index[k] < nn->_n_weight)
+			nn->weight[index[k]] += value[k];
+		else
+			nn->bias[index[k] - nn->_n_weight] += value[k];
+	}
+	nn_touch(nn);
+}
+
+/* Merge n ascending deltas into the ones of the child, adding up the ones at the same index */
+static int
+_nn_delta_merge(NNDeltaChild *child, const int *index, const float *value, int n)
+{
+	int i;
+	int j;
+	int k;
+	int max_delta;
+	int *old_index;
+	float *old_value;
+
+	max_delta = child->n_delta + n;
+	old_index = child->index;
+	old_value = child->value;
+	child->index = malloc(max_delta * sizeof(int));
+	child->value = malloc(max_delta * sizeof(float));
+	if (child->index == NULL || child->value == NULL)
+	{
+		free(child->index);
+		free(child->value);
+		child->index = old_index;
+		child->value = old_value;
+		return -1;
+	}
+
+	i = 0;
+	j = 0;
+	k = 0;
+	while (i < child->n_delta || j < n)
+	{
+		if (j == n || (i < child->n_delta && old_index[i] < index[j]))
+		{
+			child->index[k] = old_index[i];
+			child->value[k++] = old_value[i++];
+		}
+		else if (i == child->n_delta || index[j] < old_index[i])
+		{
+			child->index[k] = index[j];
+			child->value[k++] = value[j++];
+		}
+		else
+		{
+			child->index[k] = index[j];
+			child->value[k++] = old_value[i++] + value[j++];
+		}
+	}
+	child->n_delta = k;
+	child->max_delta = max_delta;
+	free(old_index);
+	free(old_value);
+
+	return 0;
+}
+
+/* Take nn over, it's freed when the last reference is dropped */
+NNDeltaParent *
+nn_delta_parent_create(NeuralNetwork *nn)
+{
+	NNDeltaParent *parent;
+
+	parent = malloc(sizeof(*parent));
+	if (parent == NULL)
+		return NULL;
+	parent->nn = nn;
+	atomic_init(&parent->refcount, 1);
+
+	return parent;
+}
+
+void
+nn_delta_parent_ref(NNDeltaParent *parent)
+{
+	atomic_fetch_add(&parent->refcount, 1);
+}
+
+void
+nn_delta_parent_unref(NNDeltaParent *parent)
+{
+	if (atomic_fetch_sub(&parent->refcount, 1) != 1)
+		return;
+
+	nn_free(parent->nn);
+	free(parent);
+}
+
+/* A child equal to the parent, it holds a reference to the parent */
+NNDeltaChild *
+nn_delta_child_create(NNDeltaParent *parent)
+{
+	NNDeltaChild *child;
+
+	child = calloc(1, sizeof(*child));
+	if (child == NULL)
+		return NULL;
+	child->output = malloc(parent->nn->_n_neuro * sizeof(float));
+	if (child->output == NULL)
+	{
+		free(child);
+		return NULL;
+	}
+	child->parent = parent;
+	nn_delta_parent_ref(parent);
+
+	return child;
+}
+
+/* A child with the same deltas, not materialized */
+NNDeltaChild *
+nn_delta_child_duplicate(NNDeltaChild *child)
+{
+	NNDeltaChild *new_child;
+
+	new_child = nn_delta_child_create(child->parent);
+	if (new_child == NULL)
+		return NULL;
+	if (_nn_delta_reserve(new_child, child->n_delta) < 0)
+	{
+		nn_delta_child_free(new_child);
+		return NULL;
+	}
+	memcpy(new_child->index, child->index, child->n_delta * sizeof(int));
+	memcpy(new_child->value, child->value, child->n_delta * sizeof(float));
+	new_child->n_delta = child->n_delta;
+
+	return new_child;
+}
+
+void
+nn_delta_child_free(NNDeltaChild *child)
+{
+	if (child->nn)
+		nn_free(child->nn);
+	nn_delta_parent_unref(child->parent);
+	free(child->index);
+	free(child->value);
+	free(child->output);
+	free(child);
+}
+
+/*
+ * As nn_plus_randomize_by_rate() on the child, only the picked parameters are stored.
+ * Return -1 if out of memory, the child is left as it was.
+ */
+int
+nn_delta_plus_randomize_by_rate(NNDeltaChild *child, float range, float rate)
+{
+	int i;
+	int ret;
+	int n_param;
+	NNDeltaChild picks;	/* Just a growing list of the picked ones */
+	NeuralNetwork *nn;
+
+	nn = child->parent->nn;
+	n_param = nn->_n_weight + (nn->use_bias ? nn->_n_neuro : 0);
+
+	ret = 0;
+	memset(&picks, 0, sizeof(picks));
+	for (i = _nn_next_pick(-1, n_param, rate); i < n_param; i = _nn_next_pick(i, n_param, rate))
+	{
+		if (picks.n_delta == picks.max_delta &&
+			_nn_delta_reserve(&picks, picks.max_delta ? picks.max_delta * 2 : 16) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		picks.index[picks.n_delta] = i;
+		picks.value[picks.n_delta++] = _nn_gen_random() * 2 * range;
+	}
+
+	if (ret == 0)
+		ret = _nn_delta_merge(child, picks.index, picks.value, picks.n_delta);
+	if (ret == 0 && child->nn)
+		_nn_delta_apply(child->nn, picks.index, picks.value, picks.n_delta);
+
+	free(picks.index);
+	free(picks.value);
+	return ret;
+}
+
+/*
+ * Run the parent's layers and correct the sums by the deltas of that layer before the activation,
+ * or nn_run() the full network if materialized.
+ */
+float *
+nn_delta_run(NNDeltaChild *child, float *input)
+{
+	int i;
+	int k;
+	int b;
+	int n_input;
+	int n_output;
+	int weight_start;
+	int neuro_start;
+	float *output;
+	NeuralNetwork *nn;
+
+	if (child->nn)
+		return nn_run(child->nn, input);
+
+	nn = child->parent->nn;
+
+	/* Deltas of the bias follow all the deltas of the weight */
+	for (b = 0; b < child->n_delta && child->index[b] < nn->_n_weight; b++)
+		;
+
+	k = 0;
+	n_input = nn->n_input;
+	output = child->output;
+	weight_start = 0;
+	neuro_start = 0;
+	for (i = 0; i <= nn->n_hidden; i++)
+	{
+		n_output = i < nn->n_hidden ? nn->n_neuro_per_hidden : nn->n_output;
+
+		_nn_layer_sum(nn->use_bias,
+				input,
+				n_input,
+				output,
+				n_output,
+				nn->use_bias ? nn->bias + neuro_start : NULL,
+				nn->weight + weight_start);
+
+		for (; k < b && child->index[k] < weight_start + n_input * n_output; k++)
+			output[(child->index[k] - weight_start) / n_input] +=
+				child->value[k] * input[(child->index[k] - weight_start) % n_input];
+		for (; b < child->n_delta && child->index[b] - nn->_n_weight < neuro_start + n_output; b++)
+			output[child->index[b] - nn->_n_weight - neuro_start] += child->value[b];
+
+		_nn_act_func_apply(i < nn->n_hidden ? nn->act_func_type_hidden : nn->act_func_type_output,
+				output,
+				n_output);
+
+		input = output;
+		output += n_output;
+		weight_start += n_input * n_output;
+		neuro_start += n_output;
+		n_input = n_output;
+	}
+
+	return input;
+}
+
+/* Build the full network, it's kept up to date and used by nn_delta_run() until dematerialized */
+NeuralNetwork *
+nn_delta_materialize(NNDeltaChild *child)
+{
+	if (child->nn)
+		return child->nn;
+
+	child->nn = nn_duplicate(child->parent->nn);
+	if (child->nn == NULL)
+		return NULL;
+	_nn_delta_apply(child->nn, child->index, child->value, child->n_delta);
+
+	return child->nn;
+}
+
+/* Drop the full network to save memory, the deltas are kept */
+void
+nn_delta_dematerialize(NNDeltaChild *child)
+{
+	if (child->nn == NULL)
+		return;
+
+	nn_free(child->nn);
+	child->nn = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __NEURAL_NETWORK_DELTA_H
+#define __NEURAL_NETWORK_DELTA_H
+
+#include <stdatomic.h>
+#include "neural_network.h"
+
+/*
+ * Children of a shared parent that only store where they differ from it.
+ * A parameter is numbered as in the flat weight array, then bias i is numbered _n_weight + i.
+ * The parent must not change while it has children.
+ */
+typedef struct {
+	NeuralNetwork *nn;
+	atomic_int refcount;
+} NNDeltaParent;
+
+typedef struct {
+	NNDeltaParent *parent;
+	int n_delta;
+	int max_delta;
+	int *index;	/* Parameters that differ from the parent, ascending */
+	float *value;	/* Added to the parent's */
+	float *output;	/* Output buffer of nn_delta_run(), laid out as nn->output */
+	NeuralNetwork *nn;	/* The full network if materialized, or NULL */
+} NNDeltaChild;
+
+NNDeltaParent *nn_delta_parent_create(NeuralNetwork *nn);
+
+void nn_delta_parent_ref(NNDeltaParent *parent);
+
+void nn_delta_parent_unref(NNDeltaParent *parent);
+
+NNDeltaChild *nn_delta_child_create(NNDeltaParent *parent);
+
+NNDeltaChild *nn_delta_child_duplicate(NNDeltaChild *child);
+
+void nn_delta_child_free(NNDeltaChild *child);
+
+int nn_delta_plus_randomize_by_rate(NNDeltaChild *child, float range, float rate);
+
+float *nn_delta_run(NNDeltaChild *child, float *input);
+
+NeuralNetwork *nn_delta_materialize(NNDeltaChild *child);
+
+void nn_delta_dematerialize(NNDeltaChild *child);
+
+#endif /* __NEURAL_NETWORK_DELTA_H */
@@ -1,6 +1,9 @@
 #include "neural_network_elite.h"
+#include "neural_network_batch.h"
+#include "neural_network_private.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 
 typedef struct _NNEliteList{
 	NeuralNetwork *nn;
@@ -9,14 +12,17 @@ typedef struct _NNEliteList{
 	void *next;
 } _NNEliteList;
 
-static void _nn_elite_free(_NNEliteList *el);
+static void _nn_elite_free(NNEliteList *list, _NNEliteList *el);
 
 static void _nn_elist_list_link(_NNEliteList *el1, _NNEliteList *el2);
 
 static void
-_nn_elite_free(_NNEliteList *el)
+_nn_elite_free(NNEliteList *list, _NNEliteList *el)
 {
-	nn_free(el->nn);
+	if (list->pool)
+		nn_pool_put(list->pool, el->nn);
+	else
+		nn_free(el->nn);
 	free(el);
 }
 
@@ -32,6 +38,13 @@ nn_elites_init_list(NNEliteList *list, int max_len)
 {
 	list->list_head = NULL;
 	list->max_len = max_len;
+	list->pool = NULL;
+}
+
+void
+nn_elites_set_pool(NNEliteList *list, NNPool *pool)
+{
+	list->pool = pool;
 }
 
 void
@@ -86,7 +99,7 @@ nn_elites_add(NNEliteList *list, NeuralNetwork *nn, float goodness)
 		/* The worst gets freed */
 		((_NNEliteList *)worst->prev)->next = worst->next;
 		((_NNEliteList *)worst->next)->prev = worst->prev;
-		_nn_elite_free(worst);
+		_nn_elite_free(list, worst);
 	}
 }
 
@@ -102,10 +115,10 @@ nn_elites_clear(NNEliteList *list)
 	while (el->next != list->list_head)
 	{
 		el = el->next;
-		_nn_elite_free(el->prev);
+		_nn_elite_free(list, el->prev);
 	};
 
-	_nn_elite_free(el);
+	_nn_elite_free(list, el);
 
 	list->list_head = NULL;
 }
@@ -124,7 +137,7 @@ nn_elites_pick_by_random(NNEliteList *list, NeuralNetwork *dont_pick)
 	el = list->list_head;
 	do
 	{
-		i = rand() % e_cnt;
+		i = _nn_rand() % e_cnt;
 		el = list->list_head;
 		while (i)
 		{
@@ -148,6 +161,84 @@ nn_elites_get_best(NNEliteList *list)
 	return ((_NNEliteList*)list->list_head)->nn;
 }
 
+/* -INFINITY if the list is empty */
+float
+nn_elites_get_best_goodness(NNEliteList *list)
+{
+	if (list->list_head == NULL)
+		return -INFINITY;
+
+	return ((_NNEliteList*)list->list_head)->goodness;
+}
+
+NeuralNetwork *
+nn_elites_get_worst(NNEliteList *list, float *goodness)
+{
+	_NNEliteList *worst;
+
+	if (list->list_head == NULL)
+		return NULL;
+
+	worst = ((_NNEliteList*)list->list_head)->prev;
+	if (goodness)
+		*goodness = worst->goodness;
+
+	return worst->nn;
+}
+
+/* Take the worst out of the list, the caller owns the returned network */
+NeuralNetwork *
+nn_elites_pop_worst(NNEliteList *list, float *goodness)
+{
+	_NNEliteList *worst;
+	NeuralNetwork *nn;
+
+	if (list->list_head == NULL)
+		return NULL;
+
+	worst = ((_NNEliteList*)list->list_head)->prev;
+	if (goodness)
+		*goodness = worst->goodness;
+
+	if (worst == list->list_head)
+	{
+		/* The last one */
+		list->list_head = NULL;
+	}
+	else
+	{
+		((_NNEliteList *)worst->prev)->next = worst->next;
+		((_NNEliteList *)worst->next)->prev = worst->prev;
+	}
+
+	nn = worst->nn;
+	free(worst);
+
+	return nn;
+}
+
+/* Call func from the best to the worst, stop and return its value once it returns non-zero */
+int
+nn_elites_foreach(NNEliteList *list, int (*func)(NeuralNetwork *nn, float goodness, void *arg), void *arg)
+{
+	int ret;
+	_NNEliteList *el;
+
+	el = list->list_head;
+	if (el == NULL)
+		return 0;
+
+	do
+	{
+		ret = func(el->nn, el->goodness, arg);
+		if (ret)
+			return ret;
+		el = el->next;
+	} while (el != list->list_head);
+
+	return 0;
+}
+
 int
 nn_elites_get_count(NNEliteList *list)
 {
@@ -168,6 +259,77 @@ nn_elites_get_count(NNEliteList *list)
 	return cnt;
 }
 
+/*
+ * Return the goodness a network needs to be more than to stay in the list,
+ * -INFINITY while the list is not full.
+ */
+float
+nn_elites_get_threshold(NNEliteList *list)
+{
+	float goodness;
+
+	if (nn_elites_get_count(list) < list->max_len)
+		return -INFINITY;
+
+	nn_elites_get_worst(list, &goodness);
+	return goodness;
+}
+
+/*
+ * Score nn on the test set chunk by chunk and give up once it can't be more than threshold.
+ * Return 1 if every sample was scored and goodness is the sum, 0 if it gave up and goodness
+ * is the bound it was dropped at, -1 on error.
+ */
+int
+nn_elites_evaluate(NeuralNetwork *nn, const NNEvalConfig *cfg, float threshold, float *goodness)
+{
+	int i;
+	int n_done;
+	int n_batch;
+	int chunk;
+	float sum;
+	float bound;
+	float *outputs;
+
+	chunk = cfg->chunk > 0 ? cfg->chunk : cfg->n_sample;
+	if (chunk > cfg->n_sample)
+		chunk = cfg->n_sample;
+	outputs = malloc((long)(chunk > 0 ? chunk : 1) * nn->n_output * sizeof(float));
+	if (outputs == NULL)
+		return -1;
+
+	sum = 0;
+	for (n_done = 0; n_done < cfg->n_sample; n_done += n_batch)
+	{
+		n_batch = cfg->n_sample - n_done < chunk ? cfg->n_sample - n_done : chunk;
+		if (nn_run_batch(nn, cfg->inputs + (long)n_done * nn->n_input, n_batch, outputs) < 0)
+		{
+			free(outputs);
+			return -1;
+		}
+		for (i = 0; i < n_batch; i++)
+			sum += cfg->score(outputs + (long)i * nn->n_output, n_done + i, cfg->arg);
+
+		if (n_done + n_batch == cfg->n_sample)
+			break;
+
+		if (cfg->bound)
+			bound = cfg->bound(sum, n_done + n_batch, cfg->n_sample, cfg->arg);
+		else
+			bound = sum + (float)(cfg->n_sample - n_done - n_batch) * cfg->max_score;
+		if (bound <= threshold)
+		{
+			free(outputs);
+			*goodness = bound;
+			return 0;
+		}
+	}
+
+	free(outputs);
+	*goodness = sum;
+	return 1;
+}
+
 int
 nn_elites_save(NNEliteList *list, const char *file_name)
 {
@@ -2,14 +2,34 @@
 #define __NEURAL_NETWORK_ELITE_H
 
 #include "neural_network.h"
+#include "neural_network_pool.h"
 
 typedef struct {
 	int max_len;
 	void *list_head;
+	NNPool *pool;	/* Where the evicted networks go, NULL to free them */
 } NNEliteList;
 
+/*
+ * How nn_elites_evaluate() scores a network on a test set.
+ * The goodness is the sum of score() over the samples, bound() returns the best goodness
+ * the network could still reach after n_done samples.
+ * If bound is NULL, no sample scores more than max_score.
+ */
+typedef struct {
+	const float *inputs;	/* n_sample rows of n_input */
+	int n_sample;
+	int chunk;		/* So many samples are run between two checks of the bound */
+	float (*score)(const float *output, int sample, void *arg);
+	float (*bound)(float goodness, int n_done, int n_sample, void *arg);
+	float max_score;
+	void *arg;
+} NNEvalConfig;
+
 void nn_elites_init_list(NNEliteList *list, int max_len);
 
+void nn_elites_set_pool(NNEliteList *list, NNPool *pool);
+
 void nn_elites_add(NNEliteList *list, NeuralNetwork *nn, float goodness);
 
 void nn_elites_clear(NNEliteList *list);
@@ -18,8 +38,20 @@ NeuralNetwork *nn_elites_pick_by_random(NNEliteList *list, NeuralNetwork *dont_p
 
 NeuralNetwork *nn_elites_get_best(NNEliteList *list);
 
+float nn_elites_get_best_goodness(NNEliteList *list);
+
+NeuralNetwork *nn_elites_get_worst(NNEliteList *list, float *goodness);
+
+NeuralNetwork *nn_elites_pop_worst(NNEliteList *list, float *goodness);
+
+int nn_elites_foreach(NNEliteList *list, int (*func)(NeuralNetwork *nn, float goodness, void *arg), void *arg);
+
 int nn_elites_get_count(NNEliteList *list);
 
+float nn_elites_get_threshold(NNEliteList *list);
+
+int nn_elites_evaluate(NeuralNetwork *nn, const NNEvalConfig *cfg, float threshold, float *goodness);
+
 int nn_elites_save(NNEliteList *list, const char *file_name);
 
 int nn_elites_load(NNEliteList *list, const char *file_name);
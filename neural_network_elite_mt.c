@@ -0,0 +1,392 @@
+#include "neural_network_elite_mt.h"
+#include "neural_network_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+	pthread_mutex_t lock;
+	NNEliteList list;
+} _NNEliteShard;
+
+typedef struct {
+	_NNEliteShard *shards;
+	pthread_mutex_t merge_lock;
+	_Atomic float threshold;	/* Worst goodness of the merged best max_len */
+	atomic_uint n_add;
+} _NNEliteShardsPriv;
+
+/* Which shard this thread inserts into, assigned on the first add */
+static _Thread_local int shard_hint = -1;
+
+static atomic_int next_shard_hint;
+
+static int _nn_elites_mt_shard(NNEliteShards *mt);
+
+static int _nn_elites_mt_collect_goodness(NeuralNetwork *nn, float goodness, void *arg);
+
+static int _nn_elites_mt_duplicate(NeuralNetwork *nn, float goodness, void *arg);
+
+static int _nn_float_cmp_desc(const void *a, const void *b);
+
+static int _nn_elites_mt_copy(NeuralNetwork *dst, NeuralNetwork *src);
+
+/* The shard may have been emptied between two locks, then src is NULL */
+static int
+_nn_elites_mt_copy(NeuralNetwork *dst, NeuralNetwork *src)
+{
+	if (src == NULL)
+		return -1;
+
+	return nn_copy_into(dst, src);
+}
+
+static int
+_nn_elites_mt_shard(NNEliteShards *mt)
+{
+	if (shard_hint < 0)
+		shard_hint = atomic_fetch_add(&next_shard_hint, 1) & 0x7fffffff;
+
+	return shard_hint % mt->n_shard;
+}
+
+static int
+_nn_elites_mt_collect_goodness(NeuralNetwork *nn, float goodness, void *arg)
+{
+	float **ptr = arg;
+
+	(void)nn;
+	*(*ptr)++ = goodness;
+
+	return 0;
+}
+
+static int
+_nn_elites_mt_duplicate(NeuralNetwork *nn, float goodness, void *arg)
+{
+	NeuralNetwork *new_nn;
+
+	new_nn = nn_duplicate(nn);
+	if (new_nn == NULL)
+		return -1;
+
+	nn_elites_add(arg, new_nn, goodness);
+
+	return 0;
+}
+
+static int
+_nn_float_cmp_desc(const void *a, const void *b)
+{
+	float fa = *(const float *)a;
+	float fb = *(const float *)b;
+
+	if (fa < fb)
+		return 1;
+	if (fa > fb)
+		return -1;
+	return 0;
+}
+
+int
+nn_elites_mt_init(NNEliteShards *mt, int max_len, int n_shard, int merge_interval)
+{
+	int i;
+	_NNEliteShardsPriv *priv;
+
+	if (max_len < 1 || n_shard < 1)
+		return -1;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+
+	priv->shards = malloc(n_shard * sizeof(*priv->shards));
+	if (priv->shards == NULL)
+	{
+		free(priv);
+		return -1;
+	}
+
+	for (i = 0; i < n_shard; i++)
+	{
+		pthread_mutex_init(&priv->shards[i].lock, NULL);
+		nn_elites_init_list(&priv->shards[i].list, max_len);
+	}
+	pthread_mutex_init(&priv->merge_lock, NULL);
+	atomic_init(&priv->threshold, -INFINITY);
+	atomic_init(&priv->n_add, 0);
+
+	mt->max_len = max_len;
+	mt->n_shard = n_shard;
+	mt->merge_interval = merge_interval;
+	mt->priv = priv;
+
+	return 0;
+}
+
+void
+nn_elites_mt_destroy(NNEliteShards *mt)
+{
+	int i;
+	_NNEliteShardsPriv *priv = mt->priv;
+
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		nn_elites_clear(&priv->shards[i].list);
+		pthread_mutex_destroy(&priv->shards[i].lock);
+	}
+	pthread_mutex_destroy(&priv->merge_lock);
+
+	free(priv->shards);
+	free(priv);
+	mt->priv = NULL;
+}
+
+/*
+ * Return 1 if nn is admitted, the list owns it from now on.
+ * Return 0 if nn can't be one of the elites, the caller still owns it and may reuse it.
+ */
+int
+nn_elites_mt_add(NNEliteShards *mt, NeuralNetwork *nn, float goodness)
+{
+	_NNEliteShardsPriv *priv = mt->priv;
+	_NNEliteShard *shard;
+	float worst;
+
+	/* Cheap check first, no lock is needed to reject a loser */
+	if (goodness <= atomic_load_explicit(&priv->threshold, memory_order_relaxed))
+		return 0;
+
+	shard = &priv->shards[_nn_elites_mt_shard(mt)];
+
+	pthread_mutex_lock(&shard->lock);
+	if (nn_elites_get_count(&shard->list) >= mt->max_len &&
+		nn_elites_get_worst(&shard->list, &worst) &&
+		goodness <= worst)
+	{
+		/* It would be evicted right away */
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+	nn_elites_add(&shard->list, nn, goodness);
+	pthread_mutex_unlock(&shard->lock);
+
+	if (mt->merge_interval > 0 &&
+		(atomic_fetch_add(&priv->n_add, 1) + 1) % mt->merge_interval == 0)
+		nn_elites_mt_merge(mt);
+
+	return 1;
+}
+
+/*
+ * Trim all shards to the global best max_len and update the admission threshold.
+ * Shards are locked one at a time while trimming, so the adding threads are barely blocked.
+ */
+void
+nn_elites_mt_merge(NNEliteShards *mt)
+{
+	int i;
+	int n;
+	float *all;
+	float *ptr;
+	float threshold;
+	float worst;
+	_NNEliteShardsPriv *priv = mt->priv;
+	_NNEliteShard *shard;
+
+	pthread_mutex_lock(&priv->merge_lock);
+
+	all = malloc(mt->n_shard * mt->max_len * sizeof(*all));
+	if (all == NULL)
+	{
+		pthread_mutex_unlock(&priv->merge_lock);
+		return;
+	}
+
+	/* 1. Collect every goodness, each shard holds no more than max_len */
+	ptr = all;
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		nn_elites_foreach(&shard->list, _nn_elites_mt_collect_goodness, &ptr);
+		pthread_mutex_unlock(&shard->lock);
+	}
+	n = ptr - all;
+
+	/* 2. The max_len-th best is the new threshold, nothing worse would ever be picked */
+	if (n < mt->max_len)
+	{
+		free(all);
+		pthread_mutex_unlock(&priv->merge_lock);
+		return;
+	}
+	qsort(all, n, sizeof(*all), _nn_float_cmp_desc);
+	threshold = all[mt->max_len - 1];
+	free(all);
+
+	/* Keep the ones equal to the threshold, so the threshold itself is rejected from now on */
+	atomic_store_explicit(&priv->threshold, threshold, memory_order_relaxed);
+
+	/* 3. Drop whatever is worse than the threshold */
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		while (nn_elites_get_worst(&shard->list, &worst) && worst < threshold)
+			nn_free(nn_elites_pop_worst(&shard->list, NULL));
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	pthread_mutex_unlock(&priv->merge_lock);
+}
+
+float
+nn_elites_mt_get_threshold(NNEliteShards *mt)
+{
+	_NNEliteShardsPriv *priv = mt->priv;
+
+	return atomic_load_explicit(&priv->threshold, memory_order_relaxed);
+}
+
+/* Number of networks in all shards, may be larger than max_len until the next merge */
+int
+nn_elites_mt_get_count(NNEliteShards *mt)
+{
+	int i;
+	int cnt;
+	_NNEliteShardsPriv *priv = mt->priv;
+
+	cnt = 0;
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		pthread_mutex_lock(&priv->shards[i].lock);
+		cnt += nn_elites_get_count(&priv->shards[i].list);
+		pthread_mutex_unlock(&priv->shards[i].lock);
+	}
+
+	return cnt;
+}
+
+/*
+ * Copy the best network into dst.
+ * Networks in the shards may be evicted at any time, so they're never handed out directly.
+ */
+int
+nn_elites_mt_get_best(NNEliteShards *mt, NeuralNetwork *dst, float *goodness)
+{
+	int i;
+	int i_best;
+	int ret;
+	float g;
+	float g_best;
+	_NNEliteShardsPriv *priv = mt->priv;
+	_NNEliteShard *shard;
+
+	/* 1. Find the shard with the best one */
+	i_best = -1;
+	g_best = -INFINITY;
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		if (nn_elites_get_best(&shard->list))
+		{
+			g = nn_elites_get_best_goodness(&shard->list);
+			if (i_best < 0 || g > g_best)
+			{
+				i_best = i;
+				g_best = g;
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	if (i_best < 0)
+		return -1;
+
+	/* 2. Copy it, the head of a shard only gets better in the meantime unless a merge emptied it */
+	shard = &priv->shards[i_best];
+	pthread_mutex_lock(&shard->lock);
+	g = nn_elites_get_best_goodness(&shard->list);
+	ret = _nn_elites_mt_copy(dst, nn_elites_get_best(&shard->list));
+	pthread_mutex_unlock(&shard->lock);
+
+	if (goodness && ret == 0)
+		*goodness = g;
+
+	return ret;
+}
+
+/* Copy a random elite into dst, every elite has the same chance */
+int
+nn_elites_mt_pick_by_random(NNEliteShards *mt, NeuralNetwork *dst)
+{
+	int i;
+	int r;
+	int ret;
+	int cnt;
+	_NNEliteShardsPriv *priv = mt->priv;
+	_NNEliteShard *shard;
+
+	cnt = nn_elites_mt_get_count(mt);
+	if (cnt == 0)
+		return -1;
+
+	/* Walk the shards to find which one the r-th elite is in, the counts may have changed since */
+	r = _nn_rand() % cnt;
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		cnt = nn_elites_get_count(&shard->list);
+		if (r < cnt || (i == mt->n_shard - 1 && cnt > 0))
+		{
+			ret = _nn_elites_mt_copy(dst, nn_elites_pick_by_random(&shard->list, NULL));
+			pthread_mutex_unlock(&shard->lock);
+			return ret;
+		}
+		r -= cnt;
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	/* Everything got trimmed away from under us, take any */
+	for (i = 0; i < mt->n_shard; i++)
+	{
+		shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		if (nn_elites_get_best(&shard->list))
+		{
+			ret = _nn_elites_mt_copy(dst, nn_elites_pick_by_random(&shard->list, NULL));
+			pthread_mutex_unlock(&shard->lock);
+			return ret;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return -1;
+}
+
+/* Merge, then add a copy of every elite to list, e.g. for nn_elites_savef() */
+int
+nn_elites_mt_collect(NNEliteShards *mt, NNEliteList *list)
+{
+	int i;
+	int ret;
+	_NNEliteShardsPriv *priv = mt->priv;
+
+	nn_elites_mt_merge(mt);
+
+	ret = 0;
+	for (i = 0; i < mt->n_shard && ret == 0; i++)
+	{
+		pthread_mutex_lock(&priv->shards[i].lock);
+		ret = nn_elites_foreach(&priv->shards[i].list, _nn_elites_mt_duplicate, list);
+		pthread_mutex_unlock(&priv->shards[i].lock);
+	}
+
+	return ret;
+}
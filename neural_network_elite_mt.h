@@ -0,0 +1,37 @@
+#ifndef __NEURAL_NETWORK_ELITE_MT_H
+#define __NEURAL_NETWORK_ELITE_MT_H
+
+#include "neural_network_elite.h"
+
+/*
+ * An elite list that many threads can add to at the same time.
+ * Every thread inserts into its own shard, each shard is a NNEliteList with its own lock.
+ * The shards are merged every merge_interval adds, which trims them to the global best max_len
+ * and updates the admission threshold so most losers are rejected without taking any lock.
+ */
+typedef struct {
+	int max_len;
+	int n_shard;
+	int merge_interval;
+	void *priv;
+} NNEliteShards;
+
+int nn_elites_mt_init(NNEliteShards *mt, int max_len, int n_shard, int merge_interval);
+
+void nn_elites_mt_destroy(NNEliteShards *mt);
+
+int nn_elites_mt_add(NNEliteShards *mt, NeuralNetwork *nn, float goodness);
+
+void nn_elites_mt_merge(NNEliteShards *mt);
+
+float nn_elites_mt_get_threshold(NNEliteShards *mt);
+
+int nn_elites_mt_get_count(NNEliteShards *mt);
+
+int nn_elites_mt_get_best(NNEliteShards *mt, NeuralNetwork *dst, float *goodness);
+
+int nn_elites_mt_pick_by_random(NNEliteShards *mt, NeuralNetwork *dst);
+
+int nn_elites_mt_collect(NNEliteShards *mt, NNEliteList *list);
+
+#endif /* __NEURAL_NETWORK_ELITE_MT_H */
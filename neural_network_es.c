@@ -0,0 +1,437 @@
+#include "neural_network_es.h"
+#include "neural_network_numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+	NNEvolutionStrategy *es;
+	NeuralNetwork *scratch;	/* The perturbed network */
+	int lo;			/* Parameters this thread updates */
+	int hi;
+	int node;		/* NUMA node the thread is pinned to if numa_pin */
+	pthread_t thread;
+} _NNESWorker;
+
+typedef struct {
+	_NNESWorker *workers;
+	int n_param;
+
+	/* O(population) of scalars per generation */
+	uint64_t *seeds;
+	float *fitness_pos;
+	float *fitness_neg;
+	float *shaped_pos;
+	float *shaped_neg;
+
+	atomic_int next_pair;
+} _NNESPriv;
+
+typedef struct {
+	float fitness;
+	int i;
+} _NNESRank;
+
+static uint64_t _nn_es_mix(uint64_t x);
+
+static float _nn_es_noise(uint64_t seed, int i);
+
+static float *_nn_es_param(NeuralNetwork *nn, int i);
+
+static int _nn_es_n_param(NeuralNetwork *nn);
+
+static void _nn_es_update_range(NeuralNetwork *center,
+		const uint64_t *seeds,
+		const float *fitness_pos,
+		const float *fitness_neg,
+		int n_pair,
+		float scale,
+		int lo,
+		int hi);
+
+static void *_nn_es_evaluate_thread(void *arg);
+
+static void *_nn_es_update_thread(void *arg);
+
+static int _nn_es_rank_cmp(const void *a, const void *b);
+
+static void _nn_es_shape(NNEvolutionStrategy *es);
+
+static int _nn_es_run_threads(NNEvolutionStrategy *es, void *(*func)(void *));
+
+/* splitmix64 finalizer */
+static uint64_t
+_nn_es_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* A standard normal of parameter i under seed, by Box-Muller from one 64 bit hash */
+static float
+_nn_es_noise(uint64_t seed, int i)
+{
+	uint64_t h;
+	double u1;
+	double u2;
+
+	h = _nn_es_mix(seed ^ _nn_es_mix((uint64_t)i));
+	u1 = ((h >> 32) + 1.0) / 4294967296.0;	/* (0, 1], never 0 for log() */
+	u2 = (h & 0xffffffffULL) / 4294967296.0;
+
+	return (float)(sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+static float *
+_nn_es_param(NeuralNetwork *nn, int i)
+{
+	if (i < nn->_n_weight)
+		return &nn->weight[i];
+	return &nn->bias[i - nn->_n_weight];
+}
+
+static int
+_nn_es_n_param(NeuralNetwork *nn)
+{
+	return nn->_n_weight + (nn->use_bias ? nn->_n_neuro : 0);
+}
+
+uint64_t
+nn_es_pair_seed(uint64_t seed, int generation, int pair)
+{
+	return _nn_es_mix(_nn_es_mix(seed ^ ((uint64_t)generation << 32)) ^ (uint64_t)pair);
+}
+
+/* dst = center + sigma * noise(seed), a negative sigma gives the mirrored one */
+void
+nn_es_perturb(NeuralNetwork *dst, NeuralNetwork *center, uint64_t seed, float sigma)
+{
+	int i;
+	int n_param;
+
+	n_param = _nn_es_n_param(center);
+	for (i = 0; i < n_param; i++)
+		*_nn_es_param(dst, i) = *_nn_es_param(center, i) + sigma * _nn_es_noise(seed, i);
+	nn_touch(dst);
+}
+
+static void
+_nn_es_update_range(NeuralNetwork *center,
+		const uint64_t *seeds,
+		const float *fitness_pos,
+		const float *fitness_neg,
+		int n_pair,
+		float scale,
+		int lo,
+		int hi)
+{
+	int i;
+	int k;
+	float coef;
+	float *grad;
+
+	grad = calloc(hi - lo, sizeof(float));
+	if (grad == NULL)
+		return;
+
+	/* Pair by pair, so a pair's coefficient is computed once */
+	for (k = 0; k < n_pair; k++)
+	{
+		coef = fitness_pos[k] - fitness_neg[k];
+		if (coef == 0)
+			continue;
+		for (i = lo; i < hi; i++)
+			grad[i - lo] += coef * _nn_es_noise(seeds[k], i);
+	}
+
+	for (i = lo; i < hi; i++)
+		*_nn_es_param(center, i) += scale * grad[i - lo];
+
+	free(grad);
+}
+
+/*
+ * Move center along the estimated gradient, rebuilt from the seeds and the fitness of
+ * the pairs only: rate / (2 * n_pair * sigma) * sum of (f+ - f-) * noise.
+ */
+void
+nn_es_update(NeuralNetwork *center,
+		const uint64_t *seeds,
+		const float *fitness_pos,
+		const float *fitness_neg,
+		int n_pair,
+		float sigma,
+		float learning_rate)
+{
+	_nn_es_update_range(center,
+			seeds,
+			fitness_pos,
+			fitness_neg,
+			n_pair,
+			learning_rate / (2.0f * n_pair * sigma),
+			0,
+			_nn_es_n_param(center));
+	nn_touch(center);
+}
+
+static void *
+_nn_es_evaluate_thread(void *arg)
+{
+	int k;
+	_NNESWorker *worker = arg;
+	NNEvolutionStrategy *es = worker->es;
+	_NNESPriv *priv = es->priv;
+	NNESConfig *config = &es->config;
+
+	while ((k = atomic_fetch_add(&priv->next_pair, 1)) < config->n_pair)
+	{
+		nn_es_perturb(worker->scratch, es->nn, priv->seeds[k], config->sigma);
+		priv->fitness_pos[k] = config->fitness(worker->scratch, config->fitness_arg);
+		nn_es_perturb(worker->scratch, es->nn, priv->seeds[k], -config->sigma);
+		priv->fitness_neg[k] = config->fitness(worker->scratch, config->fitness_arg);
+	}
+
+	return NULL;
+}
+
+static void *
+_nn_es_update_thread(void *arg)
+{
+	_NNESWorker *worker = arg;
+	NNEvolutionStrategy *es = worker->es;
+	_NNESPriv *priv = es->priv;
+	NNESConfig *config = &es->config;
+
+	_nn_es_update_range(es->nn,
+			priv->seeds,
+			priv->shaped_pos,
+			priv->shaped_neg,
+			config->n_pair,
+			config->learning_rate / (2.0f * config->n_pair * config->sigma),
+			worker->lo,
+			worker->hi);
+
+	return NULL;
+}
+
+static int
+_nn_es_rank_cmp(const void *a, const void *b)
+{
+	const _NNESRank *ra = a;
+	const _NNESRank *rb = b;
+
+	if (ra->fitness < rb->fitness)
+		return -1;
+	if (ra->fitness > rb->fitness)
+		return 1;
+	return 0;
+}
+
+/* Fill the shaped fitness, the centered ranks in [-0.5, 0.5] or the raw fitness, and the statistics */
+static void
+_nn_es_shape(NNEvolutionStrategy *es)
+{
+	int i;
+	int n;
+	double sum;
+	_NNESRank *ranks;
+	_NNESPriv *priv = es->priv;
+	NNESConfig *config = &es->config;
+
+	n = 2 * config->n_pair;
+	sum = 0;
+	es->best_fitness = -INFINITY;
+	for (i = 0; i < config->n_pair; i++)
+	{
+		sum += priv->fitness_pos[i] + priv->fitness_neg[i];
+		es->best_fitness = fmaxf(es->best_fitness, fmaxf(priv->fitness_pos[i], priv->fitness_neg[i]));
+	}
+	es->mean_fitness = sum / n;
+
+	ranks = config->rank_fitness ? malloc(n * sizeof(*ranks)) : NULL;
+	if (ranks == NULL)
+	{
+		memcpy(priv->shaped_pos, priv->fitness_pos, config->n_pair * sizeof(float));
+		memcpy(priv->shaped_neg, priv->fitness_neg, config->n_pair * sizeof(float));
+		return;
+	}
+
+	/* Even i is the positive one of pair i / 2, odd i is the negative one */
+	for (i = 0; i < n; i++)
+	{
+		ranks[i].fitness = i % 2 ? priv->fitness_neg[i / 2] : priv->fitness_pos[i / 2];
+		ranks[i].i = i;
+	}
+	qsort(ranks, n, sizeof(*ranks), _nn_es_rank_cmp);
+	for (i = 0; i < n; i++)
+	{
+		if (ranks[i].i % 2)
+			priv->shaped_neg[ranks[i].i / 2] = n > 1 ? (float)i / (n - 1) - 0.5f : 0;
+		else
+			priv->shaped_pos[ranks[i].i / 2] = n > 1 ? (float)i / (n - 1) - 0.5f : 0;
+	}
+	free(ranks);
+}
+
+/* Run func in every worker thread and wait for all of them */
+static int
+_nn_es_run_threads(NNEvolutionStrategy *es, void *(*func)(void *))
+{
+	int i;
+	int n_started;
+	int ret;
+	pthread_attr_t attr;
+	_NNESPriv *priv = es->priv;
+
+	ret = 0;
+	n_started = 0;
+	for (i = 0; i < es->config.n_thread; i++)
+	{
+		pthread_attr_init(&attr);
+		if (es->config.numa_pin)
+			nn_numa_set_attr_node(&attr, priv->workers[i].node);
+		if (pthread_create(&priv->workers[i].thread, &attr, func, &priv->workers[i]))
+		{
+			pthread_attr_destroy(&attr);
+			ret = -1;
+			break;
+		}
+		pthread_attr_destroy(&attr);
+		n_started++;
+	}
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(priv->workers[i].thread, NULL);
+
+	/* Do what the missing threads didn't in this one */
+	if (ret < 0)
+	{
+		for (i = n_started; i < es->config.n_thread; i++)
+			func(&priv->workers[i]);
+	}
+
+	return 0;
+}
+
+int
+nn_es_init(NNEvolutionStrategy *es, const NNESConfig *config, NeuralNetwork *nn)
+{
+	int i;
+	int n_thread;
+	_NNESPriv *priv;
+
+	if (config->n_pair < 1 ||
+		config->sigma <= 0 ||
+		config->fitness == NULL ||
+		nn == NULL)
+		return -1;
+
+	memset(es, 0, sizeof(*es));
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	es->config = *config;
+	es->nn = nn;
+	es->priv = priv;
+
+	n_thread = config->n_thread > 0 ? config->n_thread : 1;
+	es->config.n_thread = n_thread;
+	priv->n_param = _nn_es_n_param(nn);
+	priv->workers = calloc(n_thread, sizeof(*priv->workers));
+	priv->seeds = malloc(config->n_pair * sizeof(uint64_t));
+	priv->fitness_pos = malloc(config->n_pair * sizeof(float));
+	priv->fitness_neg = malloc(config->n_pair * sizeof(float));
+	priv->shaped_pos = malloc(config->n_pair * sizeof(float));
+	priv->shaped_neg = malloc(config->n_pair * sizeof(float));
+	if (priv->workers == NULL || priv->seeds == NULL || priv->fitness_pos == NULL ||
+		priv->fitness_neg == NULL || priv->shaped_pos == NULL || priv->shaped_neg == NULL)
+	{
+		nn_es_destroy(es);
+		return -1;
+	}
+
+	for (i = 0; i < n_thread; i++)
+	{
+		priv->workers[i].es = es;
+		priv->workers[i].lo = (long)priv->n_param * i / n_thread;
+		priv->workers[i].hi = (long)priv->n_param * (i + 1) / n_thread;
+		priv->workers[i].node = nn_numa_node_of_worker(i, n_thread);
+		if (config->numa_pin)
+			priv->workers[i].scratch = nn_numa_duplicate_on(nn, priv->workers[i].node);
+		else
+			priv->workers[i].scratch = nn_duplicate(nn);
+		if (priv->workers[i].scratch == NULL)
+		{
+			nn_es_destroy(es);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Evaluate one generation of mirrored pairs and update the network */
+int
+nn_es_step(NNEvolutionStrategy *es)
+{
+	int k;
+	_NNESPriv *priv = es->priv;
+
+	for (k = 0; k < es->config.n_pair; k++)
+		priv->seeds[k] = nn_es_pair_seed(es->config.seed, es->generation, k);
+
+	atomic_store(&priv->next_pair, 0);
+	_nn_es_run_threads(es, _nn_es_evaluate_thread);
+
+	_nn_es_shape(es);
+
+	_nn_es_run_threads(es, _nn_es_update_thread);
+	nn_touch(es->nn);
+
+	es->generation++;
+	return 0;
+}
+
+int
+nn_es_run(NNEvolutionStrategy *es)
+{
+	while (es->generation < es->config.n_generation)
+	{
+		if (nn_es_step(es) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void
+nn_es_destroy(NNEvolutionStrategy *es)
+{
+	int i;
+	_NNESPriv *priv = es->priv;
+
+	if (priv == NULL)
+		return;
+
+	if (priv->workers)
+	{
+		for (i = 0; i < es->config.n_thread; i++)
+		{
+			if (priv->workers[i].scratch)
+				nn_free(priv->workers[i].scratch);
+		}
+		free(priv->workers);
+	}
+	free(priv->seeds);
+	free(priv->fitness_pos);
+	free(priv->fitness_neg);
+	free(priv->shaped_pos);
+	free(priv->shaped_neg);
+	free(priv);
+	es->priv = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef __NEURAL_NETWORK_ES_H
+#define __NEURAL_NETWORK_ES_H
+
+#include <stdint.h>
+#include "neural_network.h"
+#include "neural_network_island.h"
+
+/*
+ * Evolution strategies around a single network.
+ * Every perturbation is known by a seed only, the gaussian noise of parameter i is a function
+ * of (seed, i), so it's regenerated wherever it's needed instead of being stored or sent.
+ * A parameter is numbered as in the flat weight array, then bias i is numbered _n_weight + i.
+ */
+typedef struct {
+	int n_pair;		/* Mirrored pairs every generation, the population is twice as many */
+	int n_thread;
+	int n_generation;
+	float sigma;		/* Standard deviation of the noise */
+	float learning_rate;
+	int rank_fitness;	/* Update by centered ranks instead of raw fitness */
+	uint64_t seed;
+	NNFitnessFunc fitness;
+	void *fitness_arg;
+	int numa_pin;		/* Pin the workers to the NUMA nodes and place their networks there */
+} NNESConfig;
+
+typedef struct {
+	NNESConfig config;
+	NeuralNetwork *nn;	/* Updated in place every generation */
+	int generation;
+	float mean_fitness;	/* Of the last generation */
+	float best_fitness;
+	void *priv;
+} NNEvolutionStrategy;
+
+int nn_es_init(NNEvolutionStrategy *es, const NNESConfig *config, NeuralNetwork *nn);
+
+int nn_es_step(NNEvolutionStrategy *es);
+
+int nn_es_run(NNEvolutionStrategy *es);
+
+void nn_es_destroy(NNEvolutionStrategy *es);
+
+/* The building blocks, for workers that don't share memory with the trainer */
+uint64_t nn_es_pair_seed(uint64_t seed, int generation, int pair);
+
+void nn_es_perturb(NeuralNetwork *dst, NeuralNetwork *center, uint64_t seed, float sigma);
+
+void nn_es_update(NeuralNetwork *center,
+		const uint64_t *seeds,
+		const float *fitness_pos,
+		const float *fitness_neg,
+		int n_pair,
+		float sigma,
+		float learning_rate);
+
+#endif /* __NEURAL_NETWORK_ES_H */
@@ -0,0 +1,522 @@
+#include "neural_network_island.h"
+#include "neural_network_pool.h"
+#include "neural_network_numa.h"
+#include "neural_network_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+	NeuralNetwork *nn;
+	float goodness;
+} _NNMigrant;
+
+typedef struct {
+	NNIslandModel *im;
+	int id;
+	NNEliteList elites;
+	NNPool pool;
+	pthread_t thread;
+
+	/* Migrants sent from the other islands, protected by lock */
+	pthread_mutex_t lock;
+	_NNMigrant *mailbox;
+	int n_mail;
+	int max_mail;
+
+	unsigned int seed;		/* Only used by the island thread */
+	atomic_int generation;
+	int n_checkpoint_failed;	/* Written by the island thread, read after it's joined */
+
+	/* Written by the island thread and read by nn_island_get_stats(), protected by lock */
+	struct timespec start;
+	struct timespec stop;
+} _NNIsland;
+
+typedef struct {
+	_NNIsland *islands;
+	NeuralNetwork *seed;
+} _NNIslandModelPriv;
+
+typedef struct {
+	_NNMigrant *migrants;
+	int n;
+	int max;
+} _NNMigrantCollect;
+
+static void *_nn_island_thread(void *arg);
+
+static void _nn_island_populate(_NNIsland *island, NeuralNetwork *seed);
+
+static void _nn_island_evolve(_NNIsland *island);
+
+static void _nn_island_receive(_NNIsland *island);
+
+static void _nn_island_migrate(_NNIsland *island);
+
+static int _nn_island_collect_best(NeuralNetwork *nn, float goodness, void *arg);
+
+static int _nn_island_checkpoint(_NNIsland *island);
+
+static void _nn_island_file_name(_NNIsland *island, char *buf, int len, const char *suffix);
+
+static float _nn_timespec_diff(struct timespec *start, struct timespec *stop);
+
+static void _nn_island_set_time(_NNIsland *island, struct timespec *ts);
+
+static void _nn_island_destroy_one(_NNIsland *island);
+
+static void *
+_nn_island_thread(void *arg)
+{
+	_NNIsland *island = arg;
+	_NNIslandModelPriv *priv = island->im->priv;
+	NNIslandConfig *config = &island->im->config;
+	int gen;
+	char file_name[1024];
+
+	/* The population is loaded or made below by this thread, so it's first touched on the node */
+	if (config->numa_pin)
+		nn_numa_pin_thread(nn_numa_node_of_worker(island->id, config->n_island));
+
+	/* Mutations, crossovers, picks and migrations of this island all draw from its own seed */
+	nn_set_thread_seed(&island->seed);
+
+	island->n_checkpoint_failed = 0;
+	_nn_island_set_time(island, &island->start);
+
+	if (nn_elites_get_count(&island->elites) == 0 &&
+		config->checkpoint_prefix)
+	{
+		_nn_island_file_name(island, file_name, sizeof(file_name), "");
+		nn_elites_load(&island->elites, file_name);
+	}
+	if (nn_elites_get_count(&island->elites) == 0)
+		_nn_island_populate(island, priv->seed);
+
+	for (gen = 1; gen <= config->n_generation; gen++)
+	{
+		_nn_island_evolve(island);
+		_nn_island_receive(island);
+
+		if (config->migrate_interval > 0 &&
+			config->n_island > 1 &&
+			gen % config->migrate_interval == 0)
+			_nn_island_migrate(island);
+
+		if (config->checkpoint_interval > 0 &&
+			config->checkpoint_prefix &&
+			gen % config->checkpoint_interval == 0 &&
+			_nn_island_checkpoint(island))
+			island->n_checkpoint_failed++;
+
+		atomic_store(&island->generation, gen);
+	}
+
+	_nn_island_set_time(island, &island->stop);
+	nn_set_thread_seed(NULL);
+
+	return NULL;
+}
+
+/* Fill the island with mutated copies of the seed */
+static void
+_nn_island_populate(_NNIsland *island, NeuralNetwork *seed)
+{
+	int i;
+	NeuralNetwork *nn;
+	NNIslandConfig *config = &island->im->config;
+
+	nn = nn_pool_duplicate(&island->pool, seed);
+	nn_elites_add(&island->elites, nn, config->fitness(nn, config->fitness_arg));
+
+	for (i = 1; i < config->n_elite; i++)
+	{
+		nn = nn_pool_duplicate(&island->pool, seed);
+		nn_plus_randomize(nn, config->mutate_range);
+		nn_elites_add(&island->elites, nn, config->fitness(nn, config->fitness_arg));
+	}
+}
+
+static void
+_nn_island_evolve(_NNIsland *island)
+{
+	int i;
+	NeuralNetwork *a;
+	NeuralNetwork *b;
+	NeuralNetwork *child;
+	NNIslandConfig *config = &island->im->config;
+
+	for (i = 0; i < config->n_offspring; i++)
+	{
+		a = nn_elites_pick_by_random(&island->elites, NULL);
+		b = nn_elites_pick_by_random(&island->elites, a);
+
+		child = nn_pool_produce(&island->pool, a, b);
+		if (child == NULL)
+			continue;
+		nn_plus_randomize_by_rate(child, config->mutate_range, config->mutate_rate);
+
+		/* The evicted one goes back to the pool for the next child */
+		nn_elites_add(&island->elites, child, config->fitness(child, config->fitness_arg));
+	}
+}
+
+static void
+_nn_island_receive(_NNIsland *island)
+{
+	int i;
+
+	pthread_mutex_lock(&island->lock);
+	for (i = 0; i < island->n_mail; i++)
+		nn_elites_add(&island->elites, island->mailbox[i].nn, island->mailbox[i].goodness);
+	island->n_mail = 0;
+	pthread_mutex_unlock(&island->lock);
+}
+
+/* Send copies of the best ones to the neighbor */
+static void
+_nn_island_migrate(_NNIsland *island)
+{
+	int i;
+	int dst_id;
+	_NNIsland *dst;
+	_NNMigrantCollect collect;
+	_NNIslandModelPriv *priv = island->im->priv;
+	NNIslandConfig *config = &island->im->config;
+
+	switch (config->topology)
+	{
+		case NN_ISLAND_TOPOLOGY_RANDOM:
+			dst_id = _nn_rand() % (config->n_island - 1);
+			if (dst_id >= island->id)
+				dst_id++;
+			break;
+
+		case NN_ISLAND_TOPOLOGY_RING:
+		default:
+			dst_id = (island->id + 1) % config->n_island;
+			break;
+	}
+	dst = &priv->islands[dst_id];
+
+	collect.migrants = malloc(config->n_migrant * sizeof(*collect.migrants));
+	if (collect.migrants == NULL)
+		return;
+	collect.n = 0;
+	collect.max = config->n_migrant;
+	nn_elites_foreach(&island->elites, _nn_island_collect_best, &collect);
+
+	/* Copy outside of the lock, the copies come from our own pool */
+	for (i = 0; i < collect.n; i++)
+		collect.migrants[i].nn = nn_pool_duplicate(&island->pool, collect.migrants[i].nn);
+
+	pthread_mutex_lock(&dst->lock);
+	for (i = 0; i < collect.n; i++)
+	{
+		if (collect.migrants[i].nn == NULL)
+			continue;
+		if (dst->n_mail < dst->max_mail)
+			dst->mailbox[dst->n_mail++] = collect.migrants[i];
+		else
+			nn_free(collect.migrants[i].nn);	/* The neighbor is too slow to receive them */
+	}
+	pthread_mutex_unlock(&dst->lock);
+
+	free(collect.migrants);
+}
+
+static int
+_nn_island_collect_best(NeuralNetwork *nn, float goodness, void *arg)
+{
+	_NNMigrantCollect *collect = arg;
+
+	if (collect->n >= collect->max)
+		return 1;
+
+	collect->migrants[collect->n].nn = nn;
+	collect->migrants[collect->n].goodness = goodness;
+	collect->n++;
+
+	return 0;
+}
+
+/* Save to a temporary file first, so a killed run always leaves a complete checkpoint */
+static int
+_nn_island_checkpoint(_NNIsland *island)
+{
+	int fd;
+	FILE *f;
+	char file_name[1024];
+	char tmp_name[1024];
+
+	_nn_island_file_name(island, file_name, sizeof(file_name), "");
+	_nn_island_file_name(island, tmp_name, sizeof(tmp_name), ".tmp");
+
+	f = fopen(tmp_name, "wb");
+	if (f == NULL)
+		return -1;
+
+	if (nn_elites_savef(&island->elites, f) ||
+		fflush(f) ||
+		fsync(fileno(f)))
+	{
+		fclose(f);
+		unlink(tmp_name);
+		return -1;
+	}
+	if (fclose(f))
+		return -1;
+
+	if (rename(tmp_name, file_name))
+		return -1;
+
+	/* Make the rename durable, file_name isn't needed anymore */
+	fd = open(dirname(file_name), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+
+	return 0;
+}
+
+static void
+_nn_island_file_name(_NNIsland *island, char *buf, int len, const char *suffix)
+{
+	snprintf(buf, len, "%s.%d%s", island->im->config.checkpoint_prefix, island->id, suffix);
+}
+
+static float
+_nn_timespec_diff(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) + (stop->tv_nsec - start->tv_nsec) / 1e9f;
+}
+
+/* Set island->start or island->stop to now */
+static void
+_nn_island_set_time(_NNIsland *island, struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&island->lock);
+	*ts = now;
+	pthread_mutex_unlock(&island->lock);
+}
+
+static void
+_nn_island_destroy_one(_NNIsland *island)
+{
+	_nn_island_receive(island);
+	nn_elites_clear(&island->elites);
+	nn_pool_clear(&island->pool);
+	pthread_mutex_destroy(&island->lock);
+	free(island->mailbox);
+}
+
+/*
+ * If checkpoint_prefix is set and the checkpoints exist, the islands are resumed from them when run.
+ * Otherwise they are populated with mutated copies of seed when run.
+ */
+int
+nn_island_init(NNIslandModel *im, const NNIslandConfig *config, NeuralNetwork *seed)
+{
+	int i;
+	_NNIsland *island;
+	_NNIslandModelPriv *priv;
+
+	if (config->n_island < 1 ||
+		config->n_elite < 1 ||
+		config->fitness == NULL ||
+		seed == NULL)
+		return -1;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+
+	priv->islands = calloc(config->n_island, sizeof(*priv->islands));
+	if (priv->islands == NULL)
+	{
+		free(priv);
+		return -1;
+	}
+	priv->seed = seed;
+
+	im->config = *config;
+	im->priv = priv;
+
+	for (i = 0; i < config->n_island; i++)
+	{
+		island = &priv->islands[i];
+		island->im = im;
+		island->id = i;
+		island->seed = config->seed + i;
+		nn_elites_init_list(&island->elites, config->n_elite);
+		nn_pool_init(&island->pool, config->n_offspring + config->n_migrant + 1);
+		nn_elites_set_pool(&island->elites, &island->pool);
+
+		pthread_mutex_init(&island->lock, NULL);
+		/* Every other island may send to us before we receive */
+		island->max_mail = config->n_migrant * (config->n_island - 1);
+		island->mailbox = malloc((island->max_mail + 1) * sizeof(*island->mailbox));
+		island->n_mail = 0;
+		if (island->mailbox == NULL)
+		{
+			while (i >= 0)
+				_nn_island_destroy_one(&priv->islands[i--]);
+			free(priv->islands);
+			free(priv);
+			im->priv = NULL;
+			return -1;
+		}
+
+		atomic_init(&island->generation, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Evolve every island in its own thread until n_generation, return when all are done.
+ * Return -1 if a thread couldn't be started or a checkpoint couldn't be saved.
+ */
+int
+nn_island_run(NNIslandModel *im)
+{
+	int i;
+	int n_started;
+	int ret;
+	_NNIslandModelPriv *priv = im->priv;
+
+	ret = 0;
+	n_started = 0;
+	for (i = 0; i < im->config.n_island; i++)
+	{
+		if (pthread_create(&priv->islands[i].thread, NULL, _nn_island_thread, &priv->islands[i]))
+		{
+			ret = -1;
+			break;
+		}
+		n_started++;
+	}
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(priv->islands[i].thread, NULL);
+
+	/* Migrants sent at the last generation */
+	for (i = 0; i < n_started; i++)
+	{
+		_nn_island_receive(&priv->islands[i]);
+		if (priv->islands[i].n_checkpoint_failed)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+NNEliteList *
+nn_island_get_elites(NNIslandModel *im, int island)
+{
+	_NNIslandModelPriv *priv = im->priv;
+
+	if (island < 0 || island >= im->config.n_island)
+		return NULL;
+
+	return &priv->islands[island].elites;
+}
+
+/* The best of all islands, only valid when no island is running */
+NeuralNetwork *
+nn_island_get_best(NNIslandModel *im, float *goodness)
+{
+	int i;
+	float g;
+	float g_best;
+	NeuralNetwork *nn;
+	NeuralNetwork *best;
+	_NNIslandModelPriv *priv = im->priv;
+
+	best = NULL;
+	g_best = 0;
+	for (i = 0; i < im->config.n_island; i++)
+	{
+		nn = nn_elites_get_best(&priv->islands[i].elites);
+		if (nn == NULL)
+			continue;
+
+		g = nn_elites_get_best_goodness(&priv->islands[i].elites);
+		if (best == NULL || g > g_best)
+		{
+			best = nn;
+			g_best = g;
+		}
+	}
+
+	if (goodness)
+		*goodness = g_best;
+
+	return best;
+}
+
+/* Could be called while running to watch the progress */
+int
+nn_island_get_stats(NNIslandModel *im, int island, int *generation, float *gen_per_sec)
+{
+	int gen;
+	float elapsed;
+	struct timespec now;
+	struct timespec start;
+	struct timespec stop;
+	_NNIsland *il;
+	_NNIslandModelPriv *priv = im->priv;
+
+	if (island < 0 || island >= im->config.n_island)
+		return -1;
+
+	il = &priv->islands[island];
+	gen = atomic_load(&il->generation);
+
+	if (generation)
+		*generation = gen;
+
+	if (gen_per_sec)
+	{
+		pthread_mutex_lock(&il->lock);
+		start = il->start;
+		stop = il->stop;
+		pthread_mutex_unlock(&il->lock);
+
+		if (gen >= im->config.n_generation && stop.tv_sec)
+			now = stop;
+		else
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+		elapsed = start.tv_sec ? _nn_timespec_diff(&start, &now) : 0;
+		*gen_per_sec = elapsed > 0 ? gen / elapsed : 0;
+	}
+
+	return 0;
+}
+
+void
+nn_island_destroy(NNIslandModel *im)
+{
+	int i;
+	_NNIslandModelPriv *priv = im->priv;
+
+	for (i = 0; i < im->config.n_island; i++)
+		_nn_island_destroy_one(&priv->islands[i]);
+
+	free(priv->islands);
+	free(priv);
+	im->priv = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef __NEURAL_NETWORK_ISLAND_H
+#define __NEURAL_NETWORK_ISLAND_H
+
+#include "neural_network.h"
+#include "neural_network_elite.h"
+
+typedef enum {
+	NN_ISLAND_TOPOLOGY_RING,
+	NN_ISLAND_TOPOLOGY_RANDOM,
+} NN_ISLAND_TOPOLOGY;
+
+/* Called from the island threads at the same time, must be thread safe */
+typedef float (*NNFitnessFunc)(NeuralNetwork *nn, void *arg);
+
+typedef struct {
+	int n_island;
+	int n_elite;			/* Length of the elite list of each island */
+	int n_offspring;		/* Children produced by each island every generation */
+	int n_generation;
+	float mutate_range;
+	float mutate_rate;
+	int migrate_interval;		/* Generations between migrations, 0 to never migrate */
+	int n_migrant;			/* So many best ones are sent to the neighbor every migration */
+	NN_ISLAND_TOPOLOGY topology;
+	int checkpoint_interval;	/* Generations between checkpoints, 0 to never save */
+	const char *checkpoint_prefix;	/* Island i is saved to "<prefix>.<i>" */
+	NNFitnessFunc fitness;
+	void *fitness_arg;
+	int numa_pin;			/* Pin the islands to the NUMA nodes, so every population stays local */
+	unsigned int seed;		/* Island i draws from seed + i, see nn_set_thread_seed() */
+} NNIslandConfig;
+
+typedef struct {
+	NNIslandConfig config;
+	void *priv;
+} NNIslandModel;
+
+int nn_island_init(NNIslandModel *im, const NNIslandConfig *config, NeuralNetwork *seed);
+
+int nn_island_run(NNIslandModel *im);
+
+NNEliteList *nn_island_get_elites(NNIslandModel *im, int island);
+
+NeuralNetwork *nn_island_get_best(NNIslandModel *im, float *goodness);
+
+int nn_island_get_stats(NNIslandModel *im, int island, int *generation, float *gen_per_sec);
+
+void nn_island_destroy(NNIslandModel *im);
+
+#endif /* __NEURAL_NETWORK_ISLAND_H */
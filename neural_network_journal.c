@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include "neural_network_journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#define NN_JOURNAL_MAGIC	0x4a454e4e	/* "NNEJ" */
+#define NN_JOURNAL_VERSION	1
+
+/*
+ * File layout:
+ *   header: magic, version, max_len
+ *   records: type, payload length, payload, checksum of all before it in the record
+ */
+enum {
+	NN_JOURNAL_INSERT = 1,	/* id, goodness, network in nn_savef() format */
+	NN_JOURNAL_EVICT,	/* id */
+	NN_JOURNAL_COMMIT,	/* generation */
+};
+
+typedef struct {
+	uint32_t type;
+	uint32_t len;
+} _NNJournalRecordHeader;
+
+typedef struct {
+	NeuralNetwork *nn;
+	float goodness;
+	uint64_t id;
+} _NNJournalMember;
+
+typedef struct {
+	FILE *f;
+	char *file_name;
+	uint64_t next_id;
+	int generation;
+	int n_record;
+	int n_uncommitted;	/* Records written since the last commit */
+	long end;		/* Where the last complete record ends */
+	int broken;		/* A failed write couldn't be undone, every call fails from then */
+
+	/* Which id every network in the list has */
+	_NNJournalMember *members;
+	int n_member;
+	int max_member;
+} _NNJournalPriv;
+
+typedef struct {
+	_NNJournalPriv *priv;
+	FILE *f;
+} _NNJournalCompact;
+
+static uint32_t _nn_journal_checksum(uint32_t sum, const void *data, size_t len);
+
+static int _nn_journal_write(FILE *f, uint32_t type, const void *payload, uint32_t len);
+
+static int _nn_journal_write_insert(FILE *f, uint64_t id, NeuralNetwork *nn, float goodness);
+
+static uint32_t _nn_journal_min_len(uint32_t type);
+
+static void *_nn_journal_read(FILE *f, _NNJournalRecordHeader *hdr);
+
+static int _nn_journal_replay(_NNJournalPriv *priv, FILE *f, long *end);
+
+static int _nn_journal_member_add(_NNJournalPriv *priv, NeuralNetwork *nn, float goodness, uint64_t id);
+
+static int _nn_journal_member_find(_NNJournalPriv *priv, NeuralNetwork *nn, uint64_t id);
+
+static void _nn_journal_member_remove(_NNJournalPriv *priv, int i);
+
+static int _nn_journal_compact_one(NeuralNetwork *nn, float goodness, void *arg);
+
+static int _nn_journal_sync(FILE *f);
+
+static void _nn_journal_rollback(_NNJournalPriv *priv);
+
+static void _nn_journal_sync_dir(const char *file_name);
+
+/* FNV-1a */
+static uint32_t
+_nn_journal_checksum(uint32_t sum, const void *data, size_t len)
+{
+	size_t i;
+	const unsigned char *p = data;
+
+	for (i = 0; i < len; i++)
+	{
+		sum ^= p[i];
+		sum *= 16777619u;
+	}
+
+	return sum;
+}
+
+static int
+_nn_journal_write(FILE *f, uint32_t type, const void *payload, uint32_t len)
+{
+	uint32_t sum;
+	_NNJournalRecordHeader hdr;
+
+	hdr.type = type;
+	hdr.len = len;
+	sum = _nn_journal_checksum(2166136261u, &hdr, sizeof(hdr));
+	sum = _nn_journal_checksum(sum, payload, len);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+	if (len && fwrite(payload, len, 1, f) != 1)
+		return -1;
+	if (fwrite(&sum, sizeof(sum), 1, f) != 1)
+		return -1;
+
+	return 0;
+}
+
+static int
+_nn_journal_write_insert(FILE *f, uint64_t id, NeuralNetwork *nn, float goodness)
+{
+	int ret;
+	char *buf;
+	size_t len;
+	FILE *mf;
+
+	/* Serialize into memory first, the checksum needs the bytes */
+	mf = open_memstream(&buf, &len);
+	if (mf == NULL)
+		return -1;
+
+	ret = 0;
+	if (fwrite(&id, sizeof(id), 1, mf) != 1 ||
+		fwrite(&goodness, sizeof(goodness), 1, mf) != 1 ||
+		nn_savef(nn, mf))
+		ret = -1;
+	fclose(mf);
+
+	if (ret == 0)
+		ret = _nn_journal_write(f, NN_JOURNAL_INSERT, buf, len);
+
+	free(buf);
+	return ret;
+}
+
+/* Length of the fixed fields of a record type, anything shorter is broken */
+static uint32_t
+_nn_journal_min_len(uint32_t type)
+{
+	switch (type)
+	{
+		case NN_JOURNAL_INSERT:
+			return sizeof(uint64_t) + sizeof(float);
+		case NN_JOURNAL_EVICT:
+			return sizeof(uint64_t);
+		case NN_JOURNAL_COMMIT:
+			return sizeof(int);
+		default:
+			return 0;
+	}
+}
+
+/* Return the payload of the next record, NULL at the end of the file or on a broken record */
+static void *
+_nn_journal_read(FILE *f, _NNJournalRecordHeader *hdr)
+{
+	uint32_t sum;
+	uint32_t stored;
+	char *payload;
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+		hdr->len < _nn_journal_min_len(hdr->type))
+		return NULL;
+
+	/* + 1 so there's always something to return for an empty payload */
+	payload = malloc(hdr->len + 1);
+	if (payload == NULL)
+		return NULL;
+
+	if ((hdr->len && fread(payload, hdr->len, 1, f) != 1) ||
+		fread(&stored, sizeof(stored), 1, f) != 1)
+		goto __error;
+
+	sum = _nn_journal_checksum(2166136261u, hdr, sizeof(*hdr));
+	sum = _nn_journal_checksum(sum, payload, hdr->len);
+	if (sum != stored)
+		goto __error;
+
+	return payload;
+
+__error:
+	free(payload);
+	return NULL;
+}
+
+/*
+ * Replay the records until the last commit into the member table.
+ * end is set to where the last commit record ends.
+ */
+static int
+_nn_journal_replay(_NNJournalPriv *priv, FILE *f, long *end)
+{
+	long start;
+	long last_commit;
+	int i;
+	char *payload;
+	uint64_t id;
+	float goodness;
+	FILE *mf;
+	NeuralNetwork *nn;
+	_NNJournalRecordHeader hdr;
+
+	/* 1. Find where the last complete commit is */
+	start = ftell(f);
+	last_commit = start;
+	while ((payload = _nn_journal_read(f, &hdr)) != NULL)
+	{
+		if (hdr.type == NN_JOURNAL_COMMIT)
+			last_commit = ftell(f);
+		free(payload);
+	}
+	*end = last_commit;
+
+	/* 2. Apply everything before it */
+	fseek(f, start, SEEK_SET);
+	while (ftell(f) < last_commit &&
+		(payload = _nn_journal_read(f, &hdr)) != NULL)
+	{
+		switch (hdr.type)
+		{
+			case NN_JOURNAL_INSERT:
+				memcpy(&id, payload, sizeof(id));
+				memcpy(&goodness, payload + sizeof(id), sizeof(goodness));
+				mf = fmemopen(payload + sizeof(id) + sizeof(goodness),
+						hdr.len - sizeof(id) - sizeof(goodness),
+						"rb");
+				nn = mf ? nn_loadf(mf) : NULL;
+				if (mf)
+					fclose(mf);
+				if (nn == NULL || _nn_journal_member_add(priv, nn, goodness, id))
+				{
+					free(payload);
+					return -1;
+				}
+				if (priv->next_id <= id)
+					priv->next_id = id + 1;
+				break;
+
+			case NN_JOURNAL_EVICT:
+				memcpy(&id, payload, sizeof(id));
+				i = _nn_journal_member_find(priv, NULL, id);
+				if (i >= 0)
+				{
+					nn_free(priv->members[i].nn);
+					_nn_journal_member_remove(priv, i);
+				}
+				break;
+
+			case NN_JOURNAL_COMMIT:
+				memcpy(&priv->generation, payload, sizeof(priv->generation));
+				break;
+
+			default:
+				break;
+		}
+		priv->n_record++;
+		free(payload);
+	}
+
+	return 0;
+}
+
+static int
+_nn_journal_member_add(_NNJournalPriv *priv, NeuralNetwork *nn, float goodness, uint64_t id)
+{
+	int max;
+	_NNJournalMember *members;
+
+	if (priv->n_member >= priv->max_member)
+	{
+		max = priv->max_member ? priv->max_member * 2 : 64;
+		members = realloc(priv->members, max * sizeof(*members));
+		if (members == NULL)
+			return -1;
+		priv->members = members;
+		priv->max_member = max;
+	}
+
+	priv->members[priv->n_member].nn = nn;
+	priv->members[priv->n_member].goodness = goodness;
+	priv->members[priv->n_member].id = id;
+	priv->n_member++;
+
+	return 0;
+}
+
+/* Find by nn, or by id if nn is NULL */
+static int
+_nn_journal_member_find(_NNJournalPriv *priv, NeuralNetwork *nn, uint64_t id)
+{
+	int i;
+
+	for (i = 0; i < priv->n_member; i++)
+	{
+		if (nn ? priv->members[i].nn == nn : priv->members[i].id == id)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+_nn_journal_member_remove(_NNJournalPriv *priv, int i)
+{
+	priv->members[i] = priv->members[--priv->n_member];
+}
+
+static int
+_nn_journal_compact_one(NeuralNetwork *nn, float goodness, void *arg)
+{
+	int i;
+	_NNJournalCompact *compact = arg;
+
+	i = _nn_journal_member_find(compact->priv, nn, 0);
+	if (i < 0)
+		return -1;
+
+	compact->priv->n_record++;
+
+	return _nn_journal_write_insert(compact->f, compact->priv->members[i].id, nn, goodness);
+}
+
+static int
+_nn_journal_sync(FILE *f)
+{
+	if (fflush(f))
+		return -1;
+
+	return fsync(fileno(f));
+}
+
+/* Cut off what a failed write left after the last complete record */
+static void
+_nn_journal_rollback(_NNJournalPriv *priv)
+{
+	if (fflush(priv->f) ||
+		ftruncate(fileno(priv->f), priv->end) ||
+		fseek(priv->f, priv->end, SEEK_SET))
+		priv->broken = 1;
+}
+
+/* Make a rename durable */
+static void
+_nn_journal_sync_dir(const char *file_name)
+{
+	int fd;
+	char *path;
+
+	path = strdup(file_name);
+	if (path == NULL)
+		return;
+
+	fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+
+	free(path);
+}
+
+/*
+ * Open the journal, replay what's committed in it into list and get ready to append.
+ * The list must be empty, its max_len is taken from the journal if there is one.
+ */
+int
+nn_journal_open(NNEliteJournal *j, NNEliteList *list, const char *file_name, int compact_interval)
+{
+	int i;
+	long end;
+	uint32_t magic;
+	uint32_t version;
+	_NNJournalPriv *priv;
+
+	if (nn_elites_get_count(list) != 0)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	priv->generation = -1;
+	priv->file_name = strdup(file_name);
+
+	priv->f = fopen(file_name, "r+b");
+	if (priv->f)
+	{
+		/* Resume */
+		if (fread(&magic, sizeof(magic), 1, priv->f) != 1 ||
+			fread(&version, sizeof(version), 1, priv->f) != 1 ||
+			fread(&list->max_len, sizeof(list->max_len), 1, priv->f) != 1 ||
+			magic != NN_JOURNAL_MAGIC ||
+			version != NN_JOURNAL_VERSION)
+			goto __error;
+
+		if (_nn_journal_replay(priv, priv->f, &end))
+			goto __error;
+
+		/* Cut off the uncommitted tail, new records go right after the last commit */
+		fflush(priv->f);
+		if (ftruncate(fileno(priv->f), end))
+			goto __error;
+		fseek(priv->f, end, SEEK_SET);
+		priv->end = end;
+
+		for (i = 0; i < priv->n_member; i++)
+			nn_elites_add(list, priv->members[i].nn, priv->members[i].goodness);
+	}
+	else
+	{
+		/* Start a new one */
+		priv->f = fopen(file_name, "w+b");
+		if (priv->f == NULL)
+			goto __error;
+
+		magic = NN_JOURNAL_MAGIC;
+		version = NN_JOURNAL_VERSION;
+		if (fwrite(&magic, sizeof(magic), 1, priv->f) != 1 ||
+			fwrite(&version, sizeof(version), 1, priv->f) != 1 ||
+			fwrite(&list->max_len, sizeof(list->max_len), 1, priv->f) != 1 ||
+			_nn_journal_sync(priv->f))
+			goto __error;
+		_nn_journal_sync_dir(file_name);
+		priv->end = ftell(priv->f);
+	}
+
+	j->list = list;
+	j->compact_interval = compact_interval;
+	j->priv = priv;
+
+	return 0;
+
+__error:
+	for (i = 0; i < priv->n_member; i++)
+		nn_free(priv->members[i].nn);
+	if (priv->f)
+		fclose(priv->f);
+	free(priv->members);
+	free(priv->file_name);
+	free(priv);
+	return -1;
+}
+
+/*
+ * Same as nn_elites_add(), and record what's changed.
+ * On failure nothing is changed and nn still belongs to the caller.
+ */
+int
+nn_journal_add(NNEliteJournal *j, NeuralNetwork *nn, float goodness)
+{
+	int i;
+	int n_written;
+	float worst_goodness;
+	NeuralNetwork *worst;
+	_NNJournalPriv *priv = j->priv;
+
+	if (priv->broken)
+		return -1;
+
+	worst = NULL;
+	if (nn_elites_get_count(j->list) >= j->list->max_len)
+	{
+		worst = nn_elites_get_worst(j->list, &worst_goodness);
+		if (worst && goodness <= worst_goodness)
+		{
+			/* The list puts it at the last and evicts it right away, nothing changes */
+			nn_elites_add(j->list, nn, goodness);
+			return 0;
+		}
+	}
+	i = worst ? _nn_journal_member_find(priv, worst, 0) : -1;
+
+	/* 1. Record the insert and the eviction, the file is cut back if either fails */
+	n_written = 1;
+	if (_nn_journal_write_insert(priv->f, priv->next_id, nn, goodness))
+		goto __error;
+	if (i >= 0)
+	{
+		n_written++;
+		if (_nn_journal_write(priv->f, NN_JOURNAL_EVICT, &priv->members[i].id, sizeof(priv->members[i].id)))
+			goto __error;
+	}
+	/* Flushed, so a write error shows up here and not after more records */
+	if (fflush(priv->f) ||
+		_nn_journal_member_add(priv, nn, goodness, priv->next_id))
+		goto __error;
+
+	/* 2. Then change the list and the members the same way, the worst one is gone */
+	nn_elites_add(j->list, nn, goodness);
+	if (i >= 0)
+		_nn_journal_member_remove(priv, i);
+	priv->next_id++;
+	priv->n_record += n_written;
+	priv->n_uncommitted += n_written;
+	priv->end = ftell(priv->f);
+
+	return 0;
+
+__error:
+	_nn_journal_rollback(priv);
+	return -1;
+}
+
+/* Everything added so far survives a crash once this returns 0 */
+int
+nn_journal_commit(NNEliteJournal *j, int generation)
+{
+	_NNJournalPriv *priv = j->priv;
+
+	if (priv->broken)
+		return -1;
+
+	if (_nn_journal_write(priv->f, NN_JOURNAL_COMMIT, &generation, sizeof(generation)) ||
+		_nn_journal_sync(priv->f))
+	{
+		_nn_journal_rollback(priv);
+		return -1;
+	}
+
+	priv->generation = generation;
+	priv->n_record++;
+	priv->n_uncommitted = 0;
+	priv->end = ftell(priv->f);
+
+	if (j->compact_interval > 0 && priv->n_record >= j->compact_interval + priv->n_member)
+		return nn_journal_compact(j);
+
+	return 0;
+}
+
+/*
+ * Rewrite the journal as the inserts of the current elites and a commit.
+ * It's written to a temporary file and renamed, so there's always a valid journal on the disk.
+ * Fails if anything's been added since the last commit, only the committed elites are written.
+ */
+int
+nn_journal_compact(NNEliteJournal *j)
+{
+	char *tmp_name;
+	int n_record;
+	uint32_t magic;
+	uint32_t version;
+	FILE *f;
+	_NNJournalCompact compact;
+	_NNJournalPriv *priv = j->priv;
+
+	if (priv->broken || priv->n_uncommitted > 0)
+		return -1;
+
+	tmp_name = malloc(strlen(priv->file_name) + 5);
+	if (tmp_name == NULL)
+		return -1;
+	sprintf(tmp_name, "%s.tmp", priv->file_name);
+
+	f = fopen(tmp_name, "wb");
+	if (f == NULL)
+	{
+		free(tmp_name);
+		return -1;
+	}
+
+	magic = NN_JOURNAL_MAGIC;
+	version = NN_JOURNAL_VERSION;
+	n_record = priv->n_record;
+	priv->n_record = 0;
+	compact.priv = priv;
+	compact.f = f;
+	if (fwrite(&magic, sizeof(magic), 1, f) != 1 ||
+		fwrite(&version, sizeof(version), 1, f) != 1 ||
+		fwrite(&j->list->max_len, sizeof(j->list->max_len), 1, f) != 1 ||
+		nn_elites_foreach(j->list, _nn_journal_compact_one, &compact) ||
+		_nn_journal_write(f, NN_JOURNAL_COMMIT, &priv->generation, sizeof(priv->generation)) ||
+		_nn_journal_sync(f))
+		goto __error;
+	priv->n_record++;
+
+	if (rename(tmp_name, priv->file_name))
+		goto __error;
+	_nn_journal_sync_dir(priv->file_name);
+
+	/* Append to the new one from now on */
+	fclose(priv->f);
+	priv->f = f;
+	priv->end = ftell(f);
+	free(tmp_name);
+
+	return 0;
+
+__error:
+	priv->n_record = n_record;
+	fclose(f);
+	unlink(tmp_name);
+	free(tmp_name);
+	return -1;
+}
+
+/* The generation of the last commit, -1 if nothing is committed */
+int
+nn_journal_get_generation(NNEliteJournal *j)
+{
+	_NNJournalPriv *priv = j->priv;
+
+	return priv->generation;
+}
+
+/* Close the journal, the list is left as it is. Anything not committed is lost on the next open */
+void
+nn_journal_close(NNEliteJournal *j)
+{
+	_NNJournalPriv *priv = j->priv;
+
+	fclose(priv->f);
+	free(priv->members);
+	free(priv->file_name);
+	free(priv);
+	j->priv = NULL;
+}
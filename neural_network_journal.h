@@ -0,0 +1,29 @@
+#ifndef __NEURAL_NETWORK_JOURNAL_H
+#define __NEURAL_NETWORK_JOURNAL_H
+
+#include "neural_network_elite.h"
+
+/*
+ * An append-only journal of the inserts and evictions of an elite list.
+ * Only what's been committed is replayed on open, anything after the last commit
+ * (e.g. a half-written record of a killed run) is thrown away.
+ */
+typedef struct {
+	NNEliteList *list;
+	int compact_interval;	/* Compact on commit once the journal has so many records, 0 to never */
+	void *priv;
+} NNEliteJournal;
+
+int nn_journal_open(NNEliteJournal *j, NNEliteList *list, const char *file_name, int compact_interval);
+
+int nn_journal_add(NNEliteJournal *j, NeuralNetwork *nn, float goodness);
+
+int nn_journal_commit(NNEliteJournal *j, int generation);
+
+int nn_journal_compact(NNEliteJournal *j);
+
+int nn_journal_get_generation(NNEliteJournal *j);
+
+void nn_journal_close(NNEliteJournal *j);
+
+#endif /* __NEURAL_NETWORK_JOURNAL_H */
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include "neural_network_numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define NN_NUMA_SYSFS	"/sys/devices/system/node"
+#define NN_NUMA_MAX_NODE	64
+
+typedef struct {
+	NeuralNetwork *src;
+	NeuralNetwork *dst;
+	int node;
+} _NNNumaCopy;
+
+/* The CPUs of every node, read once, indexed by the order of the node ids */
+static pthread_once_t _nn_numa_once = PTHREAD_ONCE_INIT;
+static int _nn_numa_n_node;
+static cpu_set_t _nn_numa_cpus[NN_NUMA_MAX_NODE];
+
+static int _nn_numa_read_cpulist(int node, cpu_set_t *set);
+
+static void _nn_numa_load(void);
+
+static void *_nn_numa_copy_thread(void *arg);
+
+/* Parse the cpulist of node, like "0-3,8-11", return -1 if there is no such node */
+static int
+_nn_numa_read_cpulist(int node, cpu_set_t *set)
+{
+	int lo;
+	int hi;
+	int cpu;
+	int n;
+	char path[128];
+	char buf[4096];
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), NN_NUMA_SYSFS "/node%d/cpulist", node);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	CPU_ZERO(set);
+	p = buf;
+	while (*p >= '0' && *p <= '9')
+	{
+		lo = strtol(p, &p, 10);
+		hi = lo;
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+/* Node ids may have holes, like node0 and node2, so every id is tried and the nodes found are packed */
+static void
+_nn_numa_load(void)
+{
+	int id;
+	int n_node;
+
+	n_node = 0;
+	for (id = 0; id < NN_NUMA_MAX_NODE; id++)
+	{
+		if (_nn_numa_read_cpulist(id, &_nn_numa_cpus[n_node]) == 0)
+			n_node++;
+	}
+	_nn_numa_n_node = n_node;
+}
+
+/* Return the number of nodes, 1 if the system says nothing */
+int
+nn_numa_get_node_count(void)
+{
+	pthread_once(&_nn_numa_once, _nn_numa_load);
+
+	return _nn_numa_n_node > 0 ? _nn_numa_n_node : 1;
+}
+
+/* Return the node the calling thread runs on now */
+int
+nn_numa_get_current_node(void)
+{
+	int cpu;
+	int node;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+
+	pthread_once(&_nn_numa_once, _nn_numa_load);
+	for (node = 0; node < _nn_numa_n_node; node++)
+	{
+		if (CPU_ISSET(cpu, &_nn_numa_cpus[node]))
+			return node;
+	}
+
+	return 0;
+}
+
+/* Spread n_worker workers over the nodes, consecutive workers on the same node */
+int
+nn_numa_node_of_worker(int worker, int n_worker)
+{
+	int n_node;
+
+	n_node = nn_numa_get_node_count();
+	if (n_worker < n_node)
+		return worker % n_node;
+
+	return (long)worker * n_node / n_worker;
+}
+
+/* Let the calling thread only run on the CPUs of node */
+int
+nn_numa_pin_thread(int node)
+{
+	pthread_once(&_nn_numa_once, _nn_numa_load);
+	if (node < 0 || node >= _nn_numa_n_node || CPU_COUNT(&_nn_numa_cpus[node]) == 0)
+		return -1;
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &_nn_numa_cpus[node]) ? -1 : 0;
+}
+
+/* Make the threads created with attr only run on the CPUs of node */
+int
+nn_numa_set_attr_node(pthread_attr_t *attr, int node)
+{
+	pthread_once(&_nn_numa_once, _nn_numa_load);
+	if (node < 0 || node >= _nn_numa_n_node || CPU_COUNT(&_nn_numa_cpus[node]) == 0)
+		return -1;
+
+	return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &_nn_numa_cpus[node]) ? -1 : 0;
+}
+
+static void *
+_nn_numa_copy_thread(void *arg)
+{
+	_NNNumaCopy *copy = arg;
+
+	nn_numa_pin_thread(copy->node);
+	copy->dst = nn_duplicate(copy->src);
+
+	return NULL;
+}
+
+/*
+ * Duplicate nn from a thread pinned to node, so the pages of the copy are first touched there.
+ * Falls back to a plain nn_duplicate() if the thread can't be started.
+ */
+NeuralNetwork *
+nn_numa_duplicate_on(NeuralNetwork *nn, int node)
+{
+	pthread_t thread;
+	_NNNumaCopy copy;
+
+	copy.src = nn;
+	copy.dst = NULL;
+	copy.node = node;
+	if (pthread_create(&thread, NULL, _nn_numa_copy_thread, &copy))
+		return nn_duplicate(nn);
+	pthread_join(thread, NULL);
+
+	return copy.dst;
+}
+
+/*
+ * Make a read-only copy of nn on every node.
+ * nn_run() writes the output buffer of the network, so threads sharing a replica
+ * are to use nn_run_batch() or their own buffers.
+ */
+int
+nn_numa_replicate(NNNumaReplicas *r, NeuralNetwork *nn)
+{
+	int i;
+
+	r->n_node = nn_numa_get_node_count();
+	r->replicas = calloc(r->n_node, sizeof(*r->replicas));
+	if (r->replicas == NULL)
+		return -1;
+
+	for (i = 0; i < r->n_node; i++)
+	{
+		r->replicas[i] = nn_numa_duplicate_on(nn, i);
+		if (r->replicas[i] == NULL)
+		{
+			nn_numa_replicas_free(r);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* The replica on the node of the calling thread */
+NeuralNetwork *
+nn_numa_get_replica(NNNumaReplicas *r)
+{
+	int node;
+
+	node = nn_numa_get_current_node();
+	if (node >= r->n_node)
+		node = 0;
+
+	return r->replicas[node];
+}
+
+void
+nn_numa_replicas_free(NNNumaReplicas *r)
+{
+	int i;
+
+	if (r->replicas)
+	{
+		for (i = 0; i < r->n_node; i++)
+		{
+			if (r->replicas[i])
+				nn_free(r->replicas[i]);
+		}
+		free(r->replicas);
+	}
+	r->replicas = NULL;
+	r->n_node = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __NEURAL_NETWORK_NUMA_H
+#define __NEURAL_NETWORK_NUMA_H
+
+#include <pthread.h>
+#include "neural_network.h"
+
+/*
+ * NUMA placement without libnuma.
+ * The nodes are read from /sys/devices/system/node, memory is placed by first touch from a thread
+ * pinned to the node. Without NUMA support everything is node 0 and pinning does nothing.
+ * Nodes are numbered from 0 in the order of their ids, so with node0 and node2 node 1 is node2.
+ */
+typedef struct {
+	int n_node;
+	NeuralNetwork **replicas;	/* One per node */
+} NNNumaReplicas;
+
+int nn_numa_get_node_count(void);
+
+int nn_numa_get_current_node(void);
+
+int nn_numa_node_of_worker(int worker, int n_worker);
+
+int nn_numa_pin_thread(int node);
+
+int nn_numa_set_attr_node(pthread_attr_t *attr, int node);
+
+NeuralNetwork *nn_numa_duplicate_on(NeuralNetwork *nn, int node);
+
+int nn_numa_replicate(NNNumaReplicas *r, NeuralNetwork *nn);
+
+NeuralNetwork *nn_numa_get_replica(NNNumaReplicas *r);
+
+void nn_numa_replicas_free(NNNumaReplicas *r);
+
+#endif /* __NEURAL_NETWORK_NUMA_H */
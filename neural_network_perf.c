@@ -0,0 +1,107 @@
+#include "neural_network_perf.h"
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *nn_perf_names[NN_PERF_N_COUNTER] = {
+	"cycles",
+	"instructions",
+	"llc_misses",
+	"branch_misses",
+};
+
+#ifdef __linux__
+static int nn_perf_event_open(unsigned int type, unsigned long long config);
+
+static int
+nn_perf_event_open(unsigned int type, unsigned long long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	/* User space only, that's all we are allowed to see with the default perf_event_paranoid */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	/* This thread on any cpu */
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/*
+ * Open every counter on its own, so one missing counter (e.g. in a VM) doesn't take the others.
+ * Return how many are available, 0 if none, the reads then give 0.
+ */
+int
+nn_perf_open(NNPerfCounters *pc)
+{
+	int i;
+	int n;
+
+	for (i = 0; i < NN_PERF_N_COUNTER; i++)
+		pc->fd[i] = -1;
+
+#ifdef __linux__
+	pc->fd[NN_PERF_CYCLES] = nn_perf_event_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	pc->fd[NN_PERF_INSTRUCTIONS] = nn_perf_event_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	pc->fd[NN_PERF_LLC_MISSES] = nn_perf_event_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	pc->fd[NN_PERF_BRANCH_MISSES] = nn_perf_event_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+
+	n = 0;
+	for (i = 0; i < NN_PERF_N_COUNTER; i++)
+	{
+		if (pc->fd[i] >= 0)
+			n++;
+	}
+
+	return n;
+}
+
+int
+nn_perf_available(NNPerfCounters *pc, NN_PERF_COUNTER counter)
+{
+	return pc->fd[counter] >= 0;
+}
+
+/* values has NN_PERF_N_COUNTER elements, the counters not available read 0 */
+void
+nn_perf_read(NNPerfCounters *pc, unsigned long long *values)
+{
+	int i;
+
+	for (i = 0; i < NN_PERF_N_COUNTER; i++)
+	{
+		values[i] = 0;
+		if (pc->fd[i] < 0)
+			continue;
+		if (read(pc->fd[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+			values[i] = 0;
+	}
+}
+
+void
+nn_perf_close(NNPerfCounters *pc)
+{
+	int i;
+
+	for (i = 0; i < NN_PERF_N_COUNTER; i++)
+	{
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+const char *
+nn_perf_counter_name(NN_PERF_COUNTER counter)
+{
+	return nn_perf_names[counter];
+}
@@ -0,0 +1,31 @@
+#ifndef __NEURAL_NETWORK_PERF_H
+#define __NEURAL_NETWORK_PERF_H
+
+/* Hardware performance counters of the calling thread, through Linux perf_event_open() */
+
+typedef enum {
+	NN_PERF_CYCLES,
+	NN_PERF_INSTRUCTIONS,
+	NN_PERF_LLC_MISSES,
+	NN_PERF_BRANCH_MISSES,
+	NN_PERF_N_COUNTER,
+} NN_PERF_COUNTER;
+
+/* Size of a cache line, to estimate the memory traffic from LLC misses */
+#define NN_PERF_CACHE_LINE 64
+
+typedef struct {
+	int fd[NN_PERF_N_COUNTER];	/* -1 if the counter is not available */
+} NNPerfCounters;
+
+int nn_perf_open(NNPerfCounters *pc);
+
+int nn_perf_available(NNPerfCounters *pc, NN_PERF_COUNTER counter);
+
+void nn_perf_read(NNPerfCounters *pc, unsigned long long *values);
+
+void nn_perf_close(NNPerfCounters *pc);
+
+const char *nn_perf_counter_name(NN_PERF_COUNTER counter);
+
+#endif /* __NEURAL_NETWORK_PERF_H */
@@ -0,0 +1,101 @@
+#include "neural_network_pool.h"
+#include <stdlib.h>
+
+void
+nn_pool_init(NNPool *pool, int max_len)
+{
+	pool->max_len = max_len;
+	pool->len = 0;
+	pool->free_list = NULL;
+	if (max_len > 0)
+		pool->free_list = malloc(max_len * sizeof(*pool->free_list));
+}
+
+void
+nn_pool_put(NNPool *pool, NeuralNetwork *nn)
+{
+	if (nn == NULL)
+		return;
+
+	/* Pool is full, really free it */
+	if (pool->len >= pool->max_len)
+	{
+		nn_free(nn);
+		return;
+	}
+
+	pool->free_list[pool->len++] = nn;
+}
+
+/*
+ * Get a network of the same shape as shape.
+ * The weight and bias of the returned network are undefined.
+ */
+NeuralNetwork *
+nn_pool_get(NNPool *pool, NeuralNetwork *shape)
+{
+	int i;
+	NeuralNetwork *nn;
+
+	/* Search from the most recently put one, it's the most likely to be still in cache */
+	for (i = pool->len - 1; i >= 0; i--)
+	{
+		nn = pool->free_list[i];
+		if (nn_same_shape(nn, shape))
+		{
+			pool->free_list[i] = pool->free_list[--pool->len];
+			return nn;
+		}
+	}
+
+	/* Nothing to reuse, copying is still cheaper than nn_create() randomizing everything */
+	return nn_duplicate(shape);
+}
+
+NeuralNetwork *
+nn_pool_produce(NNPool *pool, NeuralNetwork *a, NeuralNetwork *b)
+{
+	NeuralNetwork *nn;
+
+	if (!nn_same_shape(a, b))
+		return NULL;
+
+	nn = nn_pool_get(pool, a);
+	if (nn == NULL)
+		return NULL;
+
+	nn_produce_into(nn, a, b);
+
+	return nn;
+}
+
+NeuralNetwork *
+nn_pool_duplicate(NNPool *pool, NeuralNetwork *nn)
+{
+	NeuralNetwork *new_nn;
+
+	if (nn == NULL)
+		return NULL;
+
+	new_nn = nn_pool_get(pool, nn);
+	if (new_nn == NULL)
+		return NULL;
+
+	nn_copy_into(new_nn, nn);
+
+	return new_nn;
+}
+
+void
+nn_pool_clear(NNPool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->len; i++)
+		nn_free(pool->free_list[i]);
+
+	free(pool->free_list);
+	pool->free_list = NULL;
+	pool->len = 0;
+	pool->max_len = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __NEURAL_NETWORK_POOL_H
+#define __NEURAL_NETWORK_POOL_H
+
+#include "neural_network.h"
+
+/* A free list of networks to be reused instead of malloc/free every generation */
+typedef struct {
+	int max_len;
+	int len;
+	NeuralNetwork **free_list;
+} NNPool;
+
+void nn_pool_init(NNPool *pool, int max_len);
+
+void nn_pool_put(NNPool *pool, NeuralNetwork *nn);
+
+NeuralNetwork *nn_pool_get(NNPool *pool, NeuralNetwork *shape);
+
+NeuralNetwork *nn_pool_produce(NNPool *pool, NeuralNetwork *a, NeuralNetwork *b);
+
+NeuralNetwork *nn_pool_duplicate(NNPool *pool, NeuralNetwork *nn);
+
+void nn_pool_clear(NNPool *pool);
+
+#endif /* __NEURAL_NETWORK_POOL_H */
@@ -0,0 +1,65 @@
+#ifndef __NEURAL_NETWORK_PRIVATE_H
+#define __NEURAL_NETWORK_PRIVATE_H
+
+/* Shared by the modules of the library, not a part of the API */
+
+#include "neural_network.h"
+#include "neural_network_util.h"
+#include "neural_network_perf.h"
+
+void _nn_act_func_apply(ACT_FUNC_TYPE act_func_type, float *v, int n);
+
+void _nn_layer_sum(int use_bias,
+		const float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		const float *bias,
+		const float *weight);
+
+int _nn_next_pick(int i, int n, float rate);
+
+float _nn_gen_random(void);
+
+int _nn_rand(void);
+
+NeuralNetwork *_nn_alloc_view(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output);
+
+float *_nn_run_from(NeuralNetwork *nn, int layer, float *input, float *buffer);
+
+void _nn_backward(NeuralNetwork *nn, float *expect, float rate);
+
+void _nn_sparse_free(NeuralNetwork *nn);
+
+/*
+ * Profiling hooks, they compile to nothing unless built with NN_PROFILE.
+ * The statistics are read by nn_util_profile_*().
+ */
+typedef struct {
+	unsigned long long ns;
+	unsigned long long counter[NN_PERF_N_COUNTER];
+} _NNProfStamp;
+
+#ifdef NN_PROFILE
+#define NN_PROF_DECL(t)					_NNProfStamp t;
+#define NN_PROF_BEGIN(t)				_nn_prof_begin(&(t))
+#define NN_PROF_END(nn, layer, phase, t, flop)		_nn_prof_record((nn), (layer), (phase), &(t), (flop))
+#else
+#define NN_PROF_DECL(t)
+#define NN_PROF_BEGIN(t)				((void)0)
+#define NN_PROF_END(nn, layer, phase, t, flop)		((void)0)
+#endif
+
+unsigned long long _nn_prof_now(void);
+
+void _nn_prof_begin(_NNProfStamp *stamp);
+
+void _nn_prof_record(NeuralNetwork *nn, int layer, int phase, _NNProfStamp *start, double flop);
+
+#endif /* __NEURAL_NETWORK_PRIVATE_H */
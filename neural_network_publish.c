@@ -0,0 +1,248 @@
+#include "neural_network_publish.h"
+#include "neural_network_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* Epoch of a reader that is not running anything */
+#define NN_PUBLISH_IDLE	0
+
+typedef struct {
+	/* A cache line each, readers only write their own */
+	_Alignas(64) atomic_ulong epoch;
+	atomic_int in_use;
+} _NNPublishReader;
+
+typedef struct {
+	NeuralNetwork *nn;
+	unsigned long epoch;	/* Readers entered at this epoch or before may still run it */
+} _NNPublishRetired;
+
+typedef struct {
+	_Atomic(NeuralNetwork *) current;
+	atomic_ulong epoch;	/* Starts at 1, NN_PUBLISH_IDLE is never an epoch */
+	atomic_ulong version;
+	_NNPublishReader *readers;
+
+	/* Only touched by the trainer */
+	_NNPublishRetired *retired;
+	int n_retired;
+	int max_retired;
+	NNPool pool;
+	int n_tick;
+} _NNPublishPriv;
+
+static void _nn_published_reclaim(_NNPublishPriv *priv, int max_reader);
+
+/* Move the retired versions no reader can be running to the pool */
+static void
+_nn_published_reclaim(_NNPublishPriv *priv, int max_reader)
+{
+	int i;
+	int n;
+	unsigned long e;
+	unsigned long oldest;
+
+	oldest = atomic_load(&priv->epoch);
+	for (i = 0; i < max_reader; i++)
+	{
+		e = atomic_load(&priv->readers[i].epoch);
+		if (e != NN_PUBLISH_IDLE && e < oldest)
+			oldest = e;
+	}
+
+	n = 0;
+	for (i = 0; i < priv->n_retired; i++)
+	{
+		if (priv->retired[i].epoch < oldest)
+			nn_pool_put(&priv->pool, priv->retired[i].nn);
+		else
+			priv->retired[n++] = priv->retired[i];
+	}
+	priv->n_retired = n;
+}
+
+/* Publish a copy of nn as the first version */
+int
+nn_published_init(NNPublished *pub, NeuralNetwork *nn, int max_reader, int publish_interval)
+{
+	int i;
+	NeuralNetwork *first;
+	_NNPublishPriv *priv;
+
+	memset(pub, 0, sizeof(*pub));
+	if (max_reader < 1)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	if (posix_memalign((void **)&priv->readers, 64, max_reader * sizeof(*priv->readers)))
+	{
+		free(priv);
+		return -1;
+	}
+	first = nn_duplicate(nn);
+	if (first == NULL)
+	{
+		free(priv->readers);
+		free(priv);
+		return -1;
+	}
+
+	for (i = 0; i < max_reader; i++)
+	{
+		atomic_init(&priv->readers[i].epoch, NN_PUBLISH_IDLE);
+		atomic_init(&priv->readers[i].in_use, 0);
+	}
+	atomic_init(&priv->current, first);
+	atomic_init(&priv->epoch, 1);
+	atomic_init(&priv->version, 1);
+	/* A version can be retired by every reader plus the one being published */
+	nn_pool_init(&priv->pool, max_reader + 2);
+
+	pub->max_reader = max_reader;
+	pub->publish_interval = publish_interval;
+	pub->priv = priv;
+
+	return 0;
+}
+
+/* Return a reader id for the calling thread, -1 if max_reader are registered */
+int
+nn_published_register(NNPublished *pub)
+{
+	int i;
+	int expected;
+	_NNPublishPriv *priv = pub->priv;
+
+	for (i = 0; i < pub->max_reader; i++)
+	{
+		expected = 0;
+		if (atomic_compare_exchange_strong(&priv->readers[i].in_use, &expected, 1))
+			return i;
+	}
+
+	return -1;
+}
+
+void
+nn_published_unregister(NNPublished *pub, int reader)
+{
+	_NNPublishPriv *priv = pub->priv;
+
+	atomic_store(&priv->readers[reader].epoch, NN_PUBLISH_IDLE);
+	atomic_store(&priv->readers[reader].in_use, 0);
+}
+
+/*
+ * Return the current version, it stays valid until nn_published_exit().
+ * It's shared with the other readers, run it with nn_run_with_buffer().
+ */
+NeuralNetwork *
+nn_published_enter(NNPublished *pub, int reader)
+{
+	_NNPublishPriv *priv = pub->priv;
+
+	atomic_store(&priv->readers[reader].epoch, atomic_load(&priv->epoch));
+	return atomic_load(&priv->current);
+}
+
+void
+nn_published_exit(NNPublished *pub, int reader)
+{
+	_NNPublishPriv *priv = pub->priv;
+
+	atomic_store_explicit(&priv->readers[reader].epoch, NN_PUBLISH_IDLE, memory_order_release);
+}
+
+/* Run the current version, buffer is _n_neuro floats of the caller and the output is in it */
+float *
+nn_published_run(NNPublished *pub, int reader, float *input, float *buffer)
+{
+	float *output;
+
+	output = nn_run_with_buffer(nn_published_enter(pub, reader), input, buffer);
+	nn_published_exit(pub, reader);
+
+	return output;
+}
+
+/* Called by the trainer, make a copy of nn the current version */
+int
+nn_published_publish(NNPublished *pub, NeuralNetwork *nn)
+{
+	NeuralNetwork *next;
+	NeuralNetwork *old;
+	_NNPublishRetired *retired;
+	_NNPublishPriv *priv = pub->priv;
+
+	_nn_published_reclaim(priv, pub->max_reader);
+
+	next = nn_pool_duplicate(&priv->pool, nn);
+	if (next == NULL)
+		return -1;
+
+	if (priv->n_retired == priv->max_retired)
+	{
+		retired = realloc(priv->retired, (priv->max_retired * 2 + 4) * sizeof(*retired));
+		if (retired == NULL)
+		{
+			nn_pool_put(&priv->pool, next);
+			return -1;
+		}
+		priv->retired = retired;
+		priv->max_retired = priv->max_retired * 2 + 4;
+	}
+
+	old = atomic_exchange(&priv->current, next);
+	/* Readers entering from now on can only see next */
+	priv->retired[priv->n_retired].nn = old;
+	priv->retired[priv->n_retired].epoch = atomic_fetch_add(&priv->epoch, 1);
+	priv->n_retired++;
+	atomic_fetch_add(&priv->version, 1);
+
+	return 0;
+}
+
+/* Called by the trainer after every step, publish nn every publish_interval calls */
+int
+nn_published_tick(NNPublished *pub, NeuralNetwork *nn)
+{
+	_NNPublishPriv *priv = pub->priv;
+
+	if (++priv->n_tick < pub->publish_interval)
+		return 0;
+	priv->n_tick = 0;
+
+	return nn_published_publish(pub, nn);
+}
+
+/* Number of the versions published so far, counting the first one */
+unsigned long
+nn_published_get_version(NNPublished *pub)
+{
+	_NNPublishPriv *priv = pub->priv;
+
+	return atomic_load(&priv->version);
+}
+
+/* No reader may be running */
+void
+nn_published_destroy(NNPublished *pub)
+{
+	int i;
+	_NNPublishPriv *priv = pub->priv;
+
+	if (priv == NULL)
+		return;
+
+	nn_free(atomic_load(&priv->current));
+	for (i = 0; i < priv->n_retired; i++)
+		nn_free(priv->retired[i].nn);
+	free(priv->retired);
+	nn_pool_clear(&priv->pool);
+	free(priv->readers);
+	free(priv);
+	pub->priv = NULL;
+}
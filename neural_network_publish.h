@@ -0,0 +1,39 @@
+#ifndef __NEURAL_NETWORK_PUBLISH_H
+#define __NEURAL_NETWORK_PUBLISH_H
+
+#include "neural_network.h"
+
+/*
+ * Serve a network while it's being trained.
+ * The trainer publishes copies of its network, readers always run a complete version and never
+ * wait for the trainer. An old version is reused once no reader that could have seen it is
+ * still running it, which is known by epochs.
+ * There is one trainer, and up to max_reader reader threads, each registered once.
+ */
+typedef struct {
+	int max_reader;
+	int publish_interval;	/* Calls of nn_published_tick() between two publishes */
+	void *priv;
+} NNPublished;
+
+int nn_published_init(NNPublished *pub, NeuralNetwork *nn, int max_reader, int publish_interval);
+
+int nn_published_register(NNPublished *pub);
+
+void nn_published_unregister(NNPublished *pub, int reader);
+
+NeuralNetwork *nn_published_enter(NNPublished *pub, int reader);
+
+void nn_published_exit(NNPublished *pub, int reader);
+
+float *nn_published_run(NNPublished *pub, int reader, float *input, float *buffer);
+
+int nn_published_publish(NNPublished *pub, NeuralNetwork *nn);
+
+int nn_published_tick(NNPublished *pub, NeuralNetwork *nn);
+
+unsigned long nn_published_get_version(NNPublished *pub);
+
+void nn_published_destroy(NNPublished *pub);
+
+#endif /* __NEURAL_NETWORK_PUBLISH_H */
@@ -0,0 +1,422 @@
+#include "neural_network_replay.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+/* Records are apart by a multiple of this, so two actors don't write the same cache line */
+#define NN_REPLAY_ALIGN		64
+
+/* Give up a sample after so many records were caught being written */
+#define NN_REPLAY_MAX_RETRY	16
+
+/* An actor waiting for a lapped one to finish its record yields after so many tries */
+#define NN_REPLAY_SPIN		64
+
+/* Added to the errors nn_replay_train() sets as priorities, so nothing is never sampled */
+#define NN_REPLAY_MIN_PRIORITY	1e-6f
+
+/*
+ * sequence is 2 * pos + 1 while the record of position pos is being written
+ * and 2 * pos + 2 once it's done, pos counts every record ever added.
+ * A writer only takes a record by a CAS from an even sequence of an older position,
+ * so there is never more than one writer of a record.
+ */
+typedef struct {
+	atomic_ulong sequence;
+	float priority;	/* 0 for the maximum priority seen so far */
+} _NNReplayRecord;
+
+typedef struct {
+	char *records;
+	long stride;
+	atomic_ulong head;	/* Position of the next record */
+
+	/* Only touched by the learner */
+	uint64_t rng;
+	unsigned long synced;	/* Positions before it are in the tree */
+	int n_leaf;		/* A power of 2 */
+	double *tree;		/* Sum tree of priorities, the root at 1, leaves from n_leaf */
+	float max_priority;
+} _NNReplayPriv;
+
+static _NNReplayRecord *_nn_replay_record(_NNReplayPriv *priv, int slot);
+
+static uint64_t _nn_replay_rand(_NNReplayPriv *priv);
+
+static void _nn_replay_tree_set(_NNReplayPriv *priv, int slot, double priority);
+
+static int _nn_replay_tree_find(_NNReplayPriv *priv, double u);
+
+static void _nn_replay_sync(NNReplayBuffer *rb);
+
+static long _nn_replay_last_pos(NNReplayBuffer *rb, int slot);
+
+static int _nn_replay_claim(_NNReplayRecord *rec, unsigned long pos);
+
+static int _nn_replay_read(NNReplayBuffer *rb, int slot, float *input, float *expect);
+
+static _NNReplayRecord *
+_nn_replay_record(_NNReplayPriv *priv, int slot)
+{
+	return (_NNReplayRecord *)(priv->records + slot * priv->stride);
+}
+
+/* xorshift64* */
+static uint64_t
+_nn_replay_rand(_NNReplayPriv *priv)
+{
+	priv->rng ^= priv->rng >> 12;
+	priv->rng ^= priv->rng << 25;
+	priv->rng ^= priv->rng >> 27;
+	return priv->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+_nn_replay_tree_set(_NNReplayPriv *priv, int slot, double priority)
+{
+	int i;
+
+	i = priv->n_leaf + slot;
+	priv->tree[i] = priority;
+	for (i /= 2; i >= 1; i /= 2)
+		priv->tree[i] = priv->tree[2 * i] + priv->tree[2 * i + 1];
+}
+
+/* Return the slot where the running sum of priorities passes u */
+static int
+_nn_replay_tree_find(_NNReplayPriv *priv, double u)
+{
+	int i;
+
+	i = 1;
+	while (i < priv->n_leaf)
+	{
+		if (u < priv->tree[2 * i] || priv->tree[2 * i + 1] <= 0)
+		{
+			i = 2 * i;
+		}
+		else
+		{
+			u -= priv->tree[2 * i];
+			i = 2 * i + 1;
+		}
+	}
+
+	return i - priv->n_leaf;
+}
+
+/* Put the priorities of the records added since the last time into the tree */
+static void
+_nn_replay_sync(NNReplayBuffer *rb)
+{
+	int slot;
+	float priority;
+	unsigned long pos;
+	unsigned long head;
+	unsigned long seq;
+	_NNReplayRecord *rec;
+	_NNReplayPriv *priv = rb->priv;
+
+	head = atomic_load_explicit(&priv->head, memory_order_acquire);
+	pos = priv->synced;
+	if (head - pos > (unsigned long)rb->capacity)
+		pos = head - rb->capacity;
+
+	for (; pos < head; pos++)
+	{
+		slot = pos % rb->capacity;
+		rec = _nn_replay_record(priv, slot);
+		seq = atomic_load_explicit(&rec->sequence, memory_order_acquire);
+		/* Still being written, the next call picks it up */
+		if (seq < 2 * pos + 2)
+			break;
+		/* Dropped for a newer record, which is synced at its own position */
+		if (seq > 2 * pos + 2)
+			continue;
+
+		priority = rec->priority > 0 ? rec->priority : priv->max_priority;
+		if (priority > priv->max_priority)
+			priv->max_priority = priority;
+		_nn_replay_tree_set(priv, slot, priority);
+	}
+	priv->synced = pos;
+}
+
+/* The latest position added to slot, -1 if none is yet */
+static long
+_nn_replay_last_pos(NNReplayBuffer *rb, int slot)
+{
+	unsigned long last;
+	_NNReplayPriv *priv = rb->priv;
+
+	last = atomic_load_explicit(&priv->head, memory_order_relaxed);
+	if (last <= (unsigned long)slot)
+		return -1;
+	last--;
+
+	return last - (last - slot) % rb->capacity;
+}
+
+/*
+ * Take rec to write the record of position pos, wait for an older writer still at it.
+ * Return -1 if a newer record is already there, the one of pos is then dropped.
+ */
+static int
+_nn_replay_claim(_NNReplayRecord *rec, unsigned long pos)
+{
+	int n_try;
+	unsigned long seq;
+
+	seq = atomic_load_explicit(&rec->sequence, memory_order_relaxed);
+	for (n_try = 0; ; n_try++)
+	{
+		if (seq >= 2 * pos + 1)
+			return -1;
+		if (seq % 2 == 0 &&
+			atomic_compare_exchange_weak_explicit(&rec->sequence, &seq, 2 * pos + 1,
+					memory_order_acquire, memory_order_relaxed))
+			return 0;
+		if (seq % 2)
+		{
+			if (n_try >= NN_REPLAY_SPIN)
+				sched_yield();
+			seq = atomic_load_explicit(&rec->sequence, memory_order_relaxed);
+		}
+	}
+}
+
+/* Copy the latest record of slot out, return -1 if it was being written */
+static int
+_nn_replay_read(NNReplayBuffer *rb, int slot, float *input, float *expect)
+{
+	long pos;
+	unsigned long seq0;
+	unsigned long seq1;
+	float *data;
+	_NNReplayRecord *rec;
+	_NNReplayPriv *priv = rb->priv;
+
+	rec = _nn_replay_record(priv, slot);
+	data = (float *)(rec + 1);
+
+	/* Not just any even sequence, an older record still there means the latest is being written */
+	pos = _nn_replay_last_pos(rb, slot);
+	seq0 = atomic_load_explicit(&rec->sequence, memory_order_acquire);
+	if (pos < 0 || seq0 != 2 * (unsigned long)pos + 2)
+		return -1;
+	memcpy(input, data, rb->n_input * sizeof(float));
+	memcpy(expect, data + rb->n_input, rb->n_expect * sizeof(float));
+	atomic_thread_fence(memory_order_acquire);
+	seq1 = atomic_load_explicit(&rec->sequence, memory_order_relaxed);
+
+	return seq0 == seq1 ? 0 : -1;
+}
+
+int
+nn_replay_init(NNReplayBuffer *rb, int capacity, int n_input, int n_expect, int prioritized)
+{
+	int i;
+	_NNReplayPriv *priv;
+
+	memset(rb, 0, sizeof(*rb));
+	if (capacity < 1 || n_input < 0 || n_expect < 0)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	rb->capacity = capacity;
+	rb->n_input = n_input;
+	rb->n_expect = n_expect;
+	rb->prioritized = prioritized;
+	rb->priv = priv;
+
+	priv->stride = sizeof(_NNReplayRecord) + (n_input + n_expect) * sizeof(float);
+	priv->stride = (priv->stride + NN_REPLAY_ALIGN - 1) / NN_REPLAY_ALIGN * NN_REPLAY_ALIGN;
+	if (posix_memalign((void **)&priv->records, NN_REPLAY_ALIGN, capacity * priv->stride))
+	{
+		priv->records = NULL;
+		nn_replay_destroy(rb);
+		return -1;
+	}
+	for (i = 0; i < capacity; i++)
+		atomic_init(&_nn_replay_record(priv, i)->sequence, 0);
+	atomic_init(&priv->head, 0);
+
+	priv->rng = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)rb;
+	priv->max_priority = 1.0f;
+	if (prioritized)
+	{
+		for (priv->n_leaf = 1; priv->n_leaf < capacity; priv->n_leaf *= 2)
+			;
+		priv->tree = calloc(2 * priv->n_leaf, sizeof(double));
+		if (priv->tree == NULL)
+		{
+			nn_replay_destroy(rb);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Called by the actors, a priority of 0 or less gives the record the highest priority seen */
+void
+nn_replay_add(NNReplayBuffer *rb, const float *input, const float *expect, float priority)
+{
+	int slot;
+	unsigned long pos;
+	float *data;
+	_NNReplayRecord *rec;
+	_NNReplayPriv *priv = rb->priv;
+
+	pos = atomic_fetch_add_explicit(&priv->head, 1, memory_order_relaxed);
+	slot = pos % rb->capacity;
+	rec = _nn_replay_record(priv, slot);
+	data = (float *)(rec + 1);
+
+	if (_nn_replay_claim(rec, pos) < 0)
+		return;
+	atomic_thread_fence(memory_order_release);
+	memcpy(data, input, rb->n_input * sizeof(float));
+	memcpy(data + rb->n_input, expect, rb->n_expect * sizeof(float));
+	rec->priority = priority > 0 ? priority : 0;
+	atomic_store_explicit(&rec->sequence, 2 * pos + 2, memory_order_release);
+}
+
+long
+nn_replay_get_count(NNReplayBuffer *rb)
+{
+	unsigned long head;
+	_NNReplayPriv *priv = rb->priv;
+
+	head = atomic_load(&priv->head);
+	return head < (unsigned long)rb->capacity ? (long)head : rb->capacity;
+}
+
+/*
+ * Called by the learner, copy n records into inputs and expects (n rows of n_input and n_expect)
+ * and their slots into slots if not NULL.
+ * Return how many were sampled, less than n only if the buffer is (nearly) empty.
+ */
+int
+nn_replay_sample(NNReplayBuffer *rb, int n, float *inputs, float *expects, int *slots)
+{
+	int i;
+	int slot;
+	int n_retry;
+	long count;
+	double total;
+	_NNReplayPriv *priv = rb->priv;
+
+	count = nn_replay_get_count(rb);
+	if (count == 0)
+		return 0;
+	if (rb->prioritized)
+		_nn_replay_sync(rb);
+
+	for (i = 0; i < n; i++)
+	{
+		for (n_retry = 0; n_retry < NN_REPLAY_MAX_RETRY; n_retry++)
+		{
+			if (rb->prioritized)
+			{
+				total = priv->tree[1];
+				if (total <= 0)
+					return i;
+				slot = _nn_replay_tree_find(priv,
+						(_nn_replay_rand(priv) >> 11) * (1.0 / 9007199254740992.0) * total);
+			}
+			else
+			{
+				slot = _nn_replay_rand(priv) % count;
+			}
+
+			if (_nn_replay_read(rb, slot, inputs + (long)i * rb->n_input, expects + (long)i * rb->n_expect) == 0)
+				break;
+		}
+		if (n_retry == NN_REPLAY_MAX_RETRY)
+			return i;
+		if (slots)
+			slots[i] = slot;
+	}
+
+	return n;
+}
+
+/* Called by the learner, usually with the error of a sampled record */
+void
+nn_replay_set_priority(NNReplayBuffer *rb, int slot, float priority)
+{
+	_NNReplayPriv *priv = rb->priv;
+
+	if (!rb->prioritized)
+		return;
+	if (priority > priv->max_priority)
+		priv->max_priority = priority;
+	_nn_replay_tree_set(priv, slot, priority);
+}
+
+/*
+ * Called by the learner, nn_train() on a sampled mini-batch and return its mean squared error.
+ * If prioritized, every sampled record gets its error as the new priority.
+ * The actors are to run their own copy of the network meanwhile.
+ */
+float
+nn_replay_train(NNReplayBuffer *rb, NeuralNetwork *nn, int n_batch, float rate)
+{
+	int i;
+	int j;
+	int n;
+	int *slots;
+	float *inputs;
+	float *expects;
+	float *output;
+	float err;
+	double sum;
+
+	inputs = malloc((long)n_batch * rb->n_input * sizeof(float));
+	expects = malloc((long)n_batch * rb->n_expect * sizeof(float));
+	slots = malloc(n_batch * sizeof(int));
+	if (inputs == NULL || expects == NULL || slots == NULL)
+	{
+		free(inputs);
+		free(expects);
+		free(slots);
+		return -1;
+	}
+
+	sum = 0;
+	n = nn_replay_sample(rb, n_batch, inputs, expects, slots);
+	for (i = 0; i < n; i++)
+	{
+		output = nn_train(nn, inputs + (long)i * rb->n_input, expects + (long)i * rb->n_expect, rate);
+
+		/* The output is from before the correction */
+		err = 0;
+		for (j = 0; j < nn->n_output && j < rb->n_expect; j++)
+			err += (output[j] - expects[(long)i * rb->n_expect + j]) * (output[j] - expects[(long)i * rb->n_expect + j]);
+		sum += err;
+		nn_replay_set_priority(rb, slots[i], err + NN_REPLAY_MIN_PRIORITY);
+	}
+
+	free(inputs);
+	free(expects);
+	free(slots);
+	return n > 0 ? sum / n : 0;
+}
+
+void
+nn_replay_destroy(NNReplayBuffer *rb)
+{
+	_NNReplayPriv *priv = rb->priv;
+
+	if (priv == NULL)
+		return;
+	free(priv->records);
+	free(priv->tree);
+	free(priv);
+	rb->priv = NULL;
+}
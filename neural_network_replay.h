@@ -0,0 +1,37 @@
+#ifndef __NEURAL_NETWORK_REPLAY_H
+#define __NEURAL_NETWORK_REPLAY_H
+
+#include "neural_network.h"
+
+/*
+ * A fixed capacity ring of (input, expect) records for online training.
+ * Any number of actor threads add records without a lock, the newest overwrite the oldest.
+ * A single learner thread samples them into mini-batches, uniformly or in proportion to
+ * their priority, and may change the priority of what it sampled.
+ * An actor lapped onto a record another actor is still writing waits for it to finish, and drops
+ * its record if a newer one got there first. A record being overwritten while it's read is
+ * detected and sampled again. The capacity should be well above the number of actors.
+ */
+typedef struct {
+	int capacity;
+	int n_input;
+	int n_expect;
+	int prioritized;
+	void *priv;
+} NNReplayBuffer;
+
+int nn_replay_init(NNReplayBuffer *rb, int capacity, int n_input, int n_expect, int prioritized);
+
+void nn_replay_add(NNReplayBuffer *rb, const float *input, const float *expect, float priority);
+
+long nn_replay_get_count(NNReplayBuffer *rb);
+
+int nn_replay_sample(NNReplayBuffer *rb, int n, float *inputs, float *expects, int *slots);
+
+void nn_replay_set_priority(NNReplayBuffer *rb, int slot, float priority);
+
+float nn_replay_train(NNReplayBuffer *rb, NeuralNetwork *nn, int n_batch, float rate);
+
+void nn_replay_destroy(NNReplayBuffer *rb);
+
+#endif /* __NEURAL_NETWORK_REPLAY_H */
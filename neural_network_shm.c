@@ -0,0 +1,543 @@
+#include "neural_network_shm.h"
+#include "neural_network_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NN_SHM_MAGIC	0x4d534e4e	/* "NNSM" */
+#define NN_SHM_VERSION	1
+
+/* Nanoseconds to sleep between polls once spinning didn't help */
+#define NN_SHM_POLL_NS	50000
+
+/*
+ * Segment layout, every part NN_FILE_ALIGN aligned:
+ *   header
+ *   queue cells
+ *   slots: _NNShmSlot, weight, bias
+ * Only lock-free atomics are used, they work the same in every process the segment is mapped in.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int32_t n_input;
+	int32_t n_output;
+	int32_t n_hidden;
+	int32_t n_neuro_per_hidden;
+	int32_t use_bias;
+	int32_t act_func_type_hidden;
+	int32_t act_func_type_output;
+	int32_t n_slot;
+	uint32_t queue_mask;	/* Number of the queue cells minus 1 */
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t cell_offset;
+	uint64_t slot_offset;
+	uint64_t slot_size;
+	uint64_t weight_offset;	/* From the beginning of a slot */
+	uint64_t bias_offset;
+
+	atomic_int closed;
+	atomic_long n_submit;
+	atomic_long n_done;
+
+	/* Bounded MPMC queue of slots, the positions are apart so they don't share a cache line */
+	_Alignas(NN_FILE_ALIGN) atomic_ulong enqueue_pos;
+	_Alignas(NN_FILE_ALIGN) atomic_ulong dequeue_pos;
+} _NNShmHeader;
+
+typedef struct {
+	atomic_ulong sequence;
+	int32_t slot;
+} _NNShmCell;
+
+typedef struct {
+	float fitness;
+	atomic_ulong version;	/* Bumped on every submit, the network may have changed */
+} _NNShmSlot;
+
+typedef struct {
+	_NNShmHeader *hdr;
+	NeuralNetwork **views;
+	unsigned long *seen;	/* The version of every slot the view of this process is up to */
+	char *name;
+	pid_t owner;	/* The process to unlink the name on detach */
+} _NNShmPriv;
+
+static long _nn_shm_align(long n);
+
+static _NNShmSlot *_nn_shm_slot(_NNShmHeader *hdr, int slot);
+
+static _NNShmCell *_nn_shm_cell(_NNShmHeader *hdr, unsigned long pos);
+
+static int _nn_shm_enqueue(_NNShmHeader *hdr, int slot);
+
+static int _nn_shm_dequeue(_NNShmHeader *hdr);
+
+static void _nn_shm_pause(int n_try);
+
+static int _nn_shm_open_views(NNShmPopulation *pop, _NNShmHeader *hdr);
+
+static NeuralNetwork *_nn_shm_sync_view(_NNShmPriv *priv, int slot);
+
+static long
+_nn_shm_align(long n)
+{
+	return (n + NN_FILE_ALIGN - 1) / NN_FILE_ALIGN * NN_FILE_ALIGN;
+}
+
+static _NNShmSlot *
+_nn_shm_slot(_NNShmHeader *hdr, int slot)
+{
+	return (_NNShmSlot *)((char *)hdr + hdr->slot_offset + slot * hdr->slot_size);
+}
+
+static _NNShmCell *
+_nn_shm_cell(_NNShmHeader *hdr, unsigned long pos)
+{
+	return (_NNShmCell *)((char *)hdr + hdr->cell_offset) + (pos & hdr->queue_mask);
+}
+
+/*
+ * A cell is free for the enqueue at pos when its sequence is pos,
+ * and holds a slot for the dequeue at pos when its sequence is pos + 1.
+ * Return -1 if the queue is full.
+ */
+static int
+_nn_shm_enqueue(_NNShmHeader *hdr, int slot)
+{
+	long diff;
+	unsigned long pos;
+	_NNShmCell *cell;
+
+	pos = atomic_load_explicit(&hdr->enqueue_pos, memory_order_relaxed);
+	for (;;)
+	{
+		cell = _nn_shm_cell(hdr, pos);
+		diff = (long)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - pos);
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&hdr->enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&hdr->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	cell->slot = slot;
+	atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+	return 0;
+}
+
+/* Return a slot or -1 if the queue is empty */
+static int
+_nn_shm_dequeue(_NNShmHeader *hdr)
+{
+	int slot;
+	long diff;
+	unsigned long pos;
+	_NNShmCell *cell;
+
+	pos = atomic_load_explicit(&hdr->dequeue_pos, memory_order_relaxed);
+	for (;;)
+	{
+		cell = _nn_shm_cell(hdr, pos);
+		diff = (long)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - (pos + 1));
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&hdr->dequeue_pos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&hdr->dequeue_pos, memory_order_relaxed);
+		}
+	}
+
+	slot = cell->slot;
+	atomic_store_explicit(&cell->sequence, pos + hdr->queue_mask + 1, memory_order_release);
+	return slot;
+}
+
+/* Spin for a while, then give the CPU away */
+static void
+_nn_shm_pause(int n_try)
+{
+	struct timespec ts;
+
+	if (n_try < 64)
+		return;
+	if (n_try < 128)
+	{
+		sched_yield();
+		return;
+	}
+	ts.tv_sec = 0;
+	ts.tv_nsec = NN_SHM_POLL_NS;
+	nanosleep(&ts, NULL);
+}
+
+/* Make the networks of this process pointing into the slots */
+static int
+_nn_shm_open_views(NNShmPopulation *pop, _NNShmHeader *hdr)
+{
+	int i;
+	char *slot;
+	_NNShmPriv *priv = pop->priv;
+
+	priv->views = calloc(hdr->n_slot, sizeof(*priv->views));
+	priv->seen = calloc(hdr->n_slot, sizeof(*priv->seen));
+	if (priv->views == NULL || priv->seen == NULL)
+		return -1;
+
+	for (i = 0; i < hdr->n_slot; i++)
+	{
+		priv->views[i] = _nn_alloc_view(hdr->n_input,
+				hdr->n_output,
+				hdr->n_hidden,
+				hdr->n_neuro_per_hidden,
+				hdr->use_bias,
+				hdr->act_func_type_hidden,
+				hdr->act_func_type_output);
+		if (priv->views[i] == NULL)
+			return -1;
+		slot = (char *)_nn_shm_slot(hdr, i);
+		priv->views[i]->weight = (float *)(slot + hdr->weight_offset);
+		if (hdr->use_bias)
+			priv->views[i]->bias = (float *)(slot + hdr->bias_offset);
+	}
+
+	pop->n_slot = hdr->n_slot;
+	return 0;
+}
+
+/*
+ * The views of the other processes don't see the _version bumps of this one, so when the
+ * slot's been submitted since, touch the view to drop what's cached for the old weight
+ * (the column-major copy of nn_run_sparse(), an NNAccumulator, an NNRunCache, ...).
+ */
+static NeuralNetwork *
+_nn_shm_sync_view(_NNShmPriv *priv, int slot)
+{
+	unsigned long version;
+
+	version = atomic_load_explicit(&_nn_shm_slot(priv->hdr, slot)->version, memory_order_acquire);
+	if (version != priv->seen[slot])
+	{
+		priv->seen[slot] = version;
+		nn_touch(priv->views[slot]);
+	}
+
+	return priv->views[slot];
+}
+
+/* Create a segment of n_slot networks of the shape of shape, NULL name for an anonymous one */
+int
+nn_shm_create(NNShmPopulation *pop, const char *name, NeuralNetwork *shape, int n_slot)
+{
+	int fd;
+	int i;
+	unsigned long n_cell;
+	long size;
+	_NNShmHeader hdr;
+	_NNShmHeader *base;
+	_NNShmPriv *priv;
+
+	memset(pop, 0, sizeof(*pop));
+	if (n_slot < 1)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NN_SHM_MAGIC;
+	hdr.version = NN_SHM_VERSION;
+	hdr.n_input = shape->n_input;
+	hdr.n_output = shape->n_output;
+	hdr.n_hidden = shape->n_hidden;
+	hdr.n_neuro_per_hidden = shape->n_neuro_per_hidden;
+	hdr.use_bias = shape->use_bias;
+	hdr.act_func_type_hidden = shape->act_func_type_hidden;
+	hdr.act_func_type_output = shape->act_func_type_output;
+	hdr.n_slot = n_slot;
+	for (n_cell = 1; n_cell < (unsigned long)n_slot; n_cell *= 2)
+		;
+	hdr.queue_mask = n_cell - 1;
+	hdr.cell_offset = _nn_shm_align(sizeof(hdr));
+	hdr.slot_offset = hdr.cell_offset + _nn_shm_align(n_cell * sizeof(_NNShmCell));
+	hdr.weight_offset = _nn_shm_align(sizeof(_NNShmSlot));
+	hdr.bias_offset = hdr.weight_offset + _nn_shm_align(shape->_n_weight * sizeof(float));
+	hdr.slot_size = hdr.bias_offset + (shape->use_bias ? _nn_shm_align(shape->_n_neuro * sizeof(float)) : 0);
+	hdr.size = hdr.slot_offset + n_slot * hdr.slot_size;
+	size = hdr.size;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	pop->priv = priv;
+
+	if (name)
+	{
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+		{
+			nn_shm_detach(pop);
+			return -1;
+		}
+		priv->name = strdup(name);
+		priv->owner = getpid();
+		if (priv->name == NULL || ftruncate(fd, size) < 0)
+		{
+			close(fd);
+			nn_shm_detach(pop);
+			return -1;
+		}
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	else
+	{
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+	if (base == MAP_FAILED)
+	{
+		nn_shm_detach(pop);
+		return -1;
+	}
+
+	memcpy(base, &hdr, sizeof(hdr));
+	atomic_init(&base->closed, 0);
+	atomic_init(&base->n_submit, 0);
+	atomic_init(&base->n_done, 0);
+	atomic_init(&base->enqueue_pos, 0);
+	atomic_init(&base->dequeue_pos, 0);
+	for (i = 0; i < (int)n_cell; i++)
+		atomic_init(&_nn_shm_cell(base, i)->sequence, i);
+	for (i = 0; i < n_slot; i++)
+		atomic_init(&_nn_shm_slot(base, i)->version, 0);
+	priv->hdr = base;
+
+	if (_nn_shm_open_views(pop, base) < 0)
+	{
+		nn_shm_detach(pop);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Attach to a segment created with a name by another process */
+int
+nn_shm_attach(NNShmPopulation *pop, const char *name)
+{
+	int fd;
+	_NNShmHeader hdr;
+	_NNShmHeader *base;
+	_NNShmPriv *priv;
+
+	memset(pop, 0, sizeof(*pop));
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		hdr.magic != NN_SHM_MAGIC ||
+		hdr.version != NN_SHM_VERSION)
+	{
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+	{
+		munmap(base, hdr.size);
+		return -1;
+	}
+	priv->hdr = base;
+	pop->priv = priv;
+
+	if (_nn_shm_open_views(pop, base) < 0)
+	{
+		nn_shm_detach(pop);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Unmap the segment in this process, the creator also removes the name */
+void
+nn_shm_detach(NNShmPopulation *pop)
+{
+	int i;
+	_NNShmPriv *priv = pop->priv;
+
+	if (priv == NULL)
+		return;
+
+	if (priv->views)
+	{
+		for (i = 0; i < priv->hdr->n_slot; i++)
+		{
+			if (priv->views[i])
+				nn_free(priv->views[i]);
+		}
+		free(priv->views);
+	}
+	free(priv->seen);
+	if (priv->hdr)
+		munmap(priv->hdr, priv->hdr->size);
+	if (priv->name && priv->owner == getpid())
+		shm_unlink(priv->name);
+	free(priv->name);
+	free(priv);
+	pop->priv = NULL;
+}
+
+/*
+ * The network in slot, it can be written in place too, e.g. by nn_produce_into().
+ * Get it again after every nn_shm_take(), the view is brought up to the last submit here.
+ */
+NeuralNetwork *
+nn_shm_get(NNShmPopulation *pop, int slot)
+{
+	_NNShmPriv *priv = pop->priv;
+
+	if (slot < 0 || slot >= pop->n_slot)
+		return NULL;
+
+	return _nn_shm_sync_view(priv, slot);
+}
+
+int
+nn_shm_put(NNShmPopulation *pop, int slot, NeuralNetwork *nn)
+{
+	NeuralNetwork *dst;
+
+	dst = nn_shm_get(pop, slot);
+	if (dst == NULL)
+		return -1;
+
+	return nn_copy_into(dst, nn);
+}
+
+/* Queue slot for a worker, the network must not be changed until it's done */
+int
+nn_shm_submit(NNShmPopulation *pop, int slot)
+{
+	_NNShmPriv *priv = pop->priv;
+
+	if (slot < 0 || slot >= pop->n_slot)
+		return -1;
+
+	/* Released to the worker with the slot by the enqueue */
+	atomic_fetch_add_explicit(&_nn_shm_slot(priv->hdr, slot)->version, 1, memory_order_relaxed);
+	priv->seen[slot] = atomic_load_explicit(&_nn_shm_slot(priv->hdr, slot)->version, memory_order_relaxed);
+	atomic_fetch_add(&priv->hdr->n_submit, 1);
+	if (_nn_shm_enqueue(priv->hdr, slot) < 0)
+	{
+		atomic_fetch_sub(&priv->hdr->n_submit, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Wait until every submitted slot is done, return -1 if the queue is closed before */
+int
+nn_shm_wait(NNShmPopulation *pop)
+{
+	int n_try;
+	_NNShmHeader *hdr = ((_NNShmPriv *)pop->priv)->hdr;
+
+	for (n_try = 0; atomic_load(&hdr->n_done) < atomic_load(&hdr->n_submit); n_try++)
+	{
+		if (atomic_load(&hdr->closed))
+			return -1;
+		_nn_shm_pause(n_try);
+	}
+
+	return 0;
+}
+
+/* NAN for a slot out of range */
+float
+nn_shm_get_fitness(NNShmPopulation *pop, int slot)
+{
+	_NNShmPriv *priv = pop->priv;
+
+	if (slot < 0 || slot >= pop->n_slot)
+		return NAN;
+
+	return _nn_shm_slot(priv->hdr, slot)->fitness;
+}
+
+/*
+ * Take a submitted slot, -1 if there is none.
+ * If wait is set, wait for one until the queue is closed.
+ */
+int
+nn_shm_take(NNShmPopulation *pop, int wait)
+{
+	int slot;
+	int n_try;
+	_NNShmHeader *hdr = ((_NNShmPriv *)pop->priv)->hdr;
+
+	for (n_try = 0; ; n_try++)
+	{
+		slot = _nn_shm_dequeue(hdr);
+		if (slot >= 0)
+		{
+			_nn_shm_sync_view(pop->priv, slot);
+			return slot;
+		}
+		if (!wait || atomic_load(&hdr->closed))
+			return -1;
+		_nn_shm_pause(n_try);
+	}
+}
+
+void
+nn_shm_done(NNShmPopulation *pop, int slot, float fitness)
+{
+	_NNShmHeader *hdr = ((_NNShmPriv *)pop->priv)->hdr;
+
+	if (slot < 0 || slot >= pop->n_slot)
+		return;
+
+	_nn_shm_slot(hdr, slot)->fitness = fitness;
+	/* Releases the fitness to nn_shm_wait() */
+	atomic_fetch_add(&hdr->n_done, 1);
+}
+
+/* Let the workers waiting in nn_shm_take() go */
+void
+nn_shm_close_queue(NNShmPopulation *pop)
+{
+	_NNShmHeader *hdr = ((_NNShmPriv *)pop->priv)->hdr;
+
+	atomic_store(&hdr->closed, 1);
+}
@@ -0,0 +1,43 @@
+#ifndef __NEURAL_NETWORK_SHM_H
+#define __NEURAL_NETWORK_SHM_H
+
+#include "neural_network.h"
+
+/*
+ * A population of networks of the same shape in a shared memory segment.
+ * The parent writes networks into slots and submits them, worker processes take slots from
+ * a lock-free queue in the same segment, run the networks in place and write back the fitness.
+ * A segment made with a NULL name is only shared with the processes forked after it.
+ * The networks returned by nn_shm_get() belong to the population and are not to be freed,
+ * every process has its own output buffers but a network is not to be run by two threads at a time.
+ * Every submit invalidates what the other processes cached for the slot's network
+ * (nn_run_sparse(), NNAccumulator, NNRunCache), once they nn_shm_take() or nn_shm_get() it.
+ */
+typedef struct {
+	int n_slot;
+	void *priv;
+} NNShmPopulation;
+
+int nn_shm_create(NNShmPopulation *pop, const char *name, NeuralNetwork *shape, int n_slot);
+
+int nn_shm_attach(NNShmPopulation *pop, const char *name);
+
+void nn_shm_detach(NNShmPopulation *pop);
+
+NeuralNetwork *nn_shm_get(NNShmPopulation *pop, int slot);
+
+int nn_shm_put(NNShmPopulation *pop, int slot, NeuralNetwork *nn);
+
+int nn_shm_submit(NNShmPopulation *pop, int slot);
+
+int nn_shm_wait(NNShmPopulation *pop);
+
+float nn_shm_get_fitness(NNShmPopulation *pop, int slot);
+
+int nn_shm_take(NNShmPopulation *pop, int wait);
+
+void nn_shm_done(NNShmPopulation *pop, int slot, float fitness);
+
+void nn_shm_close_queue(NNShmPopulation *pop);
+
+#endif /* __NEURAL_NETWORK_SHM_H */
@@ -0,0 +1,241 @@
+#include "neural_network_sparse.h"
+#include "neural_network_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	unsigned long version;	/* nn->_version the copy was made at */
+	int n_first;		/* Number of the neuro of the first layer */
+	float *column;		/* n_first floats per input */
+	int *index;		/* Indexes of the set bits of a binary input */
+} _NNSparse;
+
+static _NNSparse *_nn_sparse_get(NeuralNetwork *nn);
+
+static int _nn_sparse_unpack(NeuralNetwork *nn, const uint64_t *bits, int *index);
+
+static float *_nn_sparse_forward(NeuralNetwork *nn,
+		_NNSparse *sp,
+		const int *index,
+		const float *value,
+		int n_active);
+
+/* Return the column-major copy of the first layer, making it if it's missing or out of date */
+static _NNSparse *
+_nn_sparse_get(NeuralNetwork *nn)
+{
+	int i;
+	int j;
+	_NNSparse *sp;
+
+	sp = nn->_sparse;
+	if (sp == NULL)
+	{
+		sp = malloc(sizeof(*sp));
+		if (sp == NULL)
+			return NULL;
+		sp->n_first = nn->n_hidden > 0 ? nn->n_neuro_per_hidden : nn->n_output;
+		sp->column = malloc((long)nn->n_input * sp->n_first * sizeof(float));
+		sp->index = malloc(nn->n_input * sizeof(int));
+		if (sp->column == NULL || sp->index == NULL)
+		{
+			free(sp->column);
+			free(sp->index);
+			free(sp);
+			return NULL;
+		}
+		sp->version = nn->_version - 1;
+		nn->_sparse = sp;
+	}
+
+	if (sp->version != nn->_version)
+	{
+		for (j = 0; j < nn->n_input; j++)
+		{
+			for (i = 0; i < sp->n_first; i++)
+				sp->column[(long)j * sp->n_first + i] = nn->weight[(long)i * nn->n_input + j];
+		}
+		sp->version = nn->_version;
+	}
+
+	return sp;
+}
+
+void
+_nn_sparse_free(NeuralNetwork *nn)
+{
+	_NNSparse *sp;
+
+	sp = nn->_sparse;
+	if (sp == NULL)
+		return;
+	free(sp->column);
+	free(sp->index);
+	free(sp);
+	nn->_sparse = NULL;
+}
+
+/* Write the indexes of the set bits, return how many */
+static int
+_nn_sparse_unpack(NeuralNetwork *nn, const uint64_t *bits, int *index)
+{
+	int w;
+	int n;
+	int n_word;
+	uint64_t word;
+
+	n = 0;
+	n_word = (nn->n_input + 63) / 64;
+	for (w = 0; w < n_word; w++)
+	{
+		word = bits[w];
+		if (w == n_word - 1 && nn->n_input % 64)
+			word &= ((uint64_t)1 << (nn->n_input % 64)) - 1;
+		while (word)
+		{
+			index[n++] = w * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+		}
+	}
+
+	return n;
+}
+
+/* The first layer from the active columns, then the rest as nn_run() does */
+static float *
+_nn_sparse_forward(NeuralNetwork *nn,
+		_NNSparse *sp,
+		const int *index,
+		const float *value,
+		int n_active)
+{
+	int i;
+	int k;
+	float v;
+	float *sum;
+	const float *column;
+	NN_PROF_DECL(t0)
+
+	NN_PROF_BEGIN(t0);
+	sum = nn->output;
+	if (nn->use_bias)
+		memcpy(sum, nn->bias, sp->n_first * sizeof(float));
+	else
+		memset(sum, 0, sp->n_first * sizeof(float));
+
+	for (k = 0; k < n_active; k++)
+	{
+		column = sp->column + (long)index[k] * sp->n_first;
+		if (value == NULL)
+		{
+			for (i = 0; i < sp->n_first; i++)
+				sum[i] += column[i];
+		}
+		else
+		{
+			v = value[k];
+			for (i = 0; i < sp->n_first; i++)
+				sum[i] += v * column[i];
+		}
+	}
+
+	if (nn->n_hidden == 0)
+	{
+		_nn_act_func_apply(nn->act_func_type_output, sum, sp->n_first);
+		NN_PROF_END(nn, 0, NN_PROFILE_FORWARD, t0, 2.0 * n_active * sp->n_first);
+		return sum;
+	}
+
+	_nn_act_func_apply(nn->act_func_type_hidden, sum, sp->n_first);
+	NN_PROF_END(nn, 0, NN_PROFILE_FORWARD, t0, 2.0 * n_active * sp->n_first);
+	return _nn_run_from(nn, 1, sum, nn->output);
+}
+
+float *
+nn_run_sparse(NeuralNetwork *nn, const int *index, const float *value, int n_active)
+{
+	_NNSparse *sp;
+
+	sp = _nn_sparse_get(nn);
+	if (sp == NULL)
+		return NULL;
+
+	return _nn_sparse_forward(nn, sp, index, value, n_active);
+}
+
+float *
+nn_run_binary(NeuralNetwork *nn, const uint64_t *bits)
+{
+	int n_active;
+	_NNSparse *sp;
+
+	sp = _nn_sparse_get(nn);
+	if (sp == NULL)
+		return NULL;
+
+	n_active = _nn_sparse_unpack(nn, bits, sp->index);
+	return _nn_sparse_forward(nn, sp, sp->index, NULL, n_active);
+}
+
+/*
+ * As nn_train(), but the first layer's weight is only corrected in the active columns,
+ * the others would be corrected by 0 anyway.
+ * The column-major copy is corrected along, so it stays up to date.
+ */
+float *
+nn_train_sparse(NeuralNetwork *nn,
+		const int *index,
+		const float *value,
+		int n_active,
+		float *expect,
+		float rate)
+{
+	int i;
+	int k;
+	float v;
+	float d;
+	float *ret;
+	float *column;
+	_NNSparse *sp;
+	NN_PROF_DECL(t0)
+
+	sp = _nn_sparse_get(nn);
+	if (sp == NULL)
+		return NULL;
+
+	ret = _nn_sparse_forward(nn, sp, index, value, n_active);
+	_nn_backward(nn, expect, rate);
+
+	NN_PROF_BEGIN(t0);
+	for (k = 0; k < n_active; k++)
+	{
+		v = value ? value[k] : 1.0f;
+		column = sp->column + (long)index[k] * sp->n_first;
+		for (i = 0; i < sp->n_first; i++)
+		{
+			d = nn->delta[i] * v * rate;
+			nn->weight[(long)i * nn->n_input + index[k]] += d;
+			column[i] += d;
+		}
+	}
+	NN_PROF_END(nn, 0, NN_PROFILE_UPDATE, t0, 3.0 * n_active * sp->n_first);
+
+	nn->_version++;
+	sp->version = nn->_version;
+
+	return ret;
+}
+
+float *
+nn_train_binary(NeuralNetwork *nn, const uint64_t *bits, float *expect, float rate)
+{
+	int n_active;
+	_NNSparse *sp;
+
+	sp = _nn_sparse_get(nn);
+	if (sp == NULL)
+		return NULL;
+
+	n_active = _nn_sparse_unpack(nn, bits, sp->index);
+	return nn_train_sparse(nn, sp->index, NULL, n_active, expect, rate);
+}
@@ -0,0 +1,28 @@
+#ifndef __NEURAL_NETWORK_SPARSE_H
+#define __NEURAL_NETWORK_SPARSE_H
+
+#include <stdint.h>
+#include "neural_network.h"
+
+/*
+ * Run and train with an input that is mostly zero.
+ * The input is either a list of n_active (index, value) pairs, value NULL meaning every value is 1,
+ * or a bit-packed 0/1 vector, bit j % 64 of bits[j / 64] is the j-th input.
+ * Only the weight columns of the active inputs are read, from a column-major copy of the first layer
+ * built on the first call and rebuilt after the weight changes (see nn_touch()).
+ * The copy takes as much memory again as the first layer.
+ */
+float *nn_run_sparse(NeuralNetwork *nn, const int *index, const float *value, int n_active);
+
+float *nn_run_binary(NeuralNetwork *nn, const uint64_t *bits);
+
+float *nn_train_sparse(NeuralNetwork *nn,
+		const int *index,
+		const float *value,
+		int n_active,
+		float *expect,
+		float rate);
+
+float *nn_train_binary(NeuralNetwork *nn, const uint64_t *bits, float *expect, float rate);
+
+#endif /* __NEURAL_NETWORK_SPARSE_H */
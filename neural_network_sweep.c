@@ -0,0 +1,454 @@
+#include "neural_network_sweep.h"
+#include "neural_network_batch.h"
+#include "neural_network_archive.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+typedef struct {
+	int n_rung;
+	int *budget;		/* Epochs to train up to at every rung */
+
+	/* Scheduling, protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next_new;		/* The next configuration never started */
+	int n_running;
+	int *running;		/* Set while a thread trains the configuration for its rung */
+	int failed;
+} _NNSweepPriv;
+
+typedef struct {
+	NNSweep *sw;
+	unsigned int seed;	/* For rand_r() */
+	int *order;		/* Shuffled sample indexes */
+	pthread_t thread;
+} _NNSweepWorker;
+
+static float _nn_sweep_validate(NNSweep *sw, NeuralNetwork *nn);
+
+static void _nn_sweep_train(_NNSweepWorker *worker, NNSweepResult *r, int epoch);
+
+static int _nn_sweep_promotable(NNSweep *sw, int rung);
+
+static int _nn_sweep_best_of_top(NNSweep *sw);
+
+static int _nn_sweep_next(NNSweep *sw);
+
+static void *_nn_sweep_thread(void *arg);
+
+static int _nn_sweep_write_archive(NNSweep *sw);
+
+/* Mean squared error over the validation set, or NAN if it can't be computed */
+static float
+_nn_sweep_validate(NNSweep *sw, NeuralNetwork *nn)
+{
+	int i;
+	long n;
+	double sum;
+	float d;
+	float *outputs;
+	const float *inputs;
+	const float *expects;
+	NNSweepConfig *config = &sw->config;
+
+	inputs = config->valid_inputs ? config->valid_inputs : config->inputs;
+	expects = config->valid_inputs ? config->valid_expects : config->expects;
+	n = config->valid_inputs ? config->n_valid : config->n_sample;
+	if (n == 0)
+		return 0;
+
+	outputs = malloc(n * config->n_output * sizeof(float));
+	if (outputs == NULL || nn_run_batch(nn, inputs, n, outputs) < 0)
+	{
+		free(outputs);
+		return NAN;
+	}
+
+	sum = 0;
+	for (i = 0; i < n * config->n_output; i++)
+	{
+		d = outputs[i] - expects[i];
+		sum += d * d;
+	}
+	free(outputs);
+
+	return sum / n;
+}
+
+/* Train r with nn_train() in a shuffled order until it has had epoch epochs */
+static void
+_nn_sweep_train(_NNSweepWorker *worker, NNSweepResult *r, int epoch)
+{
+	int i;
+	int j;
+	int tmp;
+	NNSweepConfig *config = &worker->sw->config;
+
+	for (; r->epoch < epoch; r->epoch++)
+	{
+		for (i = config->n_sample - 1; i > 0; i--)
+		{
+			j = rand_r(&worker->seed) % (i + 1);
+			tmp = worker->order[i];
+			worker->order[i] = worker->order[j];
+			worker->order[j] = tmp;
+		}
+		/* nn_train() doesn't write the input nor the expect */
+		for (i = 0; i < config->n_sample; i++)
+			nn_train(r->nn,
+					(float *)config->inputs + (long)worker->order[i] * config->n_input,
+					(float *)config->expects + (long)worker->order[i] * config->n_output,
+					r->param.rate);
+	}
+}
+
+/*
+ * Return a configuration that finished rung and is in the best 1 / reduction of
+ * the ones that finished it, -1 if there is none. Called with lock held.
+ * A configuration at rung is still training for it if running, the ones at a higher rung finished it.
+ */
+static int
+_nn_sweep_promotable(NNSweep *sw, int rung)
+{
+	int i;
+	int j;
+	int n_done;
+	int n_better;
+	_NNSweepPriv *priv = sw->priv;
+
+	n_done = 0;
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (sw->results[i].rung > rung || (sw->results[i].rung == rung && !priv->running[i]))
+			n_done++;
+	}
+
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (sw->results[i].rung != rung || priv->running[i])
+			continue;
+
+		/* The promoted ones count as better */
+		n_better = 0;
+		for (j = 0; j < sw->n_result; j++)
+		{
+			if (sw->results[j].rung > rung ||
+				(sw->results[j].rung == rung && !priv->running[j] && sw->results[j].loss < sw->results[i].loss))
+				n_better++;
+		}
+		if (n_better < n_done / sw->config.reduction)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * When everything else is done, return the best of the highest rung reached if that's not the last,
+ * so a small sweep still trains one configuration to max_epoch. Called with lock held.
+ */
+static int
+_nn_sweep_best_of_top(NNSweep *sw)
+{
+	int i;
+	int top;
+	int best;
+	_NNSweepPriv *priv = sw->priv;
+
+	top = 0;
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (sw->results[i].rung > top)
+			top = sw->results[i].rung;
+	}
+	if (top == priv->n_rung - 1)
+		return -1;
+
+	best = -1;
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (sw->results[i].rung == top && (best < 0 || sw->results[i].loss < sw->results[best].loss))
+			best = i;
+	}
+
+	return best;
+}
+
+/*
+ * Pick the next configuration for a thread and move it to the rung it's to be trained for,
+ * the ones to promote first from the highest rung, then new ones.
+ * Return -1 once nothing is left. Called with lock held.
+ */
+static int
+_nn_sweep_next(NNSweep *sw)
+{
+	int i;
+	int rung;
+	_NNSweepPriv *priv = sw->priv;
+
+	while (!priv->failed)
+	{
+		for (rung = priv->n_rung - 2; rung >= 0; rung--)
+		{
+			i = _nn_sweep_promotable(sw, rung);
+			if (i >= 0)
+			{
+				sw->results[i].rung = rung + 1;
+				return i;
+			}
+		}
+
+		if (priv->next_new < sw->n_result)
+		{
+			sw->results[priv->next_new].rung = 0;
+			return priv->next_new++;
+		}
+
+		/* The running ones may make another one promotable */
+		if (priv->n_running > 0)
+		{
+			pthread_cond_wait(&priv->cond, &priv->lock);
+			continue;
+		}
+
+		i = _nn_sweep_best_of_top(sw);
+		if (i >= 0)
+			sw->results[i].rung++;
+		return i;
+	}
+
+	return -1;
+}
+
+static void *
+_nn_sweep_thread(void *arg)
+{
+	int i;
+	float loss;
+	_NNSweepWorker *worker = arg;
+	NNSweep *sw = worker->sw;
+	_NNSweepPriv *priv = sw->priv;
+	NNSweepResult *r;
+
+	pthread_mutex_lock(&priv->lock);
+	while ((i = _nn_sweep_next(sw)) >= 0)
+	{
+		r = &sw->results[i];
+		priv->running[i] = 1;
+		priv->n_running++;
+		pthread_mutex_unlock(&priv->lock);
+
+		_nn_sweep_train(worker, r, priv->budget[r->rung]);
+		loss = _nn_sweep_validate(sw, r->nn);
+
+		pthread_mutex_lock(&priv->lock);
+		r->loss = loss;
+		if (isnan(loss))
+			priv->failed = 1;
+		priv->running[i] = 0;
+		priv->n_running--;
+		pthread_cond_broadcast(&priv->cond);
+	}
+	pthread_mutex_unlock(&priv->lock);
+
+	return NULL;
+}
+
+/* The networks in the order of the configurations, the archive ranks them by -loss */
+static int
+_nn_sweep_write_archive(NNSweep *sw)
+{
+	int i;
+	NNArchive ar;
+
+	if (nn_archive_create(&ar, sw->config.archive_file) < 0)
+		return -1;
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (nn_archive_append(&ar, sw->results[i].nn, -sw->results[i].loss, i) < 0)
+		{
+			nn_archive_close(&ar);
+			return -1;
+		}
+	}
+
+	return nn_archive_close(&ar);
+}
+
+int
+nn_sweep_init(NNSweep *sw, const NNSweepConfig *config, const NNSweepParam *params, int n_param)
+{
+	int i;
+	int budget;
+	unsigned int seed;
+	unsigned int *old_seed;
+	NNSweepParam *p;
+	_NNSweepPriv *priv;
+
+	memset(sw, 0, sizeof(*sw));
+	if (n_param < 1 || config->n_sample < 1 || config->min_epoch < 1 || config->max_epoch < config->min_epoch)
+		return -1;
+
+	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	sw->config = *config;
+	if (sw->config.reduction < 2)
+		sw->config.reduction = 3;
+	if (sw->config.n_thread < 1)
+		sw->config.n_thread = 1;
+	sw->priv = priv;
+	sw->n_result = n_param;
+	pthread_mutex_init(&priv->lock, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+
+	/* min_epoch, min_epoch * reduction, ... up to max_epoch */
+	priv->n_rung = 1;
+	for (budget = config->min_epoch; budget < config->max_epoch; budget *= sw->config.reduction)
+		priv->n_rung++;
+	priv->budget = malloc(priv->n_rung * sizeof(int));
+	sw->results = calloc(n_param, sizeof(*sw->results));
+	priv->running = calloc(n_param, sizeof(int));
+	if (priv->budget == NULL || sw->results == NULL || priv->running == NULL)
+	{
+		nn_sweep_destroy(sw);
+		return -1;
+	}
+	budget = config->min_epoch;
+	for (i = 0; i < priv->n_rung; i++)
+	{
+		priv->budget[i] = budget < config->max_epoch ? budget : config->max_epoch;
+		budget *= sw->config.reduction;
+	}
+
+	/* The networks are initialized from config->seed, the caller's rand() is left alone */
+	seed = config->seed;
+	old_seed = nn_set_thread_seed(&seed);
+	for (i = 0; i < n_param; i++)
+	{
+		p = &sw->results[i].param;
+		*p = params[i];
+		sw->results[i].loss = INFINITY;
+		sw->results[i].rung = -1;	/* Not started */
+		sw->results[i].nn = nn_create(config->n_input,
+				config->n_output,
+				p->n_hidden,
+				p->n_neuro_per_hidden,
+				p->use_bias,
+				p->act_func_type_hidden,
+				p->act_func_type_output);
+		if (sw->results[i].nn == NULL)
+		{
+			nn_set_thread_seed(old_seed);
+			nn_sweep_destroy(sw);
+			return -1;
+		}
+	}
+	nn_set_thread_seed(old_seed);
+
+	return 0;
+}
+
+/* Train until every configuration is done or stopped, then write the archive */
+int
+nn_sweep_run(NNSweep *sw)
+{
+	int i;
+	int j;
+	int n_started;
+	int ret;
+	_NNSweepWorker *workers;
+	_NNSweepPriv *priv = sw->priv;
+
+	workers = calloc(sw->config.n_thread, sizeof(*workers));
+	if (workers == NULL)
+		return -1;
+
+	ret = 0;
+	n_started = 0;
+	for (i = 0; i < sw->config.n_thread; i++)
+	{
+		workers[i].sw = sw;
+		workers[i].seed = sw->config.seed + i;
+		workers[i].order = malloc(sw->config.n_sample * sizeof(int));
+		if (workers[i].order == NULL)
+		{
+			ret = -1;
+			break;
+		}
+		for (j = 0; j < sw->config.n_sample; j++)
+			workers[i].order[j] = j;
+		if (pthread_create(&workers[i].thread, NULL, _nn_sweep_thread, &workers[i]))
+		{
+			free(workers[i].order);
+			ret = -1;
+			break;
+		}
+		n_started = i + 1;
+	}
+
+	for (i = 0; i < n_started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].order);
+	}
+	free(workers);
+
+	if (n_started == 0 || priv->failed)
+		return -1;
+
+	for (i = 0; i < sw->n_result; i++)
+		sw->results[i].stopped = sw->results[i].rung < priv->n_rung - 1;
+
+	if (sw->config.archive_file && _nn_sweep_write_archive(sw) < 0)
+		return -1;
+
+	return ret;
+}
+
+/* Index of the configuration with the lowest loss among the ones trained to max_epoch */
+int
+nn_sweep_get_best(NNSweep *sw)
+{
+	int i;
+	int best;
+
+	best = -1;
+	for (i = 0; i < sw->n_result; i++)
+	{
+		if (sw->results[i].stopped)
+			continue;
+		if (best < 0 || sw->results[i].loss < sw->results[best].loss)
+			best = i;
+	}
+
+	return best;
+}
+
+void
+nn_sweep_destroy(NNSweep *sw)
+{
+	int i;
+	_NNSweepPriv *priv = sw->priv;
+
+	if (sw->results)
+	{
+		for (i = 0; i < sw->n_result; i++)
+		{
+			if (sw->results[i].nn)
+				nn_free(sw->results[i].nn);
+		}
+		free(sw->results);
+	}
+	if (priv)
+	{
+		pthread_mutex_destroy(&priv->lock);
+		pthread_cond_destroy(&priv->cond);
+		free(priv->budget);
+		free(priv->running);
+		free(priv);
+	}
+	memset(sw, 0, sizeof(*sw));
+}
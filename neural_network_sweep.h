@@ -0,0 +1,63 @@
+#ifndef __NEURAL_NETWORK_SWEEP_H
+#define __NEURAL_NETWORK_SWEEP_H
+
+#include "neural_network.h"
+
+/* One configuration to try */
+typedef struct {
+	float rate;
+	int n_hidden;
+	int n_neuro_per_hidden;
+	int use_bias;
+	ACT_FUNC_TYPE act_func_type_hidden;
+	ACT_FUNC_TYPE act_func_type_output;
+} NNSweepParam;
+
+/*
+ * The dataset is shared read-only by every thread.
+ * Configurations are trained by asynchronous successive halving: every configuration gets
+ * min_epoch epochs, and at every rung only the best 1 / reduction of the ones that reached it
+ * get reduction times as many, up to max_epoch.
+ */
+typedef struct {
+	const float *inputs;		/* n_sample rows of n_input */
+	const float *expects;		/* n_sample rows of n_output */
+	int n_sample;
+	int n_input;
+	int n_output;
+	const float *valid_inputs;	/* Validation set, NULL to validate on the training set */
+	const float *valid_expects;
+	int n_valid;
+	int n_thread;
+	int min_epoch;
+	int max_epoch;
+	int reduction;
+	unsigned int seed;		/* Of the initial weight and the shuffles, rand() isn't used */
+	const char *archive_file;	/* Every network is appended here with its index as the tag, NULL for none */
+} NNSweepConfig;
+
+typedef struct {
+	NNSweepParam param;
+	NeuralNetwork *nn;
+	int epoch;		/* Epochs trained */
+	int rung;		/* Highest rung reached, -1 if never trained */
+	float loss;		/* Mean squared error on the validation set after the last rung */
+	int stopped;		/* Set if it was not promoted to max_epoch */
+} NNSweepResult;
+
+typedef struct {
+	NNSweepConfig config;
+	int n_result;
+	NNSweepResult *results;
+	void *priv;
+} NNSweep;
+
+int nn_sweep_init(NNSweep *sw, const NNSweepConfig *config, const NNSweepParam *params, int n_param);
+
+int nn_sweep_run(NNSweep *sw);
+
+int nn_sweep_get_best(NNSweep *sw);
+
+void nn_sweep_destroy(NNSweep *sw);
+
+#endif /* __NEURAL_NETWORK_SWEEP_H */
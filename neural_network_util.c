@@ -1,4 +1,46 @@
 #include "neural_network_util.h"
+#include "neural_network_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* So many latest events are kept for the trace */
+#define NN_PROF_MAX_EVENT 4096
+
+typedef struct {
+	int layer;
+	int phase;
+	unsigned long long start;
+	unsigned long long duration;
+} _NNProfEvent;
+
+/* Allocated at once, followed by the layers and the events */
+typedef struct {
+	int n_layer;
+	unsigned long long epoch;	/* Trace timestamps are from here */
+	long n_event;
+	NNLayerProfile *layers;
+	_NNProfEvent *events;
+} _NNProf;
+
+static const char *nn_prof_phase_name[NN_PROFILE_N_PHASE] = {
+	"forward",
+	"backward",
+	"update",
+};
+
+/* Read the hardware counters around every layer, they're opened for each thread on its first use */
+static int nn_prof_use_counters;
+static _Thread_local NNPerfCounters nn_prof_counters;
+static _Thread_local int nn_prof_counters_opened;
+static _Thread_local unsigned int nn_prof_counters_missing;
+
+static _NNProf *nn_prof_get(NeuralNetwork *nn);
+
+static NNPerfCounters *nn_prof_thread_counters(void);
+
+static unsigned int nn_prof_missing(NNLayerProfile *prof, int phase);
+static void nn_prof_dump_derived(FILE *f, NNLayerProfile *prof, int phase);
 
 static int nn_compute_vector_pos(NeuralNetwork *nn, int layer, int *n)
 {
@@ -23,6 +65,131 @@ static int nn_compute_vector_pos(NeuralNetwork *nn, int layer, int *n)
 	return pos;
 }
 
+static _NNProf *
+nn_prof_get(NeuralNetwork *nn)
+{
+	int n_layer;
+	_NNProf *prof;
+
+	if (nn->_prof)
+		return nn->_prof;
+
+	n_layer = nn->n_hidden + 1;
+	prof = calloc(1, sizeof(*prof) +
+			n_layer * sizeof(*prof->layers) +
+			NN_PROF_MAX_EVENT * sizeof(*prof->events));
+	if (prof == NULL)
+		return NULL;
+
+	prof->n_layer = n_layer;
+	prof->epoch = _nn_prof_now();
+	prof->layers = (NNLayerProfile *)(prof + 1);
+	prof->events = (_NNProfEvent *)(prof->layers + n_layer);
+	nn->_prof = prof;
+
+	return prof;
+}
+
+static NNPerfCounters *
+nn_prof_thread_counters(void)
+{
+	int i;
+
+	if (!nn_prof_counters_opened)
+	{
+		nn_perf_open(&nn_prof_counters);
+		for (i = 0; i < NN_PERF_N_COUNTER; i++)
+		{
+			if (!nn_perf_available(&nn_prof_counters, i))
+				nn_prof_counters_missing |= 1u << i;
+		}
+		nn_prof_counters_opened = 1;
+	}
+
+	return &nn_prof_counters;
+}
+
+/* Counters missing for phase, all of them if it was never recorded with the counters on */
+static unsigned int
+nn_prof_missing(NNLayerProfile *prof, int phase)
+{
+	if (prof->counter_calls[phase] == 0)
+		return ~0u;
+	return prof->counter_missing[phase];
+}
+
+/* IPC and bytes per FLOP, null if the counters needed are missing */
+static void
+nn_prof_dump_derived(FILE *f, NNLayerProfile *prof, int phase)
+{
+	double *counter = prof->counter[phase];
+	unsigned int missing = nn_prof_missing(prof, phase);
+
+	if (!(missing & (1u << NN_PERF_CYCLES | 1u << NN_PERF_INSTRUCTIONS)) &&
+		counter[NN_PERF_CYCLES] > 0)
+		fprintf(f, ", \"ipc\": %.3f", counter[NN_PERF_INSTRUCTIONS] / counter[NN_PERF_CYCLES]);
+	else
+		fprintf(f, ", \"ipc\": null");
+
+	if (!(missing & 1u << NN_PERF_LLC_MISSES) &&
+		prof->flop[phase] > 0)
+		fprintf(f, ", \"bytes_per_flop\": %.4f", counter[NN_PERF_LLC_MISSES] * NN_PERF_CACHE_LINE / prof->flop[phase]);
+	else
+		fprintf(f, ", \"bytes_per_flop\": null");
+}
+
+unsigned long long
+_nn_prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+_nn_prof_begin(_NNProfStamp *stamp)
+{
+	if (nn_prof_use_counters)
+		nn_perf_read(nn_prof_thread_counters(), stamp->counter);
+	stamp->ns = _nn_prof_now();
+}
+
+void
+_nn_prof_record(NeuralNetwork *nn, int layer, int phase, _NNProfStamp *start, double flop)
+{
+	int i;
+	unsigned long long now;
+	unsigned long long counter[NN_PERF_N_COUNTER];
+	_NNProf *prof;
+	_NNProfEvent *ev;
+
+	now = _nn_prof_now();
+	if (nn_prof_use_counters)
+		nn_perf_read(nn_prof_thread_counters(), counter);
+
+	prof = nn_prof_get(nn);
+	if (prof == NULL)
+		return;
+
+	prof->layers[layer].n_call[phase]++;
+	prof->layers[layer].ns[phase] += now - start->ns;
+	prof->layers[layer].flop[phase] += flop;
+	if (nn_prof_use_counters)
+	{
+		for (i = 0; i < NN_PERF_N_COUNTER; i++)
+			prof->layers[layer].counter[phase][i] += counter[i] - start->counter[i];
+		prof->layers[layer].counter_calls[phase]++;
+		prof->layers[layer].counter_missing[phase] |= nn_prof_counters_missing;
+	}
+
+	ev = &prof->events[prof->n_event++ % NN_PROF_MAX_EVENT];
+	ev->layer = layer;
+	ev->phase = phase;
+	ev->start = start->ns;
+	ev->duration = now - start->ns;
+}
+
 const float *
 nn_util_get_w_matrix(NeuralNetwork *nn, int layer, int *n_row, int *n_col)
 {
@@ -144,17 +311,218 @@ nn_util_vector_print(const float *vector, int n)
 	putchar('\n');
 }
 
-/* For utilitiy */
+/* For profiling */
+int
+nn_util_profile_enabled(void)
+{
+#ifdef NN_PROFILE
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Also read the hardware counters around every layer, which costs a few system calls each.
+ * Return how many counters are available to the calling thread, 0 if none (or not built with NN_PROFILE).
+ */
+int
+nn_util_profile_use_counters(int enable)
+{
+	int i;
+	int n;
+	NNPerfCounters *pc;
+
+	if (!nn_util_profile_enabled())
+		return 0;
+
+	nn_prof_use_counters = enable;
+	if (!enable)
+		return 0;
+
+	pc = nn_prof_thread_counters();
+	n = 0;
+	for (i = 0; i < NN_PERF_N_COUNTER; i++)
+		n += nn_perf_available(pc, i);
+
+	return n;
+}
+
+/* Layer 0 is the first hidden layer (or the output layer if there is none) like nn_util_get_w_matrix() */
+int
+nn_util_profile_get(NeuralNetwork *nn, int layer, NNLayerProfile *prof)
+{
+	_NNProf *p;
+
+	if (layer > nn->n_hidden ||
+		layer < 0)
+		return -1;
+
+	memset(prof, 0, sizeof(*prof));
+	p = nn->_prof;
+	if (p == NULL)
+		return nn_util_profile_enabled() ? 0 : -1;
+
+	*prof = p->layers[layer];
+	return 0;
+}
+
+void
+nn_util_profile_reset(NeuralNetwork *nn)
+{
+	_NNProf *p = nn->_prof;
+
+	if (p == NULL)
+		return;
+
+	memset(p->layers, 0, p->n_layer * sizeof(*p->layers));
+	p->n_event = 0;
+	p->epoch = _nn_prof_now();
+}
+
+int
+nn_util_profile_dump_json(NeuralNetwork *nn, FILE *f)
+{
+	int i;
+	int j;
+	int k;
+	NNLayerProfile prof;
+
+	if (!nn_util_profile_enabled())
+		return -1;
+
+	fprintf(f, "{\"layers\": [");
+	for (i = 0; i <= nn->n_hidden; i++)
+	{
+		nn_util_profile_get(nn, i, &prof);
+		fprintf(f, "%s\n  {\"layer\": %d", i ? "," : "", i);
+		for (j = 0; j < NN_PROFILE_N_PHASE; j++)
+		{
+			fprintf(f, ", \"%s\": {\"calls\": %ld, \"ns\": %.0f, \"flop\": %.0f, \"gflops\": %.3f",
+					nn_prof_phase_name[j],
+					prof.n_call[j],
+					prof.ns[j],
+					prof.flop[j],
+					prof.ns[j] > 0 ? prof.flop[j] / prof.ns[j] : 0);
+			if (nn_prof_use_counters)
+			{
+				for (k = 0; k < NN_PERF_N_COUNTER; k++)
+				{
+					if (nn_prof_missing(&prof, j) & 1u << k)
+						fprintf(f, ", \"%s\": null", nn_perf_counter_name(k));
+					else
+						fprintf(f, ", \"%s\": %.0f", nn_perf_counter_name(k), prof.counter[j][k]);
+				}
+				nn_prof_dump_derived(f, &prof, j);
+			}
+			fprintf(f, "}");
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* The latest events in Chrome trace event format, open it with chrome://tracing or Perfetto */
+int
+nn_util_profile_dump_trace(NeuralNetwork *nn, FILE *f)
+{
+	long i;
+	long first;
+	_NNProf *p = nn->_prof;
+	_NNProfEvent *ev;
+
+	if (!nn_util_profile_enabled())
+		return -1;
+
+	fprintf(f, "{\"traceEvents\": [");
+	if (p)
+	{
+		first = p->n_event > NN_PROF_MAX_EVENT ? p->n_event - NN_PROF_MAX_EVENT : 0;
+		for (i = first; i < p->n_event; i++)
+		{
+			ev = &p->events[i % NN_PROF_MAX_EVENT];
+			fprintf(f, "%s\n{\"name\": \"%s\", \"cat\": \"layer %d\", \"ph\": \"X\", "
+					"\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"layer\": %d}}",
+					i == first ? "" : ",",
+					nn_prof_phase_name[ev->phase],
+					ev->layer,
+					(ev->start - p->epoch) / 1000.0,
+					ev->duration / 1000.0,
+					ev->layer,
+					ev->layer);
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * For utilitiy
+ * Index of the largest output, the first one if several are the same.
+ * 4 columns are compared at a time with their own running max, so the comparisons
+ * don't wait for each other and can be done in vector registers.
+ */
 int
 nn_util_find_most_possible(const float *output, int n)
 {
 	int i;
+	int i0, i1, i2, i3;
+	float o0, o1, o2, o3;
 	int i_max;
 	float o_max;
 
 	i_max = 0;
 	o_max = output[0];
-	for (i = 1; i < n; i++)
+	if (n >= 8)
+	{
+		i0 = 0;
+		i1 = 1;
+		i2 = 2;
+		i3 = 3;
+		o0 = output[0];
+		o1 = output[1];
+		o2 = output[2];
+		o3 = output[3];
+		for (i = 4; i + 4 <= n; i += 4)
+		{
+			i0 = output[i + 0] > o0 ? i + 0 : i0;
+			o0 = output[i + 0] > o0 ? output[i + 0] : o0;
+			i1 = output[i + 1] > o1 ? i + 1 : i1;
+			o1 = output[i + 1] > o1 ? output[i + 1] : o1;
+			i2 = output[i + 2] > o2 ? i + 2 : i2;
+			o2 = output[i + 2] > o2 ? output[i + 2] : o2;
+			i3 = output[i + 3] > o3 ? i + 3 : i3;
+			o3 = output[i + 3] > o3 ? output[i + 3] : o3;
+		}
+
+		/* Merge the 4 columns, the smaller index wins a tie */
+		i_max = i0;
+		o_max = o0;
+		if (o1 > o_max || (o1 == o_max && i1 < i_max))
+		{
+			i_max = i1;
+			o_max = o1;
+		}
+		if (o2 > o_max || (o2 == o_max && i2 < i_max))
+		{
+			i_max = i2;
+			o_max = o2;
+		}
+		if (o3 > o_max || (o3 == o_max && i3 < i_max))
+		{
+			i_max = i3;
+			o_max = o3;
+		}
+	}
+	else
+	{
+		i = 1;
+	}
+
+	for (; i < n; i++)
 	{
 		if (o_max < output[i])
 		{
@@ -165,3 +533,125 @@ nn_util_find_most_possible(const float *output, int n)
 
 	return i_max;
 }
+
+/* outputs is n_row rows of n_col, index gets the largest of every row */
+void
+nn_util_find_most_possible_batch(const float *outputs, int n_row, int n_col, int *index)
+{
+	int b;
+
+	for (b = 0; b < n_row; b++)
+		index[b] = nn_util_find_most_possible(&outputs[(long)b * n_col], n_col);
+}
+
+/*
+ * Indexes of the k largest outputs from the largest, the first ones if several are the same,
+ * and their outputs in score if not NULL.
+ * Return the number found, which is k unless n is smaller.
+ */
+int
+nn_util_top_k(const float *output, int n, int k, int *index, float *score)
+{
+	int i;
+	int p;
+	int n_kept;
+
+	if (k > n)
+		k = n;
+	if (k <= 0)
+		return 0;
+	if (k == 1)
+	{
+		index[0] = nn_util_find_most_possible(output, n);
+		if (score)
+			score[0] = output[index[0]];
+		return 1;
+	}
+
+	n_kept = 0;
+	for (i = 0; i < n; i++)
+	{
+		/* Most outputs are not better than the k-th and stop here */
+		if (n_kept == k && !(output[i] > output[index[k - 1]]))
+			continue;
+
+		p = n_kept < k ? n_kept++ : k - 1;
+		for (; p > 0 && output[i] > output[index[p - 1]]; p--)
+			index[p] = index[p - 1];
+		index[p] = i;
+	}
+
+	if (score)
+	{
+		for (p = 0; p < k; p++)
+			score[p] = output[index[p]];
+	}
+
+	return k;
+}
+
+/* As nn_util_top_k() on every row, index and score are n_row rows of k */
+int
+nn_util_top_k_batch(const float *outputs, int n_row, int n_col, int k, int *index, float *score)
+{
+	int b;
+	int n;
+
+	n = 0;
+	for (b = 0; b < n_row; b++)
+	{
+		n = nn_util_top_k(&outputs[(long)b * n_col],
+				n_col,
+				k,
+				&index[(long)b * k],
+				score ? &score[(long)b * k] : NULL);
+	}
+
+	return n;
+}
+
+/*
+ * mask is n_row rows of (n_col + 63) / 64 words, the bit j % 64 of the word j / 64 is set
+ * if the j-th output is >= threshold, the same layout as nn_run_binary() takes.
+ * Return the number of bits set.
+ */
+long
+nn_util_threshold_batch(const float *outputs, int n_row, int n_col, float threshold, uint64_t *mask)
+{
+	int b;
+	int i;
+	int j;
+	int n_word;
+	int n_bit;
+	uint64_t word;
+	const float *row;
+	long count;
+
+	n_word = (n_col + 63) / 64;
+	count = 0;
+	for (b = 0; b < n_row; b++)
+	{
+		row = &outputs[(long)b * n_col];
+		for (i = 0; i < n_word; i++)
+		{
+			n_bit = n_col - i * 64 < 64 ? n_col - i * 64 : 64;
+			word = 0;
+			for (j = 0; j < n_bit; j++)
+				word |= (uint64_t)(row[i * 64 + j] >= threshold) << j;
+			mask[(long)b * n_word + i] = word;
+			count += __builtin_popcountll(word);
+		}
+	}
+
+	return count;
+}
+
+/* Normalize every row in place, as the softmax output activation does */
+void
+nn_util_softmax_batch(float *outputs, int n_row, int n_col)
+{
+	int b;
+
+	for (b = 0; b < n_row; b++)
+		_nn_act_func_apply(ACT_FUNC_TYPE_SOFTMAX, &outputs[(long)b * n_col], n_col);
+}
@@ -1,7 +1,10 @@
 #ifndef __NEURAL_NETWORK_UTIL_H
 #define __NEURAL_NETWORK_UTIL_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include "neural_network.h"
+#include "neural_network_perf.h"
 
 /* For debug uses */
 const float *nn_util_get_w_matrix(NeuralNetwork *nn, int layer, int *n_row, int *n_col);
@@ -16,7 +19,49 @@ const float *nn_util_get_delta(NeuralNetwork *nn, int layer, int *n);
 
 void nn_util_vector_print(const float *vector, int n);
 
+/* For profiling, only recorded when the library is built with NN_PROFILE */
+typedef enum {
+	NN_PROFILE_FORWARD,
+	NN_PROFILE_BACKWARD,
+	NN_PROFILE_UPDATE,
+	NN_PROFILE_N_PHASE,
+} NN_PROFILE_PHASE;
+
+typedef struct {
+	long n_call[NN_PROFILE_N_PHASE];
+	double ns[NN_PROFILE_N_PHASE];
+	double flop[NN_PROFILE_N_PHASE];
+	/* Hardware counters, 0 unless enabled by nn_util_profile_use_counters() */
+	double counter[NN_PROFILE_N_PHASE][NN_PERF_N_COUNTER];
+	/* Calls recorded with the counters enabled, the counters are missing if 0 */
+	long counter_calls[NN_PROFILE_N_PHASE];
+	/* Bit i is set if counter i was not available on a thread that recorded the phase */
+	unsigned int counter_missing[NN_PROFILE_N_PHASE];
+} NNLayerProfile;
+
+int nn_util_profile_enabled(void);
+
+int nn_util_profile_use_counters(int enable);
+
+int nn_util_profile_get(NeuralNetwork *nn, int layer, NNLayerProfile *prof);
+
+void nn_util_profile_reset(NeuralNetwork *nn);
+
+int nn_util_profile_dump_json(NeuralNetwork *nn, FILE *f);
+
+int nn_util_profile_dump_trace(NeuralNetwork *nn, FILE *f);
+
 /* For utilitiy */
 int nn_util_find_most_possible(const float *output, int n);
 
+void nn_util_find_most_possible_batch(const float *outputs, int n_row, int n_col, int *index);
+
+int nn_util_top_k(const float *output, int n, int k, int *index, float *score);
+
+int nn_util_top_k_batch(const float *outputs, int n_row, int n_col, int k, int *index, float *score);
+
+long nn_util_threshold_batch(const float *outputs, int n_row, int n_col, float threshold, uint64_t *mask);
+
+void nn_util_softmax_batch(float *outputs, int n_row, int n_col);
+
 #endif /* __NEURAL_NETWORK_H */